@@ -2,9 +2,45 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <utime.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#else
+#include <sys/stat.h>
+#include <sys/utime.h>
+#include <dirent.h>
+#include <windows.h>
+#define strtok_r strtok_s
+// MinGW trae dirent.h, pero no todas las versiones definen estos macros en sys/stat.h
+#ifndef S_ISDIR
+#define S_ISDIR(modo) (((modo) & S_IFMT) == S_IFDIR)
+#endif
+#ifndef S_ISREG
+#define S_ISREG(modo) (((modo) & S_IFMT) == S_IFREG)
+#endif
+#endif
+
+// Cada hilo del modo por lotes analiza con su propio estado
+#if defined(_MSC_VER)
+#define LOCAL_HILO __declspec(thread)
+#else
+#define LOCAL_HILO _Thread_local
+#endif
 
-#define MAX_FUNCIONES 50
 typedef enum {
     TIPO_INTEGER,
     TIPO_STRING,
@@ -14,35 +50,466 @@ typedef enum {
     TIPO_DESCONOCIDO
 } TipoDato;
 
+#define TAM_BLOQUE_ARENA (64 * 1024)
+
+typedef struct BloqueArena {
+    struct BloqueArena* siguiente;
+    size_t usado;
+    size_t capacidad;
+    char datos[];
+} BloqueArena;
+
 typedef struct {
-    char nombre[50];
+    BloqueArena* actual;
+} Arena;
+
+// Datos de una variable que se consultan en cada uso; el nombre y la linea van aparte
+typedef struct {
+    unsigned int hash;         // hash_nombre del nombre, se compara antes que el texto
     TipoDato tipo;
     bool inicializada;
-    int linea_declaracion;
 } Variable;
 
 typedef struct {
-    char nombre[50];
+    unsigned int hash;
     TipoDato tipo_retorno;
-    Variable parametros[20];
+    int primer_parametro;      // posicion en tabla.parametros
     int num_parametros;
     bool retorno_asignado;
-    int linea_declaracion;
     bool tiene_retorno;
 } Funcion;
 
+// Estructura de arreglos que crece a demanda: 'datos' guarda lo que se lee al buscar,
+// nombres y lineas solo se leen al informar
+typedef struct {
+    Variable* datos;
+    const char** nombres;
+    int* lineas;
+    int num;
+    int capacidad;
+} TablaVariables;
+
 typedef struct {
-    Variable variables[100];
-    int num_variables;
-    Funcion funciones[50];
-    int num_funciones;
-    char ambito_actual[50]; 
+    Funcion* datos;
+    const char** nombres;
+    int* lineas;
+    int num;
+    int capacidad;
+    int* indice;               // tabla hash abierta de posicion + 1, 0 = libre
+    int tam_indice;
+} TablaFunciones;
+
+// Un ambito por cuerpo de funcion o procedimiento; el marco 0 es el global.
+// Sus variables son las de [primera_variable, tabla.variables.num) hasta que se entra a otro
+typedef struct {
+    char nombre[50];
+    int primera_variable;
+    int* indice;               // solo con las variables del marco
+    int tam_indice;
+    int nodos_sugerencias;     // tamaño del arbol BK de variables al entrar
+    BloqueArena* bloque_nombres;  // posicion de la arena de nombres de variables al entrar
+    size_t usado_nombres;
+} Marco;
+
+// Parametros de todas las funciones; los de cada funcion quedan contiguos
+typedef struct {
+    TipoDato* tipos;
+    const char** nombres;
+    int num;
+    int capacidad;
+} ListaParametros;
+
+typedef struct {
+    TablaVariables variables;
+    TablaFunciones funciones;
+    ListaParametros parametros;
+    Marco* marcos;
+    int num_marcos;
+    int capacidad_marcos;
+    Arena nombres;             // nombres de funciones y parametros
+    Arena nombres_variables;   // se recorta al salir de cada ambito
+    unsigned long long huella; // resumen de todas las operaciones aplicadas, ver anotar_operacion
+    unsigned long long huella_declaraciones; // solo de las declaraciones, para los cuerpos en paralelo
 } TablaSimbolos;
 
-TablaSimbolos tabla;
+// Sube con cada cambio en las declaraciones visibles; los tipos memorizados de otra generacion no valen
+LOCAL_HILO unsigned int generacion_declaraciones = 1;
+
+LOCAL_HILO TablaSimbolos tabla;
+
+// Cambios a la tabla de simbolos y diagnosticos; se graban mientras se analiza un bloque
+// para poder repetirlos despues sin volver a analizarlo
+typedef enum {
+    OP_ENTRAR_AMBITO,
+    OP_NOMBRAR_AMBITO,
+    OP_SALIR_AMBITO,
+    OP_AGREGAR_VARIABLE,
+    OP_INICIALIZAR_VARIABLE,
+    OP_AGREGAR_FUNCION,
+    OP_REDECLARAR_FUNCION,
+    OP_AGREGAR_PARAMETRO,
+    OP_RETORNO_ASIGNADO,
+    OP_TIENE_RETORNO,
+    OP_REFERENCIA_PENDIENTE,
+    OP_RESOLVER_PENDIENTES,
+    OP_VERIFICAR_INICIALIZADA,
+    OP_DIAGNOSTICO
+} TipoOperacion;
+
+typedef struct {
+    TipoOperacion tipo;
+    int entero;                // TipoDato, Severidad, bandera o numero de argumentos
+    int linea;                 // al grabar se guarda relativa al inicio del bloque
+    bool bandera;
+    const char* texto;
+    const char* texto2;
+    const TipoDato* tipos;
+} Operacion;
+
+// Salida guardada en memoria: la de cada archivo del lote o la de un bloque reutilizable
+typedef struct {
+    FILE* archivo;
+    char* datos;
+    size_t tam;
+} Captura;
+
+bool abrir_captura(Captura* captura) {
+    captura->datos = NULL;
+    captura->tam = 0;
+#ifndef _WIN32
+    captura->archivo = open_memstream(&captura->datos, &captura->tam);
+#else
+    captura->archivo = tmpfile();
+#endif
+    return captura->archivo != NULL;
+}
+
+void cerrar_captura(Captura* captura) {
+#ifdef _WIN32
+    fflush(captura->archivo);
+    long tam = ftell(captura->archivo);
+    captura->datos = (char*)malloc(tam + 1);
+    rewind(captura->archivo);
+    captura->tam = fread(captura->datos, 1, tam, captura->archivo);
+#endif
+    fclose(captura->archivo);
+    captura->archivo = NULL;
+}
+
+// Nodo de un bloque guardado, en preorden
+typedef struct {
+    unsigned char tipo;        // TipoNodo
+    int profundidad;
+    int linea;                 // relativa a la primera linea del bloque
+    char* valor;
+} NodoGuardado;
+
+// Resultado de analizar un bloque var/function/procedure de nivel superior
+typedef struct {
+    unsigned long long clave;  // cabecera y huella de la tabla al entrar; 0 = casilla libre
+    unsigned long long hash_lineas;
+    int num_lineas;            // lineas de la fuente que consumio, cabecera incluida
+    int avance_linea;          // cuanto avanzo num_linea
+    int num_errores;
+    char* salida;
+    size_t tam_salida;
+    NodoGuardado* nodos;
+    int num_nodos;
+    Operacion* operaciones;
+    int num_operaciones;
+} BloqueGuardado;
+
+typedef struct {
+    BloqueGuardado* bloques;   // tabla hash abierta por clave
+    int capacidad;
+    int num_bloques;
+    Operacion* diario;         // operaciones del bloque que se esta grabando
+    int num_diario;
+    int capacidad_diario;
+    bool grabando;
+    int base_linea;
+    int dentro_de_operacion;
+    Captura captura;
+    FILE* salida_anterior;
+    int reutilizados;
+    int analizados;
+} CacheBloques;
+
+// Solo se activa en los modos que vuelven a analizar el mismo archivo
+bool cache_bloques_activo = false;
+LOCAL_HILO CacheBloques cache_bloques;
+
+// Revisa los cuerpos de funciones y procedimientos en hilos_cuerpos hilos (--paralelo y -j)
+bool cuerpos_en_paralelo = false;
+int hilos_cuerpos = 0;
+
+// Dato que escribe el cuerpo de otra funcion y que un trabajador leyo; al unir los resultados
+// se compara con la tabla real y, si no coincide, el bloque se vuelve a analizar
+typedef enum {
+    LECTURA_TIENE_RETORNO,
+    LECTURA_RETORNO_ASIGNADO
+} TipoLectura;
+
+typedef struct {
+    TipoLectura tipo;
+    bool valor;
+    char* nombre;
+} Lectura;
+
+// Bloque var/function/procedure de nivel superior encontrado en la pasada de cabeceras
+typedef struct {
+    int linea;                 // linea de la cabecera en la fuente
+    bool es_var;
+    char nombre[50];           // funcion que declara; vacio en los demas bloques
+    int primera_cabecera;      // su primera operacion en el diario de cabeceras
+    int trabajador;            // hilo que lo revisa; -1 si ninguno
+    bool listo;
+    bool valido;
+    unsigned long long huella_declaraciones; // de la tabla del trabajador al empezar el bloque
+    BloqueGuardado resultado;
+    Lectura* lecturas;
+    int num_lecturas;
+    int capacidad_lecturas;
+} CuerpoParalelo;
+
+// En un trabajador, el bloque que se esta revisando y el numero del trabajador
+LOCAL_HILO int cuerpo_en_curso = -1;
+LOCAL_HILO int trabajador_actual = -1;
+
+// Arbol BK para sugerir la palabra mas parecida; los hijos de cada nodo forman una lista
+typedef struct {
+    int id;            // posicion de la palabra en su tabla de origen
+    int distancia;     // distancia de edicion al padre
+    int padre;
+    int primer_hijo;
+    int siguiente;
+} NodoBK;
+
+typedef struct {
+    NodoBK* nodos;
+    int num_nodos;
+    int capacidad;
+    int longitud_minima;
+    int longitud_maxima;
+    const char* (*texto)(int id);
+} ArbolBK;
+
+const char* texto_palabra_clave(int id);
+const char* texto_variable(int id);
+const char* texto_funcion(int id);
+
+// Las palabras clave no cambian: se construye una vez en main y luego solo se lee
+ArbolBK arbol_palabras_clave = {.texto = texto_palabra_clave};
+LOCAL_HILO ArbolBK arbol_variables = {.texto = texto_variable};
+LOCAL_HILO ArbolBK arbol_funciones = {.texto = texto_funcion};
+
+// Llamada a una funcion que aun no se ha declarado; se verifica al aparecer la declaracion
+typedef struct {
+    char nombre[50];
+    char* llamada;
+    int num_argumentos;
+    TipoDato* tipos_argumentos;
+    int num_linea;
+    bool requiere_retorno;
+} ReferenciaPendiente;
+
+typedef struct {
+    ReferenciaPendiente* referencias;
+    int num_referencias;
+    int capacidad;
+} ListaPendientes;
+
+LOCAL_HILO ListaPendientes pendientes;
+
+// Destino de la salida del analisis; en modo por lotes cada archivo escribe en memoria
+LOCAL_HILO FILE* salida;
+LOCAL_HILO FILE* salida_errores;
+// Punto de retorno cuando un error detiene el analisis del archivo actual
+LOCAL_HILO jmp_buf* salida_analisis;
+
+// Memoria de trabajo que los analizadores tienen en uso. El salto a salida_analisis pasa por
+// encima de sus free, asi que quien lo recibe libera lo que siga anotado
+typedef struct {
+    void* memoria;
+    bool es_partes;            // resultado de split o split_function
+} Reserva;
+
+typedef struct {
+    Reserva* reservas;
+    int num_reservas;
+    int capacidad;
+} ListaReservas;
+
+LOCAL_HILO ListaReservas reservas_en_uso;
+
+typedef enum {
+    SEVERIDAD_ERROR,
+    SEVERIDAD_ADVERTENCIA,
+    SEVERIDAD_NOTA
+} Severidad;
+
+typedef struct {
+    Severidad severidad;
+    int linea;
+    char* mensaje;
+    char* detalle;
+    bool con_tipos;
+    TipoDato tipos[2];         // esperado y encontrado, en los errores de tipos
+} Diagnostico;
+
+// Errores y advertencias del archivo actual; se imprimen juntos al terminar
+typedef struct {
+    Diagnostico* diagnosticos;
+    int num_diagnosticos;
+    int capacidad;
+    int num_errores;
+} ListaDiagnosticos;
+
+LOCAL_HILO ListaDiagnosticos diagnosticos;
+
+// Duracion de cada fase del ultimo archivo analizado, en segundos
+typedef struct {
+    double carga;
+    double analisis;
+    double salida;
+} TiemposFases;
+
+LOCAL_HILO TiemposFases tiempos_fases;
+
+// Metricas (--metricas): tiempo por fase y contadores de actividad. Cada hilo las lleva en
+// metricas_hilo sin sincronizar y las suma a metricas_totales al terminar
+typedef enum {
+    FASE_CARGA,
+    FASE_PREESCANEO,           // cabeceras antes de los cuerpos en paralelo
+    FASE_VARIABLES,            // secciones var de nivel superior
+    FASE_CUERPOS,              // funciones y procedimientos
+    FASE_PRINCIPAL,            // el resto del programa
+    FASE_DIAGNOSTICOS,
+    FASE_ARBOL,
+    NUM_FASES,
+    FASE_NINGUNA               // fuera de cualquier fase; no se mide
+} FaseAnalisis;
+
+const char* nombres_fase[] = {"carga", "preescaneo", "variables", "cuerpos", "principal", "diagnosticos", "arbol"};
+
+typedef enum {
+    CONTADOR_LINEAS,
+    CONTADOR_TOKENS,
+    CONTADOR_NODOS,
+    CONTADOR_BUSQUEDAS,        // en la tabla de simbolos
+    CONTADOR_SONDEOS,          // casillas ocupadas visitadas en las tablas hash
+    CONTADOR_DIVISIONES,       // llamadas a split y split_function
+    CONTADOR_RESERVAS_SPLIT,   // arreglos y copias que reservan
+    CONTADOR_DIAGNOSTICOS,
+    NUM_CONTADORES
+} ContadorAnalisis;
+
+const char* nombres_contador[] = {"lineas", "tokens", "nodos", "busquedas", "sondeos", "divisiones",
+                                  "reservas_split", "diagnosticos"};
+
+typedef struct {
+    double tiempos[NUM_FASES];
+    long long contadores[NUM_CONTADORES];
+} Metricas;
+
+LOCAL_HILO Metricas metricas_hilo;
+LOCAL_HILO FaseAnalisis fase_en_curso = FASE_NINGUNA;
+LOCAL_HILO double inicio_fase;
+Metricas metricas_totales;
+#ifndef _WIN32
+pthread_mutex_t mutex_metricas = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define CONTAR(contador, n) (metricas_hilo.contadores[contador] += (n))
 
+// Formato del informe de metricas al terminar
+typedef enum {
+    METRICAS_NINGUNO,
+    METRICAS_TEXTO,
+    METRICAS_JSON
+} FormatoMetricas;
+
+FormatoMetricas formato_metricas = METRICAS_NINGUNO;
+// Maximo de errores por archivo antes de detener el analisis; 0 no pone limite
+int max_errores = 20;
+// Cambia con cada version que altere la salida, asi la cache en disco no sirve resultados viejos
+#define VERSION_ANALIZADOR "1.20.6"
+
+// Formato de los diagnosticos (--formato): texto, un objeto JSON por linea o un documento SARIF
+typedef enum {
+    FORMATO_TEXTO,
+    FORMATO_JSONL,
+    FORMATO_SARIF
+} FormatoDiagnosticos;
+
+FormatoDiagnosticos formato_diagnosticos = FORMATO_TEXTO;
+
+// Formato del arbol impreso (--arbol): texto indentado, Graphviz DOT o expresiones S
+typedef enum {
+    ARBOL_TEXTO,
+    ARBOL_DOT,
+    ARBOL_SEXP
+} FormatoArbol;
+
+FormatoArbol formato_arbol = ARBOL_TEXTO;
+// El servidor responde solo con los diagnosticos
+bool omitir_arbol = false;
+
+// Trazas de depuracion por subsistema (--traza). Los niveles por encima de TRAZA_NIVEL_MAXIMO
+// no se compilan (-DTRAZA_NIVEL_MAXIMO=0 las quita todas); los demas solo se formatean si
+// el subsistema los pidio al ejecutar, y van a un buffer por hilo que se vacia por archivo
+typedef enum {
+    TRAZA_DECLARACIONES,
+    TRAZA_LLAMADAS,
+    TRAZA_ASIGNACIONES,
+    TRAZA_CONTROL,
+    TRAZA_WRITELN,
+    NUM_SUBSISTEMAS_TRAZA
+} SubsistemaTraza;
+
+#define TRAZA_INFO 1
+#define TRAZA_DETALLE 2
+#ifndef TRAZA_NIVEL_MAXIMO
+#define TRAZA_NIVEL_MAXIMO TRAZA_DETALLE
+#endif
+
+const char* nombres_subsistema_traza[] = {"declaraciones", "llamadas", "asignaciones", "control", "writeln"};
+// Se fija en main antes de crear hilos; 0 apaga el subsistema
+int niveles_traza[NUM_SUBSISTEMAS_TRAZA];
+
+void trazar(SubsistemaTraza subsistema, const char* formato, ...);
+
+#define TRAZA_ACTIVA(subsistema, nivel) ((nivel) <= TRAZA_NIVEL_MAXIMO && (nivel) <= niveles_traza[subsistema])
+#define TRAZA(subsistema, nivel, ...) \
+    do { \
+        if (TRAZA_ACTIVA(subsistema, nivel)) { \
+            trazar(subsistema, __VA_ARGS__); \
+        } \
+    } while (0)
+// Cache de resultados en disco (--cache); NULL la desactiva
+const char* directorio_cache = NULL;
+long long tam_maximo_cache = 256LL << 20;
+// Arbol binario (--arbol-binario): el archivo de salida o, en el modo por lotes, el directorio
+// donde se escribe uno por archivo; NULL no lo escribe
+const char* ruta_arbol_binario = NULL;
+bool arbol_binario_por_archivo = false;
+
+TipoDato reconocer_tipo(const char* p, int len);
 TipoDato obtener_tipo_desde_string(const char* tipo_str);
 void inicializar_tabla_simbolos();
+void liberar_tabla_simbolos();
+int distancia_edicion(const char* a, int la, const char* b, int lb);
+void bk_insertar(ArbolBK* arbol, int id);
+int bk_buscar(const ArbolBK* arbol, const char* palabra, int max_distancia, int* distancia);
+void bk_vaciar(ArbolBK* arbol);
+void bk_recortar(ArbolBK* arbol, int num_nodos);
+void entrar_ambito(const char* nombre);
+void salir_ambito();
+Marco* ambito_actual();
+void arena_restaurar(Arena* arena, BloqueArena* bloque, size_t usado);
+void bk_liberar(ArbolBK* arbol);
+int distancia_maxima_sugerencia(int longitud);
+const char* sugerir_simbolo(const char* nombre, bool variables, bool funciones);
 void agregar_variable(const char* nombre, TipoDato tipo, int linea);
 void agregar_funcion(const char* nombre, TipoDato tipo_retorno, int linea);
 void agregar_parametro_funcion(const char* nombre_funcion, const char* nombre_param, TipoDato tipo);
@@ -51,150 +518,611 @@ bool funcion_existe(const char* nombre);
 Variable* buscar_variable(const char* nombre);
 Funcion* buscar_funcion(const char* nombre);
 void marcar_variable_inicializada(const char* nombre);
+void verificar_inicializada(const char* nombre, int linea);
 void marcar_funcion_con_retorno(const char* nombre);
 bool verificar_tipos_compatibles(TipoDato tipo1, TipoDato tipo2);
 TipoDato inferir_tipo_expresion(const char* expr);
-void analizar_llamada_funcion(const char* nombre_funcion, const char* argumentos, int num_linea);
+bool analizar_llamada_funcion(const char* nombre_funcion, const char* llamada, int num_linea, bool requiere_retorno);
+bool verificar_argumentos(const Funcion* func, const char* nombre_funcion, int num_args, const TipoDato* tipos, const char* llamada, int num_linea);
+void resolver_referencias_pendientes(const char* nombre_funcion);
+void mostrar_advertencia(const char* mensaje, int linea);
+void reportar_referencias_pendientes();
+void liberar_referencias_pendientes();
+unsigned long long hash64(unsigned long long hash, const void* datos, size_t tam);
+unsigned long long hash64_texto(unsigned long long hash, const char* texto);
+void anotar_operacion(TipoOperacion tipo, int entero, int linea, bool bandera, const char* texto, const char* texto2, const TipoDato* tipos);
+void nombrar_ambito(const char* nombre);
+void redeclarar_funcion(const char* nombre, TipoDato tipo_retorno, int linea);
+void fijar_tiene_retorno(const char* nombre, bool tiene_retorno);
+bool leer_tiene_retorno(Funcion* func);
+bool leer_retorno_asignado(Funcion* func);
 char* extraer_argumentos_funcion(const char* str);
 bool es_llamada_funcion(const char* expr);
 void procesar_llamada_funcion(const char* expr, int num_linea);
 void toLowerCase(char *str);
+unsigned int hash_nombre(const char* nombre);
+int buscar_en_indice(const int* indice, int tam, const char* nombre, bool es_funcion);
+void insertar_en_indice(int** indice, int* tam, const char* nombre, int posicion, int primera, bool es_funcion);
+void* crecer_arreglo(void* arreglo, int capacidad, size_t tam_elemento);
+const char* guardar_nombre(Arena* arena, const char* nombre);
+void* arena_reservar(Arena* arena, size_t tam);
+void arena_liberar(Arena* arena);
+void abortar_analisis();
+
+// Reconoce un nombre de tipo (en minusculas) mirando solo longitud y primera letra
+TipoDato reconocer_tipo(const char* p, int len) {
+    switch (len) {
+        case 4:
+            if (p[0] == 'r' && memcmp(p, "real", 4) == 0) return TIPO_REAL;
+            if (p[0] == 'c' && memcmp(p, "char", 4) == 0) return TIPO_CHAR;
+            break;
+        case 6:
+            if (p[0] == 's' && memcmp(p, "string", 6) == 0) return TIPO_STRING;
+            break;
+        case 7:
+            if (p[0] == 'i' && memcmp(p, "integer", 7) == 0) return TIPO_INTEGER;
+            if (p[0] == 'b' && memcmp(p, "boolean", 7) == 0) return TIPO_BOOLEAN;
+            break;
+    }
+    return TIPO_DESCONOCIDO;
+}
 
 TipoDato obtener_tipo_desde_string(const char* tipo_str) {
-    if (strcmp(tipo_str, "integer") == 0) return TIPO_INTEGER;
-    if (strcmp(tipo_str, "string") == 0) return TIPO_STRING;
-    if (strcmp(tipo_str, "real") == 0) return TIPO_REAL;
-    if (strcmp(tipo_str, "boolean") == 0) return TIPO_BOOLEAN;
-    if (strcmp(tipo_str, "char") == 0) return TIPO_CHAR;
-    return TIPO_DESCONOCIDO;
+    return reconocer_tipo(tipo_str, strlen(tipo_str));
+}
+
+// FNV-1a de 64 bits encadenable
+unsigned long long hash64(unsigned long long hash, const void* datos, size_t tam) {
+    const unsigned char* p = (const unsigned char*)datos;
+    for (size_t i = 0; i < tam; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+unsigned long long hash64_texto(unsigned long long hash, const char* texto) {
+    if (texto == NULL) {
+        unsigned char nulo = 0xff;
+        return hash64(hash, &nulo, 1);
+    }
+    return hash64(hash, texto, strlen(texto) + 1);
+}
+
+// Mezcla la operacion en la huella de la tabla y, si se graba un bloque, la copia al diario.
+// Los diagnosticos y las lineas de los simbolos no entran en la huella: no cambian lo que se
+// analiza despues, asi que editarlos o mover un bloque no invalida los bloques siguientes.
+// Con los cuerpos en paralelo las declaraciones se resumen ademas en huella_declaraciones
+void anotar_operacion(TipoOperacion tipo, int entero, int linea, bool bandera, const char* texto, const char* texto2, const TipoDato* tipos) {
+    if (!cache_bloques_activo && !cuerpos_en_paralelo) {
+        return;
+    }
+    if (cuerpos_en_paralelo && (tipo == OP_AGREGAR_VARIABLE || tipo == OP_AGREGAR_FUNCION ||
+                                tipo == OP_REDECLARAR_FUNCION || tipo == OP_AGREGAR_PARAMETRO)) {
+        unsigned long long h = hash64(tabla.huella_declaraciones ? tabla.huella_declaraciones : 14695981039346656037ull, &tipo, sizeof(tipo));
+        h = hash64(h, &entero, sizeof(entero));
+        h = hash64_texto(h, texto);
+        tabla.huella_declaraciones = hash64_texto(h, texto2);
+    }
+    if (cache_bloques_activo && tipo != OP_DIAGNOSTICO && tipo != OP_VERIFICAR_INICIALIZADA) {
+        unsigned long long h = hash64(tabla.huella ? tabla.huella : 14695981039346656037ull, &tipo, sizeof(tipo));
+        h = hash64(h, &entero, sizeof(entero));
+        h = hash64(h, &bandera, sizeof(bandera));
+        h = hash64_texto(h, texto);
+        h = hash64_texto(h, texto2);
+        if (tipo == OP_REFERENCIA_PENDIENTE) {
+            // La linea de la llamada aparece en los errores que da su resolucion
+            h = hash64(h, &linea, sizeof(linea));
+            h = hash64(h, tipos, entero * sizeof(TipoDato));
+        }
+        tabla.huella = h;
+    }
+    if (!cache_bloques.grabando) {
+        return;
+    }
+    CacheBloques* c = &cache_bloques;
+    if (c->num_diario == c->capacidad_diario) {
+        c->capacidad_diario = c->capacidad_diario ? c->capacidad_diario * 2 : 64;
+        c->diario = (Operacion*)crecer_arreglo(c->diario, c->capacidad_diario, sizeof(Operacion));
+    }
+    Operacion* op = &c->diario[c->num_diario++];
+    op->tipo = tipo;
+    op->entero = entero;
+    op->linea = linea - c->base_linea;
+    op->bandera = bandera;
+    op->texto = texto ? strdup(texto) : NULL;
+    op->texto2 = texto2 ? strdup(texto2) : NULL;
+    op->tipos = NULL;
+    // Las referencias pendientes llevan un tipo por argumento; los diagnosticos, el esperado y el encontrado
+    if (tipo == OP_REFERENCIA_PENDIENTE || (tipo == OP_DIAGNOSTICO && tipos)) {
+        int num_tipos = tipo == OP_DIAGNOSTICO ? 2 : entero;
+        TipoDato* copia = (TipoDato*)malloc((num_tipos > 0 ? num_tipos : 1) * sizeof(TipoDato));
+        memcpy(copia, tipos, num_tipos * sizeof(TipoDato));
+        op->tipos = copia;
+    }
 }
 
 void inicializar_tabla_simbolos() {
-    tabla.num_variables = 0;
-    tabla.num_funciones = 0;
-    strcpy(tabla.ambito_actual, "global");
+    tabla.huella = 0;
+    tabla.huella_declaraciones = 0;
+    tabla.variables.num = 0;
+    tabla.funciones.num = 0;
+    tabla.parametros.num = 0;
+    if (tabla.funciones.indice) {
+        memset(tabla.funciones.indice, 0, tabla.funciones.tam_indice * sizeof(int));
+    }
+    while (tabla.num_marcos > 0) {
+        salir_ambito();
+    }
+    pendientes.num_referencias = 0;
+    bk_vaciar(&arbol_variables);
+    bk_vaciar(&arbol_funciones);
+    entrar_ambito("global");
 }
 
-void agregar_variable(const char* nombre, TipoDato tipo, int linea) {
-    if (tabla.num_variables < 100) {
-        strcpy(tabla.variables[tabla.num_variables].nombre, nombre);
-        tabla.variables[tabla.num_variables].tipo = tipo;
-        tabla.variables[tabla.num_variables].inicializada = false;
-        tabla.variables[tabla.num_variables].linea_declaracion = linea;
-        tabla.num_variables++;
+void liberar_tabla_simbolos() {
+    while (tabla.num_marcos > 0) {
+        salir_ambito();
+    }
+    free(tabla.marcos);
+    free(tabla.variables.datos);
+    free(tabla.variables.nombres);
+    free(tabla.variables.lineas);
+    free(tabla.funciones.datos);
+    free(tabla.funciones.nombres);
+    free(tabla.funciones.lineas);
+    free(tabla.funciones.indice);
+    free(tabla.parametros.tipos);
+    free(tabla.parametros.nombres);
+    arena_liberar(&tabla.nombres);
+    arena_liberar(&tabla.nombres_variables);
+    memset(&tabla, 0, sizeof(tabla));
+    bk_liberar(&arbol_variables);
+    bk_liberar(&arbol_funciones);
+}
+
+void entrar_ambito(const char* nombre) {
+    anotar_operacion(OP_ENTRAR_AMBITO, 0, 0, false, nombre, NULL, NULL);
+    generacion_declaraciones++;
+    if (tabla.num_marcos == tabla.capacidad_marcos) {
+        tabla.capacidad_marcos = tabla.capacidad_marcos ? tabla.capacidad_marcos * 2 : 8;
+        tabla.marcos = (Marco*)crecer_arreglo(tabla.marcos, tabla.capacidad_marcos, sizeof(Marco));
+    }
+    Marco* marco = &tabla.marcos[tabla.num_marcos++];
+    snprintf(marco->nombre, sizeof(marco->nombre), "%s", nombre);
+    marco->primera_variable = tabla.variables.num;
+    marco->indice = NULL;
+    marco->tam_indice = 0;
+    marco->nodos_sugerencias = arbol_variables.num_nodos;
+    marco->bloque_nombres = tabla.nombres_variables.actual;
+    marco->usado_nombres = marco->bloque_nombres ? marco->bloque_nombres->usado : 0;
+}
+
+// Descarta de una vez las variables del marco, su indice y sus nombres
+void salir_ambito() {
+    anotar_operacion(OP_SALIR_AMBITO, 0, 0, false, NULL, NULL, NULL);
+    generacion_declaraciones++;
+    Marco* marco = &tabla.marcos[--tabla.num_marcos];
+    tabla.variables.num = marco->primera_variable;
+    free(marco->indice);
+    bk_recortar(&arbol_variables, marco->nodos_sugerencias);
+    arena_restaurar(&tabla.nombres_variables, marco->bloque_nombres, marco->usado_nombres);
+}
+
+Marco* ambito_actual() {
+    return &tabla.marcos[tabla.num_marcos - 1];
+}
+
+void nombrar_ambito(const char* nombre) {
+    anotar_operacion(OP_NOMBRAR_AMBITO, 0, 0, false, nombre, NULL, NULL);
+    snprintf(ambito_actual()->nombre, sizeof(ambito_actual()->nombre), "%s", nombre);
+}
+
+const char* texto_variable(int id) {
+    return tabla.variables.nombres[id];
+}
+
+const char* texto_funcion(int id) {
+    return tabla.funciones.nombres[id];
+}
+
+#define MAX_LONGITUD_BK 128
+
+// Distancia de Damerau-Levenshtein restringida (cuenta transposiciones) sin distinguir mayusculas
+int distancia_edicion(const char* a, int la, const char* b, int lb) {
+    if (la >= MAX_LONGITUD_BK || lb >= MAX_LONGITUD_BK) {
+        return la > lb ? la : lb;
+    }
+    int filas[3][MAX_LONGITUD_BK];
+    int* anterior2 = filas[0];
+    int* anterior = filas[1];
+    int* actual = filas[2];
+    for (int j = 0; j <= lb; j++) anterior[j] = j;
+    for (int i = 1; i <= la; i++) {
+        actual[0] = i;
+        char ca = tolower((unsigned char)a[i - 1]);
+        for (int j = 1; j <= lb; j++) {
+            char cb = tolower((unsigned char)b[j - 1]);
+            int costo = ca == cb ? 0 : 1;
+            int d = anterior[j] + 1;
+            if (actual[j - 1] + 1 < d) d = actual[j - 1] + 1;
+            if (anterior[j - 1] + costo < d) d = anterior[j - 1] + costo;
+            if (i > 1 && j > 1 && ca == tolower((unsigned char)b[j - 2]) &&
+                tolower((unsigned char)a[i - 2]) == cb && anterior2[j - 2] + 1 < d) {
+                d = anterior2[j - 2] + 1;
+            }
+            actual[j] = d;
+        }
+        int* libre = anterior2;
+        anterior2 = anterior;
+        anterior = actual;
+        actual = libre;
+    }
+    return anterior[lb];
+}
+
+void bk_insertar(ArbolBK* arbol, int id) {
+    const char* palabra = arbol->texto(id);
+    int len = strlen(palabra);
+    int actual = 0;
+    if (arbol->num_nodos > 0) {
+        while (true) {
+            const char* otra = arbol->texto(arbol->nodos[actual].id);
+            int d = distancia_edicion(palabra, len, otra, strlen(otra));
+            if (d == 0) {
+                return;
+            }
+            int hijo = arbol->nodos[actual].primer_hijo;
+            while (hijo >= 0 && arbol->nodos[hijo].distancia != d) {
+                hijo = arbol->nodos[hijo].siguiente;
+            }
+            if (hijo < 0) {
+                break;
+            }
+            actual = hijo;
+        }
+    }
+    if (arbol->num_nodos == arbol->capacidad) {
+        int capacidad = arbol->capacidad ? arbol->capacidad * 2 : 32;
+        NodoBK* nodos = (NodoBK*)realloc(arbol->nodos, capacidad * sizeof(NodoBK));
+        if (nodos == NULL) {
+            fprintf(salida_errores, "Error: Memoria insuficiente para las sugerencias\n");
+            abortar_analisis();
+        }
+        arbol->nodos = nodos;
+        arbol->capacidad = capacidad;
+    }
+    NodoBK* nodo = &arbol->nodos[arbol->num_nodos];
+    nodo->id = id;
+    nodo->primer_hijo = -1;
+    nodo->siguiente = -1;
+    nodo->distancia = 0;
+    nodo->padre = -1;
+    if (arbol->num_nodos > 0) {
+        const char* otra = arbol->texto(arbol->nodos[actual].id);
+        nodo->distancia = distancia_edicion(palabra, len, otra, strlen(otra));
+        nodo->padre = actual;
+        nodo->siguiente = arbol->nodos[actual].primer_hijo;
+        arbol->nodos[actual].primer_hijo = arbol->num_nodos;
+        if (len < arbol->longitud_minima) arbol->longitud_minima = len;
+        if (len > arbol->longitud_maxima) arbol->longitud_maxima = len;
+    } else {
+        arbol->longitud_minima = len;
+        arbol->longitud_maxima = len;
+    }
+    arbol->num_nodos++;
+}
+
+// Devuelve el id mas cercano a distancia <= max_distancia (el menor id si empatan) o -1
+int bk_buscar(const ArbolBK* arbol, const char* palabra, int max_distancia, int* distancia) {
+    int len = strlen(palabra);
+    if (arbol->num_nodos == 0 || len + max_distancia < arbol->longitud_minima ||
+        len - max_distancia > arbol->longitud_maxima) {
+        return -1;
+    }
+    int pila_local[64];
+    int* pila = arbol->num_nodos <= 64 ? pila_local : (int*)malloc(arbol->num_nodos * sizeof(int));
+    int tope = 0;
+    int mejor = -1;
+    int mejor_distancia = max_distancia + 1;
+    pila[tope++] = 0;
+    while (tope > 0) {
+        const NodoBK* nodo = &arbol->nodos[pila[--tope]];
+        const char* otra = arbol->texto(nodo->id);
+        int d = distancia_edicion(palabra, len, otra, strlen(otra));
+        if (d < mejor_distancia || (d == mejor_distancia && mejor >= 0 && nodo->id < mejor)) {
+            mejor = nodo->id;
+            mejor_distancia = d;
+        }
+        for (int hijo = nodo->primer_hijo; hijo >= 0; hijo = arbol->nodos[hijo].siguiente) {
+            if (abs(arbol->nodos[hijo].distancia - d) <= max_distancia) {
+                pila[tope++] = hijo;
+            }
+        }
     }
+    if (pila != pila_local) {
+        free(pila);
+    }
+    if (mejor >= 0 && distancia) {
+        *distancia = mejor_distancia;
+    }
+    return mejor;
+}
+
+void bk_vaciar(ArbolBK* arbol) {
+    arbol->num_nodos = 0;
+}
+
+// Quita los nodos insertados despues de tener num_nodos; cada uno encabeza la lista
+// de hijos de su padre, asi que basta recorrerlos del mas nuevo al mas viejo
+void bk_recortar(ArbolBK* arbol, int num_nodos) {
+    for (int i = arbol->num_nodos - 1; i >= num_nodos; i--) {
+        int padre = arbol->nodos[i].padre;
+        if (padre >= 0 && padre < num_nodos) {
+            arbol->nodos[padre].primer_hijo = arbol->nodos[i].siguiente;
+        }
+    }
+    if (num_nodos < arbol->num_nodos) {
+        arbol->num_nodos = num_nodos;
+    }
+}
+
+void bk_liberar(ArbolBK* arbol) {
+    free(arbol->nodos);
+    arbol->nodos = NULL;
+    arbol->num_nodos = 0;
+    arbol->capacidad = 0;
+}
+
+// Cuantos cambios se toleran segun la longitud; con nombres de una o dos letras
+// cualquier otro nombre corto pareceria un error tipografico
+int distancia_maxima_sugerencia(int longitud) {
+    if (longitud <= 2) return 0;
+    return longitud >= 6 ? 2 : 1;
+}
+
+// Nombre declarado mas parecido a uno desconocido, o NULL si ninguno esta cerca
+const char* sugerir_simbolo(const char* nombre, bool variables, bool funciones) {
+    int max_distancia = distancia_maxima_sugerencia(strlen(nombre));
+    int distancia_variable = max_distancia + 1;
+    int distancia_funcion = max_distancia + 1;
+    int variable = variables ? bk_buscar(&arbol_variables, nombre, max_distancia, &distancia_variable) : -1;
+    int funcion = funciones ? bk_buscar(&arbol_funciones, nombre, max_distancia, &distancia_funcion) : -1;
+    if (variable >= 0 && distancia_variable <= distancia_funcion) {
+        return tabla.variables.nombres[variable];
+    }
+    if (funcion >= 0) {
+        return tabla.funciones.nombres[funcion];
+    }
+    return NULL;
+}
+
+// Hash FNV-1a sobre el nombre en minusculas, asi la busqueda no distingue mayusculas
+unsigned int hash_nombre(const char* nombre) {
+    unsigned int hash = 2166136261u;
+    while (*nombre) {
+        hash ^= (unsigned char)tolower((unsigned char)*nombre);
+        hash *= 16777619u;
+        nombre++;
+    }
+    return hash;
+}
+
+// Los indices guardan posicion + 1; una casilla en 0 esta vacia
+int buscar_en_indice(const int* indice, int tam, const char* nombre, bool es_funcion) {
+    CONTAR(CONTADOR_BUSQUEDAS, 1);
+    if (tam == 0) {
+        return -1;
+    }
+    unsigned int hash = hash_nombre(nombre);
+    unsigned int pos = hash & (tam - 1);
+    while (indice[pos] != 0) {
+        CONTAR(CONTADOR_SONDEOS, 1);
+        int i = indice[pos] - 1;
+        unsigned int guardado = es_funcion ? tabla.funciones.datos[i].hash : tabla.variables.datos[i].hash;
+        if (guardado == hash &&
+            strcasecmp(es_funcion ? tabla.funciones.nombres[i] : tabla.variables.nombres[i], nombre) == 0) {
+            return i;
+        }
+        pos = (pos + 1) & (tam - 1);
+    }
+    return -1;
+}
+
+// El indice cubre las posiciones [primera, posicion]. Un nombre repetido no se inserta:
+// la busqueda sigue devolviendo la primera declaracion
+void insertar_en_indice(int** indice, int* tam, const char* nombre, int posicion, int primera, bool es_funcion) {
+    if (2 * (posicion - primera + 1) > *tam) {
+        int nuevo_tam = *tam ? *tam * 2 : 64;
+        free(*indice);
+        *indice = (int*)calloc(nuevo_tam, sizeof(int));
+        if (*indice == NULL) {
+            fprintf(salida_errores, "Error: Memoria insuficiente para la tabla de simbolos\n");
+            abortar_analisis();
+        }
+        *tam = nuevo_tam;
+        for (int i = primera; i < posicion; i++) {
+            insertar_en_indice(indice, tam, es_funcion ? tabla.funciones.nombres[i] : tabla.variables.nombres[i], i, primera, es_funcion);
+        }
+    }
+    if (buscar_en_indice(*indice, *tam, nombre, es_funcion) >= 0) {
+        return;
+    }
+    unsigned int pos = hash_nombre(nombre) & (*tam - 1);
+    while ((*indice)[pos] != 0) {
+        pos = (pos + 1) & (*tam - 1);
+    }
+    (*indice)[pos] = posicion + 1;
+}
+
+void* crecer_arreglo(void* arreglo, int capacidad, size_t tam_elemento) {
+    void* nuevo = realloc(arreglo, capacidad * tam_elemento);
+    if (nuevo == NULL) {
+        fprintf(salida_errores, "Error: Memoria insuficiente para la tabla de simbolos\n");
+        abortar_analisis();
+    }
+    return nuevo;
+}
+
+const char* guardar_nombre(Arena* arena, const char* nombre) {
+    size_t len = strlen(nombre);
+    char* copia = (char*)arena_reservar(arena, len + 1);
+    memcpy(copia, nombre, len + 1);
+    return copia;
+}
+
+void agregar_variable(const char* nombre, TipoDato tipo, int linea) {
+    anotar_operacion(OP_AGREGAR_VARIABLE, tipo, linea, false, nombre, NULL, NULL);
+    generacion_declaraciones++;
+    TablaVariables* t = &tabla.variables;
+    if (t->num == t->capacidad) {
+        t->capacidad = t->capacidad ? t->capacidad * 2 : 64;
+        t->datos = (Variable*)crecer_arreglo(t->datos, t->capacidad, sizeof(Variable));
+        t->nombres = (const char**)crecer_arreglo(t->nombres, t->capacidad, sizeof(char*));
+        t->lineas = (int*)crecer_arreglo(t->lineas, t->capacidad, sizeof(int));
+    }
+    t->datos[t->num].hash = hash_nombre(nombre);
+    t->datos[t->num].tipo = tipo;
+    t->datos[t->num].inicializada = false;
+    t->nombres[t->num] = guardar_nombre(&tabla.nombres_variables, nombre);
+    t->lineas[t->num] = linea;
+    Marco* marco = ambito_actual();
+    insertar_en_indice(&marco->indice, &marco->tam_indice, nombre, t->num, marco->primera_variable, false);
+    bk_insertar(&arbol_variables, t->num);
+    t->num++;
 }
 
 void agregar_funcion(const char* nombre, TipoDato tipo_retorno, int linea_declaracion) {
-    if (tabla.num_funciones >= MAX_FUNCIONES) {
-        fprintf(stderr, "Error: Número máximo de funciones alcanzado\n");
-        exit(1);
+    anotar_operacion(OP_AGREGAR_FUNCION, tipo_retorno, linea_declaracion, false, nombre, NULL, NULL);
+    generacion_declaraciones++;
+    TablaFunciones* t = &tabla.funciones;
+    if (t->num == t->capacidad) {
+        t->capacidad = t->capacidad ? t->capacidad * 2 : 32;
+        t->datos = (Funcion*)crecer_arreglo(t->datos, t->capacidad, sizeof(Funcion));
+        t->nombres = (const char**)crecer_arreglo(t->nombres, t->capacidad, sizeof(char*));
+        t->lineas = (int*)crecer_arreglo(t->lineas, t->capacidad, sizeof(int));
     }
     
     char nombre_lower[50];
-    strcpy(nombre_lower, nombre);
+    snprintf(nombre_lower, sizeof(nombre_lower), "%s", nombre);
     toLowerCase(nombre_lower);
     
-    strcpy(tabla.funciones[tabla.num_funciones].nombre, nombre_lower);
-    tabla.funciones[tabla.num_funciones].tipo_retorno = tipo_retorno;
-    tabla.funciones[tabla.num_funciones].num_parametros = 0;
-    tabla.funciones[tabla.num_funciones].linea_declaracion = linea_declaracion;
-    tabla.funciones[tabla.num_funciones].tiene_retorno = false;
-    tabla.num_funciones++;
+    Funcion* func = &t->datos[t->num];
+    func->hash = hash_nombre(nombre_lower);
+    func->tipo_retorno = tipo_retorno;
+    func->primer_parametro = tabla.parametros.num;
+    func->num_parametros = 0;
+    func->retorno_asignado = false;
+    func->tiene_retorno = false;
+    t->nombres[t->num] = guardar_nombre(&tabla.nombres, nombre_lower);
+    t->lineas[t->num] = linea_declaracion;
+    insertar_en_indice(&t->indice, &t->tam_indice, nombre_lower, t->num, 0, true);
+    bk_insertar(&arbol_funciones, t->num);
+    t->num++;
 }
 
 void agregar_parametro_funcion(const char* nombre_funcion, const char* nombre_param, TipoDato tipo) {
-    for (int i = 0; i < tabla.num_funciones; i++) {
-        if (strcmp(tabla.funciones[i].nombre, nombre_funcion) == 0) {
-            int num = tabla.funciones[i].num_parametros;
-            strcpy(tabla.funciones[i].parametros[num].nombre, nombre_param);
-            tabla.funciones[i].parametros[num].tipo = tipo;
-            tabla.funciones[i].parametros[num].inicializada = true; 
-            tabla.funciones[i].num_parametros++;
-            return;
+    anotar_operacion(OP_AGREGAR_PARAMETRO, tipo, 0, false, nombre_funcion, nombre_param, NULL);
+    Funcion* func = buscar_funcion(nombre_funcion);
+    if (func) {
+        ListaParametros* p = &tabla.parametros;
+        // Si otra funcion agrego parametros despues, los de esta se mueven al final para seguir contiguos
+        bool al_final = func->primer_parametro + func->num_parametros == p->num;
+        int necesarios = p->num + 1 + (al_final ? 0 : func->num_parametros);
+        if (necesarios > p->capacidad) {
+            while (p->capacidad < necesarios) {
+                p->capacidad = p->capacidad ? p->capacidad * 2 : 64;
+            }
+            p->tipos = (TipoDato*)crecer_arreglo(p->tipos, p->capacidad, sizeof(TipoDato));
+            p->nombres = (const char**)crecer_arreglo(p->nombres, p->capacidad, sizeof(char*));
         }
+        if (!al_final) {
+            memcpy(p->tipos + p->num, p->tipos + func->primer_parametro, func->num_parametros * sizeof(TipoDato));
+            memcpy(p->nombres + p->num, p->nombres + func->primer_parametro, func->num_parametros * sizeof(char*));
+            func->primer_parametro = p->num;
+            p->num += func->num_parametros;
+        }
+        p->tipos[p->num] = tipo;
+        p->nombres[p->num] = guardar_nombre(&tabla.nombres, nombre_param);
+        p->num++;
+        func->num_parametros++;
     }
 }
 
 bool variable_existe(const char* nombre) {
-    char lowerNombre[50];
-    strcpy(lowerNombre, nombre);
-    toLowerCase(lowerNombre);
-    
-    for (int i = 0; i < tabla.num_variables; i++) {
-        char lowerVarName[50];
-        strcpy(lowerVarName, tabla.variables[i].nombre);
-        toLowerCase(lowerVarName);
-        if (strcmp(lowerVarName, lowerNombre) == 0) {
-            return true;
-        }
-    }
-    return false;
+    return buscar_variable(nombre) != NULL;
 }
 
 bool funcion_existe(const char* nombre) {
-    char lowerNombre[50];
-    strcpy(lowerNombre, nombre);
-    toLowerCase(lowerNombre);
-    
-    for (int i = 0; i < tabla.num_funciones; i++) {
-        char lowerFuncName[50];
-        strcpy(lowerFuncName, tabla.funciones[i].nombre);
-        toLowerCase(lowerFuncName);
-        if (strcmp(lowerFuncName, lowerNombre) == 0) {
-            return true;
-        }
-    }
-    return false;
+    return buscar_en_indice(tabla.funciones.indice, tabla.funciones.tam_indice, nombre, true) >= 0;
 }
 
+// Los punteros valen hasta la siguiente declaracion, que puede mover los arreglos
+// Recorre los ambitos del mas interno al global, asi los locales ocultan a los globales
 Variable* buscar_variable(const char* nombre) {
-    char lowerNombre[50];
-    strcpy(lowerNombre, nombre);
-    toLowerCase(lowerNombre);
-    
-    for (int i = 0; i < tabla.num_variables; i++) {
-        char lowerVarName[50];
-        strcpy(lowerVarName, tabla.variables[i].nombre);
-        toLowerCase(lowerVarName);
-        if (strcmp(lowerVarName, lowerNombre) == 0) {
-            return &tabla.variables[i];
+    for (int m = tabla.num_marcos - 1; m >= 0; m--) {
+        int i = buscar_en_indice(tabla.marcos[m].indice, tabla.marcos[m].tam_indice, nombre, false);
+        if (i >= 0) {
+            return &tabla.variables.datos[i];
         }
     }
     return NULL;
 }
 
 Funcion* buscar_funcion(const char* nombre) {
-    char nombre_lower[50];
-    strcpy(nombre_lower, nombre);
-    toLowerCase(nombre_lower);
-    
-    for (int i = 0; i < tabla.num_funciones; i++) {
-        char func_nombre_lower[50];
-        strcpy(func_nombre_lower, tabla.funciones[i].nombre);
-        toLowerCase(func_nombre_lower);
-        
-        if (strcmp(func_nombre_lower, nombre_lower) == 0) {
-            return &tabla.funciones[i];
-        }
-    }
-    return NULL;
+    int i = buscar_en_indice(tabla.funciones.indice, tabla.funciones.tam_indice, nombre, true);
+    return i >= 0 ? &tabla.funciones.datos[i] : NULL;
 }
 
 void marcar_variable_inicializada(const char* nombre) {
+    anotar_operacion(OP_INICIALIZAR_VARIABLE, 0, 0, false, nombre, NULL, NULL);
     Variable* var = buscar_variable(nombre);
     if (var) {
         var->inicializada = true;
     }
 }
 
+// Avisa si la variable se usa antes de inicializarse. Es una operacion para que al repetir
+// un bloque el aviso dependa de la tabla de ese momento y no de la que vio el bloque grabado
+void verificar_inicializada(const char* nombre, int linea) {
+    anotar_operacion(OP_VERIFICAR_INICIALIZADA, 0, linea, false, nombre, NULL, NULL);
+    Variable* var = buscar_variable(nombre);
+    if (var && !var->inicializada) {
+        char mensaje[100];
+        snprintf(mensaje, sizeof(mensaje), "Variable '%s' utilizada antes de ser inicializada", nombre);
+        cache_bloques.dentro_de_operacion++;
+        mostrar_advertencia(mensaje, linea);
+        cache_bloques.dentro_de_operacion--;
+    }
+}
+
 void marcar_funcion_con_retorno(const char* nombre) {
+    anotar_operacion(OP_RETORNO_ASIGNADO, 0, 0, false, nombre, NULL, NULL);
     Funcion* func = buscar_funcion(nombre);
     if (func) {
         func->retorno_asignado = true;
     }
 }
 
+// Una segunda cabecera de la misma funcion actualiza su tipo y su linea
+void redeclarar_funcion(const char* nombre, TipoDato tipo_retorno, int linea) {
+    anotar_operacion(OP_REDECLARAR_FUNCION, tipo_retorno, linea, false, nombre, NULL, NULL);
+    generacion_declaraciones++;
+    Funcion* func = buscar_funcion(nombre);
+    if (func) {
+        func->tipo_retorno = tipo_retorno;
+        tabla.funciones.lineas[func - tabla.funciones.datos] = linea;
+    }
+}
+
+void fijar_tiene_retorno(const char* nombre, bool tiene_retorno) {
+    anotar_operacion(OP_TIENE_RETORNO, 0, 0, tiene_retorno, nombre, NULL, NULL);
+    Funcion* func = buscar_funcion(nombre);
+    if (func) {
+        func->tiene_retorno = tiene_retorno;
+    }
+}
+
 bool verificar_tipos_compatibles(TipoDato tipo1, TipoDato tipo2) {
     if (tipo1 == tipo2) return true;
 
@@ -211,46 +1139,212 @@ bool verificar_tipos_compatibles(TipoDato tipo1, TipoDato tipo2) {
     return false;
 }
 
-TipoDato inferir_tipo_expresion(const char* expr) {
-    if (strstr(expr, "\"") != NULL || strstr(expr, "'") != NULL) {
-        return TIPO_STRING;
-    }
-    
-    if (strstr(expr, ".") != NULL) {
-        return TIPO_REAL;
-    }
-    
-    if (strcmp(expr, "true") == 0 || strcmp(expr, "false") == 0) {
-        return TIPO_BOOLEAN;
-    }
-    
-    Variable* var = buscar_variable(expr);
-    if (var) {
-        return var->tipo;
-    }
-    
-    return TIPO_INTEGER;
-}
-
 const char* palabras_clave[] = {"begin", "end", "then", "else", "while", "do", "for", "to", "downto", 
                                 "repeat", "until", "case", "of", "const", "type", "record", "array", "var",
                                 "function", "procedure"};
 
-const char* tipos_validos[] = {"integer", "string", "real", "boolean", "char"};
-
 const char* operadoresAritmeticos[] = {"*", "/","mod","+","-"};
 
 const char* operadoresDeComparacion[] = {"<>", "<=", ">=", "<", ">", "="};
 
 
+typedef enum {
+    NODO_ASIGNACION,
+    NODO_ASIGNACION_OPERADOR,
+    NODO_CABECERA,
+    NODO_COMA,
+    NODO_CONTENIDO,
+    NODO_CUERPO_FUNCION,
+    NODO_DO,
+    NODO_DOS_PUNTOS_CABECERA,
+    NODO_DOS_PUNTOS,
+    NODO_EXPRESION,
+    NODO_FINAL,
+    NODO_FOR,
+    NODO_FOR_STATEMENT,
+    NODO_FUNCION,
+    NODO_HEADER_PT1,
+    NODO_HEADER_PT2,
+    NODO_IF,
+    NODO_IF_STATEMENT,
+    NODO_LLAMADA,
+    NODO_NODO_OPERADOR_DER,
+    NODO_NODO_OPERADOR_IZQ,
+    NODO_OPERADOR,
+    NODO_OPERADOR_CONTROL,
+    NODO_OPERANDO,
+    NODO_PALABRA_CLAVE,
+    NODO_PARAMETRO,
+    NODO_PARAMETRO_INNER,
+    NODO_PARAMETROS,
+    NODO_PARENTESIS,
+    NODO_PROCEDURE,
+    NODO_PROGRAMA,
+    NODO_PUNTO_Y_COMA,
+    NODO_SENTENCIA,
+    NODO_THEN,
+    NODO_TIPO,
+    NODO_VARIABLE,
+    NODO_VARIABLES,
+    NODO_WHILE,
+    NODO_WHILE_STATEMENT,
+    NODO_WRITELN,
+    NUM_TIPOS_NODO
+} TipoNodo;
+
+// Nombre con el que se imprime cada tipo de nodo
+const char* nombres_tipo_nodo[NUM_TIPOS_NODO] = {
+    [NODO_ASIGNACION] = "asignacion",
+    [NODO_ASIGNACION_OPERADOR] = "asignacion_operador",
+    [NODO_CABECERA] = "cabecera",
+    [NODO_COMA] = "coma",
+    [NODO_CONTENIDO] = "contenido",
+    [NODO_CUERPO_FUNCION] = "cuerpo_funcion",
+    [NODO_DO] = "do",
+    [NODO_DOS_PUNTOS_CABECERA] = "dos puntos",
+    [NODO_DOS_PUNTOS] = "dos_puntos",
+    [NODO_EXPRESION] = "expresion",
+    [NODO_FINAL] = "final",
+    [NODO_FOR] = "for",
+    [NODO_FOR_STATEMENT] = "for_statement",
+    [NODO_FUNCION] = "funcion",
+    [NODO_HEADER_PT1] = "header pt1",
+    [NODO_HEADER_PT2] = "header pt2",
+    [NODO_IF] = "if",
+    [NODO_IF_STATEMENT] = "if_statement",
+    [NODO_LLAMADA] = "llamada",
+    [NODO_NODO_OPERADOR_DER] = "nodo_operador_der",
+    [NODO_NODO_OPERADOR_IZQ] = "nodo_operador_izq",
+    [NODO_OPERADOR] = "operador",
+    [NODO_OPERADOR_CONTROL] = "operador_control",
+    [NODO_OPERANDO] = "operando",
+    [NODO_PALABRA_CLAVE] = "palabra_clave",
+    [NODO_PARAMETRO] = "parametro",
+    [NODO_PARAMETRO_INNER] = "parametro_inner",
+    [NODO_PARAMETROS] = "parametros",
+    [NODO_PARENTESIS] = "parentesis",
+    [NODO_PROCEDURE] = "procedure",
+    [NODO_PROGRAMA] = "programaPrueba",
+    [NODO_PUNTO_Y_COMA] = "punto y coma",
+    [NODO_SENTENCIA] = "sentencia",
+    [NODO_THEN] = "then",
+    [NODO_TIPO] = "tipo",
+    [NODO_VARIABLE] = "variable",
+    [NODO_VARIABLES] = "variables",
+    [NODO_WHILE] = "while",
+    [NODO_WHILE_STATEMENT] = "while_statement",
+    [NODO_WRITELN] = "writeln",
+};
+
+// Nodo compacto: el valor es un id de la tabla de cadenas internadas y los
+// hijos forman una lista enlazada dentro de la arena
 typedef struct Nodo {
-    char tipo[20];      
-    char valor[50];      
-    struct Nodo** hijos;  
-    int num_hijos;       
+    unsigned char tipo;        // TipoNodo
+    unsigned int valor;
+    int linea;                 // linea de la fuente (desde 1) que se leia al crearlo; 0 si ninguna
+    struct Nodo* primer_hijo;
+    struct Nodo* ultimo_hijo;
+    struct Nodo* siguiente;
 } Nodo;
 
-Nodo* crear_nodo(const char* tipo, const char* valor);
+LOCAL_HILO Arena arena_arbol;
+
+// Cadenas de los valores de los nodos, guardadas una sola vez en la arena
+typedef struct {
+    const char** textos;
+    int num_textos;
+    int capacidad;
+    int* indice;              // tabla hash abierta de ids + 1, 0 = libre
+    int tam_indice;
+    unsigned char* tipos;     // tipo memorizado de la expresion con ese texto
+    unsigned int* generaciones; // generacion_declaraciones al memorizarlo, 0 = sin memorizar
+    int capacidad_tipos;
+} TablaCadenas;
+
+LOCAL_HILO TablaCadenas cadenas_arbol;
+
+typedef enum {
+    TOKEN_IDENTIFICADOR,
+    TOKEN_NUMERO,
+    TOKEN_CADENA,
+    TOKEN_ASIGNACION,
+    TOKEN_COMPARACION,
+    TOKEN_OPERADOR,
+    TOKEN_PUNTUACION
+} TipoToken;
+
+// Los valores 1..20 siguen el orden de palabras_clave
+typedef enum {
+    PALABRA_NINGUNA,
+    PALABRA_BEGIN, PALABRA_END, PALABRA_THEN, PALABRA_ELSE, PALABRA_WHILE, PALABRA_DO,
+    PALABRA_FOR, PALABRA_TO, PALABRA_DOWNTO, PALABRA_REPEAT, PALABRA_UNTIL, PALABRA_CASE,
+    PALABRA_OF, PALABRA_CONST, PALABRA_TYPE, PALABRA_RECORD, PALABRA_ARRAY, PALABRA_VAR,
+    PALABRA_FUNCTION, PALABRA_PROCEDURE,
+    PALABRA_IF
+} PalabraClave;
+
+typedef struct {
+    unsigned char tipo;
+    unsigned char palabra;
+    int offset;
+    int longitud;
+    int linea;
+} Token;
+
+typedef struct {
+    const char* texto;
+    size_t longitud;
+    bool mapeado;
+    size_t tam_linea;
+    int* inicio_lineas;
+    int* primer_token;
+    int num_lineas;
+    Token* tokens;
+    int num_tokens;
+    int capacidad_tokens;
+    int linea_actual;
+} Fuente;
+
+// Fuente de la que se leen las lineas de los nodos que se crean
+LOCAL_HILO const Fuente* fuente_arbol;
+
+typedef struct {
+    const char* texto;
+    const Token* tokens;
+    int num_tokens;
+} VistaTokens;
+
+typedef struct {
+    const char* inicio;
+    int longitud;
+} VistaLinea;
+
+int escanear_token(const char* texto, int pos, int fin, Token* token);
+bool cargar_fuente(Fuente* fuente, const char* ruta);
+void indexar_fuente(Fuente* fuente);
+void liberar_fuente(Fuente* fuente);
+VistaLinea obtener_linea(const Fuente* fuente, int i);
+char* nuevo_buffer_linea(const Fuente* fuente);
+bool leer_linea(Fuente* fuente, char* buffer, size_t tam, VistaTokens* vista);
+PalabraClave reconocer_palabra_clave(const char* p, int len);
+PalabraClave clasificar_palabra(const char* inicio, int longitud);
+bool es_palabra_clave(const char* palabra);
+bool vista_empieza_con(VistaTokens vista, PalabraClave palabra);
+int vista_buscar(VistaTokens vista, TipoToken tipo, int desde);
+int vista_buscar_palabra(VistaTokens vista, PalabraClave palabra, int desde);
+bool vista_contiene_palabra_clave(VistaTokens vista);
+bool vista_contiene_identificador(VistaTokens vista, const char* nombre);
+bool vista_empieza_con_identificador(VistaTokens vista, const char* nombre);
+bool vista_es_llamada_funcion(VistaTokens vista);
+const char* token_en_linea(const char* linea, VistaTokens vista, int i);
+void copiar_fragmento(char* destino, size_t tam, const char* inicio, const char* fin);
+const char* buscar_asignacion(const char* linea);
+
+void* arena_reservar(Arena* arena, size_t tam);
+void arena_liberar(Arena* arena);
+unsigned int internar_cadena(const char* texto);
+void liberar_arbol();
+Nodo* crear_nodo(TipoNodo tipo, const char* valor);
 void agregar_hijo(Nodo* padre, Nodo* hijo);
 bool end_with_semicolon(const char* str);
 void removeSpaces(char *str);
@@ -262,27 +1356,46 @@ void toLowerCase(char *str);
 char **split_function(const char *str, int *count);
 char *extraer_parentesis(const char *str);
 char **split(const char *str, const char *delim, int *count);
+void liberar_partes(char **partes);
 void mostrar_error(const char* mensaje, int linea, const char* detalle);
+void mostrar_error_tipos(const char* mensaje, int linea, const char* detalle, TipoDato esperado, TipoDato encontrado);
 void mostrar_advertencia(const char* mensaje, int linea);
+void volcar_diagnosticos(const char* ruta, const Fuente* fuente);
+void descartar_diagnosticos();
 int es_tipo_valido(const char* tipo);
-void analizar_palabra_clave(Nodo* arbol, const char* linea, int *num_linea, bool fromF_Or_P, FILE* archivo);
+void analizar_palabra_clave(Nodo* arbol, const char* linea, int *num_linea, bool fromF_Or_P, Fuente* fuente);
 void analizar_cabecera_funcion(Nodo* arbol, char* linea, int num_linea, char* nombre_funcion);
-void analizar_funcion(Nodo* arbol, char* linea, int* num_linea, FILE* archivo, char* nombre_funcion);
-void analizar_expresion(Nodo* arbol, char* expr, int num_linea);
+void analizar_funcion(Nodo* arbol, char* linea, int* num_linea, Fuente* fuente, char* nombre_funcion);
+TipoDato analizar_expresion(Nodo* arbol, char* expr, int num_linea);
 void analizar_asignacion(Nodo* arbol, const char* linea, int num_linea);
-void imprimir_arbol(Nodo* nodo, int nivel);
+void imprimir_arbol(Nodo* arbol);
+bool escribir_arbol_binario(Nodo* arbol, const char* ruta);
 void analizar_writeln(Nodo* arbol, const char* linea, int num_linea);
-void analizar_if(Nodo* arbol, const char* linea, int *num_linea, FILE* archivo);
-void analizar_while(Nodo* arbol, const char* linea, int *num_linea, FILE* archivo);
-void analizar_for(Nodo* arbol, const char* linea, int *num_linea, FILE* archivo);
+void analizar_if(Nodo* arbol, const char* linea, VistaTokens vista, int *num_linea, Fuente* fuente);
+void analizar_while(Nodo* arbol, const char* linea, VistaTokens vista, int *num_linea, Fuente* fuente);
+void analizar_for(Nodo* arbol, const char* linea, VistaTokens vista, int *num_linea, Fuente* fuente);
 
+void construir_arbol_palabras_clave();
 bool es_palabra_clave_similar(const char* palabra, int num_linea);
 bool validar_asignacion(const char* linea, int num_linea);
 bool validar_condicion(const char* condicion, int num_linea);
 bool validar_parametros_funcion(const char* parametros, int num_linea);
 
+const char* texto_palabra_clave(int id) {
+    return palabras_clave[id];
+}
+
+void construir_arbol_palabras_clave() {
+    for (int i = 0; i < sizeof(palabras_clave) / sizeof(palabras_clave[0]); i++) {
+        bk_insertar(&arbol_palabras_clave, i);
+    }
+}
+
 bool es_palabra_clave_similar(const char* palabra, int num_linea) {
     char palabra_sin_puntuacion[256];
+    if (strlen(palabra) >= sizeof(palabra_sin_puntuacion)) {
+        return false;
+    }
     strcpy(palabra_sin_puntuacion, palabra);
   
     int len = strlen(palabra_sin_puntuacion);
@@ -290,10 +1403,8 @@ bool es_palabra_clave_similar(const char* palabra, int num_linea) {
         palabra_sin_puntuacion[len-1] = '\0';
     }
     
-    for (int i = 0; i < sizeof(palabras_clave) / sizeof(palabras_clave[0]); i++) {
-        if (strcmp(palabra_sin_puntuacion, palabras_clave[i]) == 0) {
-            return false; 
-        }
+    if (es_palabra_clave(palabra_sin_puntuacion)) {
+        return false; 
     }
 
     if (strcmp(palabra_sin_puntuacion, "en") == 0) {
@@ -301,64 +1412,58 @@ bool es_palabra_clave_similar(const char* palabra, int num_linea) {
         return true;
     }
     
-    for (int i = 0; i < sizeof(palabras_clave) / sizeof(palabras_clave[0]); i++) {
-        int len1 = strlen(palabra_sin_puntuacion);
-        int len2 = strlen(palabras_clave[i]);
-        
-        if (abs(len1 - len2) <= 1) {
-            int differences = 0;
-            int minLen = (len1 < len2) ? len1 : len2;
-            
-            for (int j = 0; j < minLen && differences <= 2; j++) {
-                if (palabra_sin_puntuacion[j] != palabras_clave[i][j]) {
-                    differences++;
-                }
-            }
-            differences += abs(len1 - len2);
-            
-            if (differences <= 2) {
-                char mensaje[100];
-                sprintf(mensaje, "Posible error tipográfico: '%s' (¿quiso escribir '%s'?)", 
-                        palabra_sin_puntuacion, palabras_clave[i]);
-                mostrar_error(mensaje, num_linea, palabra);
-                return true;
-            }
-        }
+    int distancia;
+    int i = bk_buscar(&arbol_palabras_clave, palabra_sin_puntuacion,
+                      distancia_maxima_sugerencia(strlen(palabra_sin_puntuacion)), &distancia);
+    if (i >= 0) {
+        char mensaje[300];
+        snprintf(mensaje, sizeof(mensaje), "Posible error tipográfico: '%s' (¿quiso escribir '%s'?)", 
+                 palabra_sin_puntuacion, palabras_clave[i]);
+        mostrar_error(mensaje, num_linea, palabra);
+        return true;
     }
     
     return false;
 }
 
 bool validar_asignacion(const char* linea, int num_linea) {
-    if (strstr(linea, "=") != NULL && strstr(linea, ":=") == NULL) {
+    int len = strlen(linea);
+    int asignaciones = 0;
+    int dos_puntos = 0;
+    int iguales = 0;
+    int tokens_izquierda = 0;
+    int tokens_derecha = 0;
+    Token token;
+    int pos = 0;
+    while ((pos = escanear_token(linea, pos, len, &token)) >= 0) {
+        if (token.tipo == TOKEN_ASIGNACION) {
+            asignaciones++;
+            continue;
+        }
+        if (token.tipo == TOKEN_PUNTUACION && linea[token.offset] == ':') {
+            dos_puntos++;
+        } else if (token.tipo == TOKEN_COMPARACION && token.longitud == 1 && linea[token.offset] == '=') {
+            iguales++;
+        }
+        if (asignaciones == 0) {
+            tokens_izquierda++;
+        } else {
+            tokens_derecha++;
+        }
+    }
+
+    if (iguales > 0 && asignaciones == 0) {
         mostrar_error("Operador de asignación invalido. Debe usar ':='", num_linea, linea);
         return false;
     }
-
-    char* dos_puntos = strstr(linea, ":");
-    char* igual = strstr(linea, "=");
-    if ((dos_puntos && !igual) || (!dos_puntos && igual)) {
+    if (dos_puntos > 0 && asignaciones == 0) {
         mostrar_error("Operador de asignacion mal formado. Debe ser ':='", num_linea, linea);
         return false;
     }
-    if (strstr(linea, ":=") != NULL) {
-        int count = 0;
-        char** partes = split(linea, ":=", &count);
-        if (!partes || count != 2 || !partes[0] || !partes[1] || 
-            strlen(partes[0]) == 0 || strlen(partes[1]) == 0) {
-            if (partes) {
-                for(int i = 0; i < count; i++) {
-                    free(partes[i]);
-                }
-                free(partes);
-            }
-            mostrar_error("Asignación mal formada", num_linea, linea);
-            return false;
-        }
-        for(int i = 0; i < count; i++) {
-            free(partes[i]);
-        }
-        free(partes);
+    if (asignaciones > 0 &&
+        (asignaciones + dos_puntos + iguales != 1 || tokens_izquierda == 0 || tokens_derecha == 0)) {
+        mostrar_error("Asignación mal formada", num_linea, linea);
+        return false;
     }
     return true;
 }
@@ -384,7 +1489,8 @@ bool validar_condicion(const char* condicion, int num_linea) {
 
 bool validar_parametros_funcion(const char* parametros, int num_linea) {
     char* copia = strdup(parametros);
-    char* token = strtok(copia, ":");
+    char* contexto = NULL;
+    char* token = strtok_r(copia, ":", &contexto);
     
     while (token != NULL) {
         char* params = strchr(token, ',');
@@ -392,59 +1498,569 @@ bool validar_parametros_funcion(const char* parametros, int num_linea) {
             char* antes = token;
             while (isspace(*antes)) antes++;
             if (*antes == ',') {
-                mostrar_error("Error en la lista de parametros: falta variable antes de la coma", num_linea, parametros);
                 free(copia);
+                mostrar_error("Error en la lista de parametros: falta variable antes de la coma", num_linea, parametros);
                 return false;
             }
 
             char* despues = params + 1;
             while (*despues && isspace(*despues)) despues++;
             if (*despues == '\0' || *despues == ':') {
-                mostrar_error("Error en la lista de parametros: falta variable después de la coma", num_linea, parametros);
                 free(copia);
+                mostrar_error("Error en la lista de parametros: falta variable después de la coma", num_linea, parametros);
                 return false;
             }
         }
-        token = strtok(NULL, ":");
+        token = strtok_r(NULL, ":", &contexto);
     }
     free(copia);
     return true;
 }
 
-Nodo* crear_nodo(const char* tipo, const char* valor) {
-    Nodo* nodo = (Nodo*)malloc(sizeof(Nodo));
-    strcpy(nodo->tipo, tipo);
-    strcpy(nodo->valor, valor);
-    nodo->hijos = NULL;
-    nodo->num_hijos = 0;
+void* arena_reservar(Arena* arena, size_t tam) {
+    tam = (tam + 15) & ~(size_t)15;
+    BloqueArena* bloque = arena->actual;
+    if (bloque == NULL || bloque->usado + tam > bloque->capacidad) {
+        size_t capacidad = tam > TAM_BLOQUE_ARENA ? tam : TAM_BLOQUE_ARENA;
+        bloque = (BloqueArena*)malloc(sizeof(BloqueArena) + capacidad);
+        if (bloque == NULL) {
+            fprintf(salida_errores, "Error: Memoria insuficiente para el arbol\n");
+            abortar_analisis();
+        }
+        bloque->siguiente = arena->actual;
+        bloque->usado = 0;
+        bloque->capacidad = capacidad;
+        arena->actual = bloque;
+    }
+    void* ptr = bloque->datos + bloque->usado;
+    bloque->usado += tam;
+    return ptr;
+}
+
+// Vuelve la arena a una posicion anterior liberando los bloques pedidos despues
+void arena_restaurar(Arena* arena, BloqueArena* bloque, size_t usado) {
+    while (arena->actual != bloque) {
+        BloqueArena* siguiente = arena->actual->siguiente;
+        free(arena->actual);
+        arena->actual = siguiente;
+    }
+    if (bloque != NULL) {
+        bloque->usado = usado;
+    }
+}
+
+// Libera de una vez todos los nodos y cadenas del analisis
+void arena_liberar(Arena* arena) {
+    BloqueArena* bloque = arena->actual;
+    while (bloque != NULL) {
+        BloqueArena* siguiente = bloque->siguiente;
+        free(bloque);
+        bloque = siguiente;
+    }
+    arena->actual = NULL;
+}
+
+// FNV-1a distinguiendo mayusculas, a diferencia de hash_nombre
+unsigned int hash_cadena(const char* texto) {
+    unsigned int hash = 2166136261u;
+    while (*texto) {
+        hash ^= (unsigned char)*texto++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+unsigned int internar_cadena(const char* texto) {
+    TablaCadenas* t = &cadenas_arbol;
+    if (2 * (t->num_textos + 1) > t->tam_indice) {
+        int tam = t->tam_indice ? t->tam_indice * 2 : 1024;
+        int* indice = (int*)calloc(tam, sizeof(int));
+        if (indice == NULL) {
+            fprintf(salida_errores, "Error: Memoria insuficiente para el arbol\n");
+            abortar_analisis();
+        }
+        for (int i = 0; i < t->num_textos; i++) {
+            unsigned int pos = hash_cadena(t->textos[i]) & (tam - 1);
+            while (indice[pos] != 0) pos = (pos + 1) & (tam - 1);
+            indice[pos] = i + 1;
+        }
+        free(t->indice);
+        t->indice = indice;
+        t->tam_indice = tam;
+    }
+    unsigned int pos = hash_cadena(texto) & (t->tam_indice - 1);
+    while (t->indice[pos] != 0) {
+        CONTAR(CONTADOR_SONDEOS, 1);
+        int id = t->indice[pos] - 1;
+        if (strcmp(t->textos[id], texto) == 0) return id;
+        pos = (pos + 1) & (t->tam_indice - 1);
+    }
+    if (t->num_textos == t->capacidad) {
+        int capacidad = t->capacidad ? t->capacidad * 2 : 512;
+        const char** textos = (const char**)realloc(t->textos, capacidad * sizeof(char*));
+        if (textos == NULL) {
+            fprintf(salida_errores, "Error: Memoria insuficiente para el arbol\n");
+            abortar_analisis();
+        }
+        t->textos = textos;
+        t->capacidad = capacidad;
+    }
+    size_t len = strlen(texto);
+    char* copia = (char*)arena_reservar(&arena_arbol, len + 1);
+    memcpy(copia, texto, len + 1);
+    t->textos[t->num_textos] = copia;
+    t->indice[pos] = t->num_textos + 1;
+    return t->num_textos++;
+}
+
+// Libera los nodos y la tabla de cadenas del analisis actual
+void liberar_arbol() {
+    arena_liberar(&arena_arbol);
+    free(cadenas_arbol.textos);
+    free(cadenas_arbol.indice);
+    free(cadenas_arbol.tipos);
+    free(cadenas_arbol.generaciones);
+    memset(&cadenas_arbol, 0, sizeof(cadenas_arbol));
+}
+
+Nodo* crear_nodo(TipoNodo tipo, const char* valor) {
+    Nodo* nodo = (Nodo*)arena_reservar(&arena_arbol, sizeof(Nodo));
+    nodo->tipo = (unsigned char)tipo;
+    nodo->valor = internar_cadena(valor);
+    nodo->linea = fuente_arbol ? fuente_arbol->linea_actual : 0;
+    CONTAR(CONTADOR_NODOS, 1);
+    nodo->primer_hijo = NULL;
+    nodo->ultimo_hijo = NULL;
+    nodo->siguiente = NULL;
     return nodo;
 }
 
 void agregar_hijo(Nodo* padre, Nodo* hijo) {
-    padre->num_hijos++;
-    padre->hijos = (Nodo**)realloc(padre->hijos, padre->num_hijos * sizeof(Nodo*));
-    padre->hijos[padre->num_hijos - 1] = hijo;
+    if (padre->ultimo_hijo == NULL) {
+        padre->primer_hijo = hijo;
+    } else {
+        padre->ultimo_hijo->siguiente = hijo;
+    }
+    padre->ultimo_hijo = hijo;
+}
+
+#define ES_PALABRA(lit) (memcmp(p, lit, sizeof(lit) - 1) == 0)
+
+// Reconoce una palabra clave (en minusculas) con un switch sobre longitud y primera letra
+PalabraClave reconocer_palabra_clave(const char* p, int len) {
+    switch (len) {
+        case 2:
+            switch (p[0]) {
+                case 'd': if (ES_PALABRA("do")) return PALABRA_DO; break;
+                case 't': if (ES_PALABRA("to")) return PALABRA_TO; break;
+                case 'o': if (ES_PALABRA("of")) return PALABRA_OF; break;
+                case 'i': if (ES_PALABRA("if")) return PALABRA_IF; break;
+            }
+            break;
+        case 3:
+            switch (p[0]) {
+                case 'e': if (ES_PALABRA("end")) return PALABRA_END; break;
+                case 'f': if (ES_PALABRA("for")) return PALABRA_FOR; break;
+                case 'v': if (ES_PALABRA("var")) return PALABRA_VAR; break;
+            }
+            break;
+        case 4:
+            switch (p[0]) {
+                case 't':
+                    if (ES_PALABRA("then")) return PALABRA_THEN;
+                    if (ES_PALABRA("type")) return PALABRA_TYPE;
+                    break;
+                case 'e': if (ES_PALABRA("else")) return PALABRA_ELSE; break;
+                case 'c': if (ES_PALABRA("case")) return PALABRA_CASE; break;
+            }
+            break;
+        case 5:
+            switch (p[0]) {
+                case 'b': if (ES_PALABRA("begin")) return PALABRA_BEGIN; break;
+                case 'w': if (ES_PALABRA("while")) return PALABRA_WHILE; break;
+                case 'u': if (ES_PALABRA("until")) return PALABRA_UNTIL; break;
+                case 'c': if (ES_PALABRA("const")) return PALABRA_CONST; break;
+                case 'a': if (ES_PALABRA("array")) return PALABRA_ARRAY; break;
+            }
+            break;
+        case 6:
+            switch (p[0]) {
+                case 'd': if (ES_PALABRA("downto")) return PALABRA_DOWNTO; break;
+                case 'r':
+                    if (ES_PALABRA("repeat")) return PALABRA_REPEAT;
+                    if (ES_PALABRA("record")) return PALABRA_RECORD;
+                    break;
+            }
+            break;
+        case 8:
+            if (ES_PALABRA("function")) return PALABRA_FUNCTION;
+            break;
+        case 9:
+            if (ES_PALABRA("procedure")) return PALABRA_PROCEDURE;
+            break;
+    }
+    return PALABRA_NINGUNA;
+}
+
+#undef ES_PALABRA
+
+// Igual que reconocer_palabra_clave pero sin distinguir mayusculas, para el tokenizador
+PalabraClave clasificar_palabra(const char* inicio, int longitud) {
+    char minusculas[9];
+    if (longitud < 2 || longitud > (int)sizeof(minusculas)) {
+        return PALABRA_NINGUNA;
+    }
+    for (int i = 0; i < longitud; i++) {
+        minusculas[i] = (char)tolower((unsigned char)inicio[i]);
+    }
+    return reconocer_palabra_clave(minusculas, longitud);
+}
+
+// Palabras clave de palabras_clave[], es decir sin contar 'if'
+bool es_palabra_clave(const char* palabra) {
+    PalabraClave id = reconocer_palabra_clave(palabra, strlen(palabra));
+    return id >= PALABRA_BEGIN && id <= PALABRA_PROCEDURE;
+}
+
+// Lee el siguiente token de texto[pos..fin); devuelve la posicion siguiente o -1 si no hay mas
+int escanear_token(const char* texto, int pos, int fin, Token* token) {
+    while (pos < fin && isspace((unsigned char)texto[pos])) {
+        pos++;
+    }
+    if (pos >= fin) {
+        return -1;
+    }
+
+    int inicio = pos;
+    char c = texto[pos];
+    token->palabra = PALABRA_NINGUNA;
+
+    if (isalpha((unsigned char)c) || c == '_') {
+        while (pos < fin && (isalnum((unsigned char)texto[pos]) || texto[pos] == '_')) pos++;
+        token->tipo = TOKEN_IDENTIFICADOR;
+        token->palabra = clasificar_palabra(texto + inicio, pos - inicio);
+    } else if (isdigit((unsigned char)c)) {
+        while (pos < fin && isdigit((unsigned char)texto[pos])) pos++;
+        if (pos + 1 < fin && texto[pos] == '.' && isdigit((unsigned char)texto[pos + 1])) {
+            pos++;
+            while (pos < fin && isdigit((unsigned char)texto[pos])) pos++;
+        }
+        token->tipo = TOKEN_NUMERO;
+    } else if (c == '\'' || c == '"') {
+        pos++;
+        while (pos < fin) {
+            if (texto[pos] == c) {
+                if (c == '\'' && pos + 1 < fin && texto[pos + 1] == '\'') {
+                    pos += 2;
+                    continue;
+                }
+                pos++;
+                break;
+            }
+            pos++;
+        }
+        token->tipo = TOKEN_CADENA;
+    } else if (c == ':' && pos + 1 < fin && texto[pos + 1] == '=') {
+        pos += 2;
+        token->tipo = TOKEN_ASIGNACION;
+    } else if (c == '<' || c == '>' || c == '=') {
+        pos++;
+        if (pos < fin && ((c == '<' && (texto[pos] == '>' || texto[pos] == '=')) || (c == '>' && texto[pos] == '='))) {
+            pos++;
+        }
+        token->tipo = TOKEN_COMPARACION;
+    } else if (c == '+' || c == '-' || c == '*' || c == '/') {
+        pos++;
+        token->tipo = TOKEN_OPERADOR;
+    } else {
+        pos++;
+        token->tipo = TOKEN_PUNTUACION;
+    }
+
+    token->offset = inicio;
+    token->longitud = pos - inicio;
+    return pos;
 }
 
-void extraer_condicion_while(const char* linea, char* condicion) {
-    const char* inicio_while = strstr(linea, "while");  
-    if (inicio_while != NULL) {
-        inicio_while += 5;
-        while (*inicio_while && isspace(*inicio_while)) {
-            inicio_while++;
+// Lo que no se puede proyectar (tuberias, la entrada estandar, Windows) se lee completo, por
+// bloques, a un buffer por hilo que queda para el archivo siguiente; vale hasta la proxima carga del hilo.
+// Se leen a lo sumo maximo bytes, (size_t)-1 para leer hasta el final
+#define TAM_BLOQUE_LECTURA (64 * 1024)
+
+LOCAL_HILO char* buffer_lectura;
+LOCAL_HILO size_t capacidad_lectura;
+
+bool leer_flujo(Fuente* fuente, FILE* archivo, size_t maximo) {
+    fuente->longitud = 0;
+    while (fuente->longitud < maximo) {
+        if (capacidad_lectura - fuente->longitud < TAM_BLOQUE_LECTURA) {
+            size_t capacidad = capacidad_lectura ? capacidad_lectura * 2 : 4 * TAM_BLOQUE_LECTURA;
+            char* nuevo = (char*)realloc(buffer_lectura, capacidad);
+            if (nuevo == NULL) {
+                return false;
+            }
+            buffer_lectura = nuevo;
+            capacidad_lectura = capacidad;
+        }
+        size_t libre = capacidad_lectura - fuente->longitud;
+        size_t leido = fread(buffer_lectura + fuente->longitud, 1, maximo - fuente->longitud < libre ? maximo - fuente->longitud : libre, archivo);
+        if (leido == 0) {
+            break;
         }
+        fuente->longitud += leido;
+    }
+    fuente->texto = fuente->longitud > 0 ? buffer_lectura : "";
+    return !ferror(archivo);
+}
+
+void liberar_buffer_lectura() {
+    free(buffer_lectura);
+    buffer_lectura = NULL;
+    capacidad_lectura = 0;
+}
 
-        const char* fin_do = strstr(inicio_while, "do");
-        if (fin_do != NULL) {
-            size_t longitud = fin_do - inicio_while;
-            strncpy(condicion, inicio_while, longitud);
-            condicion[longitud] = '\0';  
+// Proyecta el archivo en memoria de solo lectura; todas las pasadas y lectores comparten esa vista.
+// La ruta "-" es la entrada estandar
+bool cargar_fuente(Fuente* fuente, const char* ruta) {
+    memset(fuente, 0, sizeof(Fuente));
+    if (strcmp(ruta, "-") == 0) {
+        if (!leer_flujo(fuente, stdin, (size_t)-1)) {
+            return false;
+        }
+        indexar_fuente(fuente);
+        return true;
+    }
+#ifndef _WIN32
+    int fd = open(ruta, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        fuente->longitud = (size_t)info.st_size;
+        if (fuente->longitud == 0) {
+            fuente->texto = "";
         } else {
-            condicion[0] = '\0';  
+            void* mapa = mmap(NULL, fuente->longitud, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapa != MAP_FAILED) {
+                madvise(mapa, fuente->longitud, MADV_SEQUENTIAL);
+                fuente->texto = (const char*)mapa;
+                fuente->mapeado = true;
+            }
+        }
+    }
+    close(fd);
+#endif
+    if (fuente->texto == NULL) {
+        FILE* archivo = fopen(ruta, "rb");
+        if (!archivo) {
+            return false;
+        }
+        bool leido = leer_flujo(fuente, archivo, (size_t)-1);
+        fclose(archivo);
+        if (!leido) {
+            return false;
+        }
+    }
+    indexar_fuente(fuente);
+    return true;
+}
+
+// Registra donde empieza cada linea y tokeniza el texto una sola vez
+void indexar_fuente(Fuente* fuente) {
+    int capacidad_lineas = 64;
+    fuente->inicio_lineas = (int*)malloc(capacidad_lineas * sizeof(int));
+    fuente->primer_token = (int*)malloc((capacidad_lineas + 1) * sizeof(int));
+    fuente->capacidad_tokens = 256;
+    fuente->tokens = (Token*)malloc(fuente->capacidad_tokens * sizeof(Token));
+    fuente->tam_linea = 256;
+
+    int pos = 0;
+    int len = (int)fuente->longitud;
+    while (pos < len) {
+        if (fuente->num_lineas == capacidad_lineas) {
+            capacidad_lineas *= 2;
+            fuente->inicio_lineas = (int*)realloc(fuente->inicio_lineas, capacidad_lineas * sizeof(int));
+            fuente->primer_token = (int*)realloc(fuente->primer_token, (capacidad_lineas + 1) * sizeof(int));
+        }
+        const char* salto = memchr(fuente->texto + pos, '\n', len - pos);
+        int fin = salto ? (int)(salto - fuente->texto) : len;
+        fuente->inicio_lineas[fuente->num_lineas] = pos;
+        fuente->primer_token[fuente->num_lineas] = fuente->num_tokens;
+        if ((size_t)(fin - pos) + 1 > fuente->tam_linea) {
+            fuente->tam_linea = (size_t)(fin - pos) + 1;
+        }
+
+        Token token;
+        int p = pos;
+        while ((p = escanear_token(fuente->texto, p, fin, &token)) >= 0) {
+            if (fuente->num_tokens == fuente->capacidad_tokens) {
+                fuente->capacidad_tokens *= 2;
+                fuente->tokens = (Token*)realloc(fuente->tokens, fuente->capacidad_tokens * sizeof(Token));
+            }
+            token.linea = fuente->num_lineas;
+            fuente->tokens[fuente->num_tokens++] = token;
+        }
+        fuente->num_lineas++;
+        pos = fin + 1;
+    }
+    fuente->primer_token[fuente->num_lineas] = fuente->num_tokens;
+    fuente->linea_actual = 0;
+    CONTAR(CONTADOR_TOKENS, fuente->num_tokens);
+}
+
+// El texto leido por bloques es del buffer del hilo y no se libera aqui
+void liberar_fuente(Fuente* fuente) {
+#ifndef _WIN32
+    if (fuente->mapeado) {
+        munmap((void*)fuente->texto, fuente->longitud);
+    }
+#endif
+    free(fuente->inicio_lineas);
+    free(fuente->primer_token);
+    free(fuente->tokens);
+    memset(fuente, 0, sizeof(Fuente));
+}
+
+VistaLinea obtener_linea(const Fuente* fuente, int i) {
+    VistaLinea vista;
+    int inicio = fuente->inicio_lineas[i];
+    int fin = i + 1 < fuente->num_lineas ? fuente->inicio_lineas[i + 1] - 1 : (int)fuente->longitud;
+    vista.inicio = fuente->texto + inicio;
+    vista.longitud = fin - inicio;
+    return vista;
+}
+
+// Buffer de trabajo con espacio para la linea mas larga del archivo
+char* nuevo_buffer_linea(const Fuente* fuente) {
+    return (char*)malloc(fuente->tam_linea);
+}
+
+// Reemplaza a fgets: copia la siguiente linea y entrega sus tokens ya calculados
+bool leer_linea(Fuente* fuente, char* buffer, size_t tam, VistaTokens* vista) {
+    if (fuente->linea_actual >= fuente->num_lineas) {
+        return false;
+    }
+    int i = fuente->linea_actual++;
+    CONTAR(CONTADOR_LINEAS, 1);
+    VistaLinea linea = obtener_linea(fuente, i);
+    int inicio = fuente->inicio_lineas[i];
+    size_t len = linea.longitud;
+    if (len > tam - 1) {
+        len = tam - 1;
+    }
+    memcpy(buffer, linea.inicio, len);
+    buffer[len] = '\0';
+
+    if (vista) {
+        vista->texto = fuente->texto;
+        vista->tokens = fuente->tokens + fuente->primer_token[i];
+        vista->num_tokens = fuente->primer_token[i + 1] - fuente->primer_token[i];
+        while (vista->num_tokens > 0 &&
+               vista->tokens[vista->num_tokens - 1].offset + vista->tokens[vista->num_tokens - 1].longitud > inicio + (int)len) {
+            vista->num_tokens--;
+        }
+    }
+    return true;
+}
+
+bool vista_empieza_con(VistaTokens vista, PalabraClave palabra) {
+    return vista.num_tokens > 0 && vista.tokens[0].palabra == palabra;
+}
+
+int vista_buscar(VistaTokens vista, TipoToken tipo, int desde) {
+    for (int i = desde; i < vista.num_tokens; i++) {
+        if (vista.tokens[i].tipo == tipo) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int vista_buscar_palabra(VistaTokens vista, PalabraClave palabra, int desde) {
+    for (int i = desde; i < vista.num_tokens; i++) {
+        if (vista.tokens[i].palabra == palabra) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool vista_contiene_palabra_clave(VistaTokens vista) {
+    for (int i = 0; i < vista.num_tokens; i++) {
+        if (vista.tokens[i].palabra >= PALABRA_BEGIN && vista.tokens[i].palabra <= PALABRA_PROCEDURE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool token_es_identificador(const char* texto, const Token* token, const char* nombre) {
+    int len = strlen(nombre);
+    return token->tipo == TOKEN_IDENTIFICADOR && token->longitud == len &&
+           strncasecmp(texto + token->offset, nombre, len) == 0;
+}
+
+bool vista_contiene_identificador(VistaTokens vista, const char* nombre) {
+    for (int i = 0; i < vista.num_tokens; i++) {
+        if (token_es_identificador(vista.texto, &vista.tokens[i], nombre)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool vista_empieza_con_identificador(VistaTokens vista, const char* nombre) {
+    return vista.num_tokens > 0 && token_es_identificador(vista.texto, &vista.tokens[0], nombre);
+}
+
+bool vista_es_llamada_funcion(VistaTokens vista) {
+    return vista.num_tokens >= 2 && vista.tokens[0].tipo == TOKEN_IDENTIFICADOR &&
+           vista.tokens[1].tipo == TOKEN_PUNTUACION && vista.texto[vista.tokens[1].offset] == '(';
+}
+
+// Posicion del token i dentro de una copia recortada (trim) de su linea
+const char* token_en_linea(const char* linea, VistaTokens vista, int i) {
+    return linea + (vista.tokens[i].offset - vista.tokens[0].offset);
+}
+
+void copiar_fragmento(char* destino, size_t tam, const char* inicio, const char* fin) {
+    size_t len = fin > inicio ? (size_t)(fin - inicio) : 0;
+    if (len > tam - 1) {
+        len = tam - 1;
+    }
+    memcpy(destino, inicio, len);
+    destino[len] = '\0';
+}
+
+// Ubica el primer ':=' real de la linea, ignorando el contenido de cadenas
+const char* buscar_asignacion(const char* linea) {
+    Token token;
+    int len = strlen(linea);
+    int pos = 0;
+    while ((pos = escanear_token(linea, pos, len, &token)) >= 0) {
+        if (token.tipo == TOKEN_ASIGNACION) {
+            return linea + token.offset;
         }
-    } else {
-        condicion[0] = '\0';  
     }
+    return NULL;
+}
+
+// Copia el texto entre la palabra que abre (if/while) y la que cierra (then/do)
+void extraer_condicion(const char* linea, VistaTokens vista, PalabraClave abre, PalabraClave cierra, char* condicion, size_t tam) {
+    int i = vista_buscar_palabra(vista, abre, 0);
+    int j = i >= 0 ? vista_buscar_palabra(vista, cierra, i + 1) : -1;
+    if (i < 0 || j < 0) {
+        condicion[0] = '\0';
+        return;
+    }
+    const char* fin = token_en_linea(linea, vista, j);
+    const char* inicio = j > i + 1 ? token_en_linea(linea, vista, i + 1) : fin;
+    copiar_fragmento(condicion, tam, inicio, fin);
+}
+
+void extraer_condicion_while(const char* linea, VistaTokens vista, char* condicion, size_t tam) {
+    extraer_condicion(linea, vista, PALABRA_WHILE, PALABRA_DO, condicion, tam);
 }
 
 void obtenerNombreFuncion(const char* linea, char* nombre, size_t tam) {
@@ -467,7 +2083,7 @@ void obtenerNombreFuncion(const char* linea, char* nombre, size_t tam) {
 
     toLowerCase(nombre);
     
-    printf("DEBUG: nombre de funcion extraida: '%s' en la linea '%s'\n", nombre, linea);
+    TRAZA(TRAZA_DECLARACIONES, TRAZA_DETALLE, "nombre de funcion extraida: '%s' en la linea '%s'\n", nombre, linea);
 }
 
 void obtenerNombreProcedure(const char* linea, char* nombre, size_t tam) {
@@ -530,26 +2146,8 @@ bool ends_with(const char* str, const char* suffix) {
     return strncmp(str + str_len - suffix_len, suffix, suffix_len) == 0;
 }
 
-void extraer_condicion_if(const char* linea, char* condicion) {
-    const char* inicio_if = strstr(linea, "if");  
-    if (inicio_if != NULL) {
-        inicio_if += 2;
-
-        while (*inicio_if && isspace(*inicio_if)) {
-            inicio_if++;
-        }
-
-        const char* fin_then = strstr(inicio_if, "then");
-        if (fin_then != NULL) {
-            size_t longitud = fin_then - inicio_if;
-            strncpy(condicion, inicio_if, longitud);
-            condicion[longitud] = '\0';  
-        } else {
-            condicion[0] = '\0';  
-        }
-    } else {
-        condicion[0] = '\0'; 
-    }
+void extraer_condicion_if(const char* linea, VistaTokens vista, char* condicion, size_t tam) {
+    extraer_condicion(linea, vista, PALABRA_IF, PALABRA_THEN, condicion, tam);
 }
 
 bool starts_with_case_insensitive(const char* str, const char* prefix) {
@@ -566,23 +2164,23 @@ bool starts_with_case_insensitive(const char* str, const char* prefix) {
     return true;
 }
 
-bool validar_condicion_for(const char* linea, int num_linea) {
-    if (!starts_with_case_insensitive(linea, "for ")) {
+bool validar_condicion_for(const char* linea, VistaTokens vista, int num_linea) {
+    if (!vista_empieza_con(vista, PALABRA_FOR)) {
         mostrar_error("La estructura for debe comenzar con 'for'", num_linea, linea);
         return false;
     }
     
-    if (strstr(linea, ":=") == NULL) {
+    if (vista_buscar(vista, TOKEN_ASIGNACION, 0) < 0) {
         mostrar_error("La estructura for debe contener una asignación (:=)", num_linea, linea);
         return false;
     }
     
-    if (strstr(linea, " to ") == NULL && strstr(linea, " downto ") == NULL) {
+    if (vista_buscar_palabra(vista, PALABRA_TO, 0) < 0 && vista_buscar_palabra(vista, PALABRA_DOWNTO, 0) < 0) {
         mostrar_error("La estructura for debe contener 'to' o 'downto'", num_linea, linea);
         return false;
     }
     
-    if (!ends_with(linea, "do")) {
+    if (vista.tokens[vista.num_tokens - 1].palabra != PALABRA_DO) {
         mostrar_error("La estructura for debe terminar con 'do'", num_linea, linea);
         return false;
     }
@@ -591,60 +2189,52 @@ bool validar_condicion_for(const char* linea, int num_linea) {
 }
 
 
-void extraer_condicion_for(const char* linea, char* inicializacion, char* operador_control, char* final) {
-    const char* ptr = linea + 4;
-    while (*ptr && isspace(*ptr)) ptr++;
-    
-    const char* asignacion_pos = strstr(ptr, ":=");
-    if (asignacion_pos == NULL) {
+// inicializacion y final reciben pedazos de la linea, asi que alcanza con buffers de su largo
+void extraer_condicion_for(const char* linea, VistaTokens vista, char* inicializacion, char* operador_control, char* final,
+                           size_t tam) {
+    int asignacion = vista_buscar(vista, TOKEN_ASIGNACION, 1);
+    if (asignacion < 0) {
         strcpy(inicializacion, "");
         strcpy(operador_control, "");
         strcpy(final, "");
         return;
     }
     
-    size_t var_len = asignacion_pos - ptr;
-    char variable[50];
-    strncpy(variable, ptr, var_len);
-    variable[var_len] = '\0';
+    size_t len = strlen(linea) + 1;
+    char* variable = (char*)malloc(2 * len);
+    char* valor_inicial = variable + len;
+    copiar_fragmento(variable, len, token_en_linea(linea, vista, 1), token_en_linea(linea, vista, asignacion));
     trim(variable);
 
-    const char* to_pos = strstr(ptr, " to ");
-    const char* downto_pos = strstr(ptr, " downto ");
+    int to = vista_buscar_palabra(vista, PALABRA_TO, asignacion);
+    int downto = vista_buscar_palabra(vista, PALABRA_DOWNTO, asignacion);
     
-    const char* op_pos = NULL;
-    if (to_pos != NULL && (downto_pos == NULL || to_pos < downto_pos)) {
-        op_pos = to_pos;
+    int op = -1;
+    if (to >= 0 && (downto < 0 || to < downto)) {
+        op = to;
         strcpy(operador_control, "to");
-    } else if (downto_pos != NULL) {
-        op_pos = downto_pos;
+    } else if (downto >= 0) {
+        op = downto;
         strcpy(operador_control, "downto");
     } else {
         strcpy(inicializacion, "");
         strcpy(operador_control, "");
         strcpy(final, "");
+        free(variable);
         return;
     }
     
-    const char* valor_inicial_pos = asignacion_pos + 2;
-    while (*valor_inicial_pos && isspace(*valor_inicial_pos)) valor_inicial_pos++;
-    
-    size_t valor_inicial_len = op_pos - valor_inicial_pos;
-    char valor_inicial[50];
-    strncpy(valor_inicial, valor_inicial_pos, valor_inicial_len);
-    valor_inicial[valor_inicial_len] = '\0';
+    const char* fin_asignacion = token_en_linea(linea, vista, asignacion) + vista.tokens[asignacion].longitud;
+    copiar_fragmento(valor_inicial, len, fin_asignacion, token_en_linea(linea, vista, op));
     trim(valor_inicial);
     
-    sprintf(inicializacion, "%s := %s", variable, valor_inicial);
+    snprintf(inicializacion, tam, "%s := %s", variable, valor_inicial);
+    free(variable);
     
-    ptr = op_pos + strlen(operador_control) + 1;
-    while (*ptr && isspace(*ptr)) ptr++;
-    
-    const char* do_pos = strstr(ptr, " do");
-    if (do_pos != NULL) {
-        size_t final_len = do_pos - ptr;
-        strncpy(final, ptr, final_len);
-        final[final_len] = '\0';
+    int fin_do = vista_buscar_palabra(vista, PALABRA_DO, op + 1);
+    if (fin_do >= 0) {
+        const char* fin_op = token_en_linea(linea, vista, op) + vista.tokens[op].longitud;
+        copiar_fragmento(final, tam, fin_op, token_en_linea(linea, vista, fin_do));
         trim(final);
     } else {
         strcpy(final, "");
@@ -726,25 +2316,10 @@ void toLowerCase(char *str) {
     }
 }
 
-bool contiene_palabra_clave(const char *cadena, const char *array[], int tam_array) {
-    char *copia = strdup(cadena);
-    char *token = strtok(copia, " ,.;()[]{}<>+-*/=!:\"\'\t\n\r"); 
-    while (token != NULL) {
-        for (int i = 0; i < tam_array; i++) {
-            if (strcmp(token, array[i]) == 0) {
-                free(copia);
-                return true;
-            }
-        }
-        token = strtok(NULL, " ,.;()[]{}<>+-*/=!:\"\'\t\n\r");
-    }
-    free(copia);
-    return false;
-}
-
 char **split_function(const char *str, int *count) {
     char *copia = strdup(str);
-    char **resultado = (char **)malloc(2 * sizeof(char *));
+    char **resultado = (char **)malloc(3 * sizeof(char *));
+    resultado[2] = NULL;
     *count = 1;  
 
     char *pos = strrchr(copia, ':'); 
@@ -758,6 +2333,8 @@ char **split_function(const char *str, int *count) {
         resultado[1] = strdup(pos + 1);
         *count = 2;  
     }
+    CONTAR(CONTADOR_DIVISIONES, 1);
+    CONTAR(CONTADOR_RESERVAS_SPLIT, 2 + *count);
 
     free(copia);
     return resultado;
@@ -828,77 +2405,544 @@ char* extraer_argumentos_funcion(const char* str) {
     return resultado;
 }
 
+// Libera lo que devuelven split y split_function
+void liberar_partes(char **partes) {
+    for (int i = 0; partes[i] != NULL; i++) {
+        free(partes[i]);
+    }
+    free(partes);
+}
+
 char **split(const char *str, const char *delim, int *count) {
     char *copia = strdup(str); 
     int capacidad = 10; 
     char **resultado = (char **)malloc(capacidad * sizeof(char *)); 
     int index = 0;
 
-    char *token = strtok(copia, delim);
+    char *contexto = NULL;
+    char *token = strtok_r(copia, delim, &contexto);
     while (token != NULL) { 
-        if (index >= capacidad) { 
+        if (index + 1 >= capacidad) { 
             capacidad *= 2;
             resultado = (char **)realloc(resultado, capacidad * sizeof(char *));
         }
         resultado[index++] = strdup(token);  
 
-        token = strtok(NULL, delim); 
+        token = strtok_r(NULL, delim, &contexto); 
     }
 
     resultado[index] = NULL;  
      *count = index; 
+    CONTAR(CONTADOR_DIVISIONES, 1);
+    CONTAR(CONTADOR_RESERVAS_SPLIT, 2 + index);
 
     free(copia); 
 
     return resultado; 
 }
 
-void mostrar_error(const char* mensaje, int linea, const char* detalle) {
-    fprintf(stderr, "Error en la linea %d: %s -> %s\n", linea+2, mensaje, detalle);
+void* anotar_reserva(void* memoria, bool es_partes) {
+    if (memoria == NULL) {
+        return NULL;
+    }
+    ListaReservas* lista = &reservas_en_uso;
+    if (lista->num_reservas == lista->capacidad) {
+        lista->capacidad = lista->capacidad ? lista->capacidad * 2 : 16;
+        lista->reservas = (Reserva*)realloc(lista->reservas, lista->capacidad * sizeof(Reserva));
+    }
+    lista->reservas[lista->num_reservas].memoria = memoria;
+    lista->reservas[lista->num_reservas].es_partes = es_partes;
+    lista->num_reservas++;
+    return memoria;
+}
+
+// Anota memoria que sigue en uso mientras se puede reportar un error; se libera con soltar
+void* retener(void* memoria) {
+    return anotar_reserva(memoria, false);
+}
+
+char** retener_partes(char** partes) {
+    return (char**)anotar_reserva(partes, true);
+}
+
+void liberar_reserva(Reserva reserva) {
+    if (reserva.es_partes) {
+        liberar_partes((char**)reserva.memoria);
+    } else {
+        free(reserva.memoria);
+    }
+}
+
+// Libera memoria retenida y la quita de la lista; casi siempre es la ultima anotada
+void soltar(void* memoria) {
+    ListaReservas* lista = &reservas_en_uso;
+    for (int i = lista->num_reservas - 1; memoria && i >= 0; i--) {
+        if (lista->reservas[i].memoria == memoria) {
+            liberar_reserva(lista->reservas[i]);
+            memmove(&lista->reservas[i], &lista->reservas[i + 1], (lista->num_reservas - i - 1) * sizeof(Reserva));
+            lista->num_reservas--;
+            return;
+        }
+    }
+}
+
+// Libera lo anotado desde la marca; los puntos de retorno la llaman despues de un salto
+void liberar_reservas(int marca) {
+    ListaReservas* lista = &reservas_en_uso;
+    while (lista->num_reservas > marca) {
+        liberar_reserva(lista->reservas[--lista->num_reservas]);
+    }
+    if (lista->num_reservas == 0) {
+        free(lista->reservas);
+        lista->reservas = NULL;
+        lista->capacidad = 0;
+    }
+}
+
+// Detiene el analisis del archivo actual; sin punto de retorno termina el proceso
+void abortar_analisis() {
+    if (salida_analisis) {
+        longjmp(*salida_analisis, 1);
+    }
     exit(1);
 }
 
+void agregar_diagnostico(Severidad severidad, int linea, const char* mensaje, const char* detalle, const TipoDato* tipos) {
+    if (diagnosticos.num_diagnosticos == diagnosticos.capacidad) {
+        diagnosticos.capacidad = diagnosticos.capacidad ? diagnosticos.capacidad * 2 : 16;
+        diagnosticos.diagnosticos = (Diagnostico*)realloc(diagnosticos.diagnosticos, diagnosticos.capacidad * sizeof(Diagnostico));
+    }
+    Diagnostico* diagnostico = &diagnosticos.diagnosticos[diagnosticos.num_diagnosticos++];
+    diagnostico->severidad = severidad;
+    diagnostico->linea = linea;
+    diagnostico->mensaje = strdup(mensaje);
+    diagnostico->detalle = detalle ? strdup(detalle) : NULL;
+    diagnostico->con_tipos = tipos != NULL;
+    if (tipos) {
+        diagnostico->tipos[0] = tipos[0];
+        diagnostico->tipos[1] = tipos[1];
+    }
+    if (severidad == SEVERIDAD_ERROR) {
+        diagnosticos.num_errores++;
+    }
+    if (cache_bloques.grabando && cache_bloques.dentro_de_operacion == 0) {
+        anotar_operacion(OP_DIAGNOSTICO, severidad, linea, false, mensaje, detalle, tipos);
+    }
+}
+
+void reportar_error(const char* mensaje, int linea, const char* detalle, const TipoDato* tipos) {
+    agregar_diagnostico(SEVERIDAD_ERROR, linea+2, mensaje, detalle, tipos);
+    if (max_errores > 0 && diagnosticos.num_errores >= max_errores) {
+        char nota[100];
+        snprintf(nota, sizeof(nota), "Se alcanzo el maximo de %d errores; se detiene el analisis", max_errores);
+        agregar_diagnostico(SEVERIDAD_NOTA, linea+2, nota, NULL, NULL);
+        abortar_analisis();
+    }
+}
+
+// El analisis sigue despues de un error; solo se detiene al llegar a max_errores
+void mostrar_error(const char* mensaje, int linea, const char* detalle) {
+    reportar_error(mensaje, linea, detalle, NULL);
+}
+
+// Los tipos viajan aparte del mensaje para que las salidas estructuradas den sus nombres
+void mostrar_error_tipos(const char* mensaje, int linea, const char* detalle, TipoDato esperado, TipoDato encontrado) {
+    TipoDato tipos[2] = {esperado, encontrado};
+    reportar_error(mensaje, linea, detalle, tipos);
+}
+
+// Se guarda la linea del archivo, como en los errores; el texto conserva la numeracion de siempre
 void mostrar_advertencia(const char* mensaje, int linea) {
-    fprintf(stderr, "Advertencia en la linea %d: %s\n", linea, mensaje);
+    agregar_diagnostico(SEVERIDAD_ADVERTENCIA, linea+2, mensaje, NULL, NULL);
 }
 
-int es_tipo_valido(const char* tipo) {
-    for (int i = 0; i < sizeof(tipos_validos) / sizeof(tipos_validos[0]); i++) {
-        if (strcmp(tipo, tipos_validos[i]) == 0) {
-            return true;  
+const char* nombres_tipo_dato[] = {"integer", "string", "real", "boolean", "char", "desconocido"};
+
+// Regla de cada diagnostico segun el comienzo de su mensaje; la primera que coincide gana
+typedef struct {
+    const char* prefijo;
+    const char* regla;
+} ReglaDiagnostico;
+
+const ReglaDiagnostico reglas_diagnostico[] = {
+    {"Tipos incompatibles en la asignacion", "tipo-asignacion"},
+    {"Tipos incompatibles en la expresion", "tipo-expresion"},
+    {"Tipo incompatible en el argumento", "tipo-argumento"},
+    {"Tipo de retorno incompatible", "tipo-retorno"},
+    {"Tipo de retorno de la funcion", "tipo-invalido"},
+    {"Tipo de dato no valido", "tipo-invalido"},
+    {"Numero incorrecto de argumentos", "numero-argumentos"},
+    {"La funcion '", "retorno-faltante"},
+    {"No se ha asignado", "retorno-faltante"},
+    {"Variable o funcion no declarada", "no-declarado"},
+    {"Funcion no declarada", "no-declarado"},
+    {"Variable ya declarada", "ya-declarado"},
+    {"Variable '", "sin-inicializar"},
+    {"Posible error tipogr", "errata"},
+    {"Palabra clave", "palabra-clave"},
+    {"Comando incorrecto", "palabra-clave"},
+    {"Se alcanzo el maximo", "limite-errores"},
+    {"Error al abrir el archivo", "archivo"},
+};
+
+#define REGLA_POR_DEFECTO "sintaxis"
+
+const char* regla_diagnostico(const char* mensaje) {
+    for (size_t i = 0; i < sizeof(reglas_diagnostico) / sizeof(reglas_diagnostico[0]); i++) {
+        if (strncmp(mensaje, reglas_diagnostico[i].prefijo, strlen(reglas_diagnostico[i].prefijo)) == 0) {
+            return reglas_diagnostico[i].regla;
         }
     }
-    return false; 
+    return REGLA_POR_DEFECTO;
 }
 
-void analizar_inicializacion_variables(Nodo* arbol, char* linea, int* num_linea, FILE* archivo, char* ultima_linea) {
-    char buffer[256];
-    trim((char*)linea);
-    Nodo* nodo_keyword = crear_nodo("palabra_clave", linea);
-    agregar_hijo(arbol, nodo_keyword);
-    int count = 0;
-    while(fgets(buffer, sizeof(buffer), archivo)) {
-        if (starts_with(buffer, "begin") || starts_with(buffer, "procedure") || starts_with(buffer, "function") || starts_with(buffer, "writeln")) {
-            break;
+// Columna (desde 1) donde aparece el detalle en la linea, o la del primer caracter visible; 0 si no se conoce
+int columna_diagnostico(const Fuente* fuente, const Diagnostico* diagnostico) {
+    if (fuente == NULL || diagnostico->linea < 1 || diagnostico->linea > fuente->num_lineas) {
+        return 0;
+    }
+    VistaLinea linea = obtener_linea(fuente, diagnostico->linea - 1);
+    const char* detalle = diagnostico->detalle;
+    while (detalle && isspace((unsigned char)*detalle)) {
+        detalle++;
+    }
+    int len = detalle ? (int)strlen(detalle) : 0;
+    if (len > 0) {
+        for (int i = 0; i + len <= linea.longitud; i++) {
+            if (strncasecmp(linea.inicio + i, detalle, len) == 0) {
+                return i + 1;
+            }
         }
-        (*num_linea)++;
-        trim(buffer);
-        if(buffer[0] == '\0'){
-            continue;
+    }
+    for (int i = 0; i < linea.longitud; i++) {
+        if (!isspace((unsigned char)linea.inicio[i])) {
+            return i + 1;
         }
-        if(!end_with_semicolon(buffer)){
-            mostrar_error("; faltante", *num_linea, buffer);
+    }
+    return 1;
+}
+
+// Texto de los diagnosticos de un archivo; se arma en memoria y sale con una sola escritura
+typedef struct {
+    char* datos;
+    size_t tam;
+    size_t capacidad;
+} Escritor;
+
+void escribir_va(Escritor* escritor, const char* formato, va_list args) {
+    while (true) {
+        size_t libre = escritor->capacidad - escritor->tam;
+        va_list copia;
+        va_copy(copia, args);
+        int n = vsnprintf(escritor->datos ? escritor->datos + escritor->tam : NULL, libre, formato, copia);
+        va_end(copia);
+        if (n < 0) {
+            return;
         }
-        trim_semicolon(buffer);
-        char** partesInicializacion = split(buffer, ":", &count);
-        Nodo* nodo_asignacion = crear_nodo("asignacion", buffer);
-        agregar_hijo(nodo_keyword, nodo_asignacion);
-        Nodo* nodo_variables = crear_nodo("variables", partesInicializacion[0]);
-        agregar_hijo(nodo_asignacion, nodo_variables);
-        char** partesVariableMismoTipo = split(partesInicializacion[0], ",", &count);
-        int numVariablesMismoTipo = contar_elementos(partesVariableMismoTipo);
-        if(numVariablesMismoTipo == 0){
-            mostrar_error("No se han declarado variables", *num_linea, buffer);
+        if ((size_t)n < libre) {
+            escritor->tam += n;
+            return;
+        }
+        size_t capacidad = escritor->capacidad ? escritor->capacidad * 2 : 4096;
+        while (capacidad - escritor->tam <= (size_t)n) {
+            capacidad *= 2;
+        }
+        escritor->datos = (char*)realloc(escritor->datos, capacidad);
+        escritor->capacidad = capacidad;
+    }
+}
+
+void escribir(Escritor* escritor, const char* formato, ...) {
+    va_list args;
+    va_start(args, formato);
+    escribir_va(escritor, formato, args);
+    va_end(args);
+}
+
+// Deja lugar para n bytes mas y devuelve donde van
+char* reservar_escritura(Escritor* escritor, size_t n) {
+    if (escritor->capacidad - escritor->tam < n || escritor->datos == NULL) {
+        size_t capacidad = escritor->capacidad ? escritor->capacidad * 2 : 4096;
+        while (capacidad - escritor->tam < n) {
+            capacidad *= 2;
+        }
+        escritor->datos = (char*)realloc(escritor->datos, capacidad);
+        escritor->capacidad = capacidad;
+    }
+    char* destino = escritor->datos + escritor->tam;
+    escritor->tam += n;
+    return destino;
+}
+
+// Sin formato, para los caminos calientes
+void escribir_bytes(Escritor* escritor, const char* texto, size_t n) {
+    memcpy(reservar_escritura(escritor, n), texto, n);
+}
+
+void escribir_texto(Escritor* escritor, const char* texto) {
+    escribir_bytes(escritor, texto, strlen(texto));
+}
+
+void escribir_repetido(Escritor* escritor, char c, size_t n) {
+    memset(reservar_escritura(escritor, n), c, n);
+}
+
+#define TAM_VACIADO_TRAZA (64 * 1024)
+
+LOCAL_HILO Escritor traza;
+
+void vaciar_traza() {
+    if (traza.tam > 0) {
+        fwrite(traza.datos, 1, traza.tam, stderr);
+        fflush(stderr);
+        traza.tam = 0;
+    }
+}
+
+void liberar_traza() {
+    vaciar_traza();
+    free(traza.datos);
+    memset(&traza, 0, sizeof(traza));
+}
+
+void trazar(SubsistemaTraza subsistema, const char* formato, ...) {
+    escribir(&traza, "[%s] ", nombres_subsistema_traza[subsistema]);
+    va_list args;
+    va_start(args, formato);
+    escribir_va(&traza, formato, args);
+    va_end(args);
+    if (traza.tam >= TAM_VACIADO_TRAZA) {
+        vaciar_traza();
+    }
+}
+
+// Lista separada por comas de subsistema[:nivel]; "todo" los activa a todos y sin nivel se usa el detallado
+bool configurar_traza(const char* lista) {
+    char* copia = strdup(lista);
+    char* contexto = NULL;
+    bool valida = true;
+    for (char* parte = strtok_r(copia, ",", &contexto); parte && valida; parte = strtok_r(NULL, ",", &contexto)) {
+        int nivel = TRAZA_DETALLE;
+        char* dos_puntos = strchr(parte, ':');
+        if (dos_puntos) {
+            *dos_puntos = '\0';
+            nivel = atoi(dos_puntos + 1);
+        }
+        valida = false;
+        for (int i = 0; i < NUM_SUBSISTEMAS_TRAZA; i++) {
+            if (strcmp(parte, "todo") == 0 || strcmp(parte, nombres_subsistema_traza[i]) == 0) {
+                niveles_traza[i] = nivel;
+                valida = true;
+            }
+        }
+    }
+    free(copia);
+    return valida;
+}
+
+// Cadena JSON entre comillas; los bytes de control van como \u00XX
+// El texto de una cadena JSON, sin las comillas
+void escribir_escapado(Escritor* escritor, const char* texto) {
+    const char* inicio = texto;
+    for (const char* p = texto; ; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c != '\0' && c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+        escribir_bytes(escritor, inicio, p - inicio);
+        if (c == '\0') {
+            break;
+        }
+        if (c == '"' || c == '\\') {
+            escribir(escritor, "\\%c", c);
+        } else if (c == '\n') {
+            escribir(escritor, "\\n");
+        } else {
+            escribir(escritor, "\\u%04x", c);
+        }
+        inicio = p + 1;
+    }
+}
+
+void escribir_json(Escritor* escritor, const char* texto) {
+    escribir_bytes(escritor, "\"", 1);
+    escribir_escapado(escritor, texto);
+    escribir_bytes(escritor, "\"", 1);
+}
+
+const char* nombres_severidad[] = {"error", "advertencia", "nota"};
+const char* niveles_sarif[] = {"error", "warning", "note"};
+
+void escribir_diagnostico_jsonl(Escritor* escritor, const char* ruta, const Diagnostico* diagnostico, int columna) {
+    escribir(escritor, "{\"archivo\":");
+    escribir_json(escritor, ruta);
+    escribir(escritor, ",\"regla\":\"%s\",\"severidad\":\"%s\",\"linea\":%d,\"columna\":%d,\"mensaje\":",
+             regla_diagnostico(diagnostico->mensaje), nombres_severidad[diagnostico->severidad],
+             diagnostico->linea, columna);
+    escribir_json(escritor, diagnostico->mensaje);
+    if (diagnostico->detalle) {
+        escribir(escritor, ",\"detalle\":");
+        escribir_json(escritor, diagnostico->detalle);
+    }
+    if (diagnostico->con_tipos) {
+        escribir(escritor, ",\"tipo_esperado\":\"%s\",\"tipo_encontrado\":\"%s\"",
+                 nombres_tipo_dato[diagnostico->tipos[0]], nombres_tipo_dato[diagnostico->tipos[1]]);
+    }
+    escribir(escritor, "}\n");
+}
+
+// Un elemento de results; los separa la coma que escribe quien los junta
+void escribir_diagnostico_sarif(Escritor* escritor, const char* ruta, const Diagnostico* diagnostico, int columna) {
+    escribir(escritor, "{\"ruleId\":\"%s\",\"level\":\"%s\",\"message\":{\"text\":",
+             regla_diagnostico(diagnostico->mensaje), niveles_sarif[diagnostico->severidad]);
+    escribir_json(escritor, diagnostico->mensaje);
+    escribir(escritor, "},\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":");
+    escribir_json(escritor, ruta);
+    escribir(escritor, "}");
+    if (diagnostico->linea >= 1) {
+        escribir(escritor, ",\"region\":{\"startLine\":%d", diagnostico->linea);
+        if (columna > 0) {
+            escribir(escritor, ",\"startColumn\":%d", columna);
+        }
+        escribir(escritor, "}");
+    }
+    escribir(escritor, "}}]");
+    if (diagnostico->detalle || diagnostico->con_tipos) {
+        escribir(escritor, ",\"properties\":{");
+        if (diagnostico->detalle) {
+            escribir(escritor, "\"detalle\":");
+            escribir_json(escritor, diagnostico->detalle);
+        }
+        if (diagnostico->con_tipos) {
+            escribir(escritor, "%s\"tipoEsperado\":\"%s\",\"tipoEncontrado\":\"%s\"", diagnostico->detalle ? "," : "",
+                     nombres_tipo_dato[diagnostico->tipos[0]], nombres_tipo_dato[diagnostico->tipos[1]]);
+        }
+        escribir(escritor, "}");
+    }
+    escribir(escritor, "}");
+}
+
+void abrir_documento_sarif(FILE* destino) {
+    fprintf(destino, "{\"version\":\"2.1.0\",\"$schema\":\"https://json.schemastore.org/sarif-2.1.0.json\","
+                     "\"runs\":[{\"tool\":{\"driver\":{\"name\":\"Semantico\",\"version\":\"%s\",\"rules\":[",
+            VERSION_ANALIZADOR);
+    size_t num_reglas = sizeof(reglas_diagnostico) / sizeof(reglas_diagnostico[0]);
+    for (size_t i = 0; i < num_reglas; i++) {
+        bool repetida = false;
+        for (size_t j = 0; j < i && !repetida; j++) {
+            repetida = strcmp(reglas_diagnostico[i].regla, reglas_diagnostico[j].regla) == 0;
+        }
+        if (!repetida) {
+            fprintf(destino, "{\"id\":\"%s\"},", reglas_diagnostico[i].regla);
+        }
+    }
+    fprintf(destino, "{\"id\":\"%s\"}]}},\"results\":[\n", REGLA_POR_DEFECTO);
+}
+
+void cerrar_documento_sarif(FILE* destino) {
+    fprintf(destino, "\n]}]}\n");
+    fflush(destino);
+}
+
+// Escribe todos los diagnosticos del archivo, en el orden en que se encontraron, con una sola
+// escritura y un solo vaciado. La fuente solo se usa para las columnas y puede ser NULL
+void volcar_diagnosticos(const char* ruta, const Fuente* fuente) {
+    CONTAR(CONTADOR_DIAGNOSTICOS, diagnosticos.num_diagnosticos);
+    Escritor escritor = {0};
+    for (int i = 0; i < diagnosticos.num_diagnosticos; i++) {
+        Diagnostico* diagnostico = &diagnosticos.diagnosticos[i];
+        switch (formato_diagnosticos) {
+            case FORMATO_JSONL:
+                escribir_diagnostico_jsonl(&escritor, ruta, diagnostico, columna_diagnostico(fuente, diagnostico));
+                continue;
+            case FORMATO_SARIF:
+                if (i > 0) {
+                    escribir(&escritor, ",\n");
+                }
+                escribir_diagnostico_sarif(&escritor, ruta, diagnostico, columna_diagnostico(fuente, diagnostico));
+                continue;
+            case FORMATO_TEXTO:
+                break;
+        }
+        switch (diagnostico->severidad) {
+            case SEVERIDAD_ERROR:
+                escribir(&escritor, "Error en la linea %d: %s -> %s\n", diagnostico->linea, diagnostico->mensaje, diagnostico->detalle);
+                break;
+            case SEVERIDAD_ADVERTENCIA:
+                escribir(&escritor, "Advertencia en la linea %d: %s\n", diagnostico->linea - 2, diagnostico->mensaje);
+                break;
+            case SEVERIDAD_NOTA:
+                escribir(&escritor, "Nota en la linea %d: %s\n", diagnostico->linea, diagnostico->mensaje);
+                break;
+        }
+    }
+    if (escritor.tam > 0) {
+        fwrite(escritor.datos, 1, escritor.tam, salida_errores);
+        fflush(salida_errores);
+    }
+    free(escritor.datos);
+    descartar_diagnosticos();
+}
+
+void descartar_diagnosticos() {
+    for (int i = 0; i < diagnosticos.num_diagnosticos; i++) {
+        free(diagnosticos.diagnosticos[i].mensaje);
+        free(diagnosticos.diagnosticos[i].detalle);
+    }
+    free(diagnosticos.diagnosticos);
+    diagnosticos.diagnosticos = NULL;
+    diagnosticos.num_diagnosticos = 0;
+    diagnosticos.capacidad = 0;
+    diagnosticos.num_errores = 0;
+}
+
+int es_tipo_valido(const char* tipo) {
+    return obtener_tipo_desde_string(tipo) != TIPO_DESCONOCIDO;
+}
+
+void analizar_inicializacion_variables(Nodo* arbol, char* linea, int* num_linea, Fuente* fuente, char* ultima_linea) {
+    char* buffer = (char*)retener(nuevo_buffer_linea(fuente));
+    buffer[0] = '\0';
+    VistaTokens vista;
+    trim((char*)linea);
+    Nodo* nodo_keyword = crear_nodo(NODO_PALABRA_CLAVE, linea);
+    agregar_hijo(arbol, nodo_keyword);
+    int count = 0;
+    while(leer_linea(fuente, buffer, fuente->tam_linea, &vista)) {
+        if (vista_empieza_con(vista, PALABRA_BEGIN) || vista_empieza_con(vista, PALABRA_PROCEDURE) ||
+            vista_empieza_con(vista, PALABRA_FUNCTION) || vista_empieza_con_identificador(vista, "writeln")) {
+            // Se devuelve la linea para que main analice la declaracion o el bloque que sigue
+            fuente->linea_actual--;
+            (*num_linea)--;
+            break;
+        }
+        (*num_linea)++;
+        trim(buffer);
+        if(buffer[0] == '\0'){
+            continue;
+        }
+        if(!end_with_semicolon(buffer)){
+            mostrar_error("; faltante", *num_linea, buffer);
+        }
+        trim_semicolon(buffer);
+        char** partesInicializacion = retener_partes(split(buffer, ":", &count));
+        int numPartesInicializacion = count;
+        if (numPartesInicializacion < 2) {
+            mostrar_error("Se esperaba ':' seguido del tipo de dato", *num_linea, buffer);
+            soltar(partesInicializacion);
+            continue;
+        }
+        Nodo* nodo_asignacion = crear_nodo(NODO_ASIGNACION, buffer);
+        agregar_hijo(nodo_keyword, nodo_asignacion);
+        Nodo* nodo_variables = crear_nodo(NODO_VARIABLES, partesInicializacion[0]);
+        agregar_hijo(nodo_asignacion, nodo_variables);
+        char** partesVariableMismoTipo = retener_partes(split(partesInicializacion[0], ",", &count));
+        int numVariablesMismoTipo = contar_elementos(partesVariableMismoTipo);
+        if(numVariablesMismoTipo == 0){
+            mostrar_error("No se han declarado variables", *num_linea, buffer);
+            soltar(partesVariableMismoTipo);
+            soltar(partesInicializacion);
+            continue;
         }
         
         trim(partesInicializacion[1]);
@@ -908,7 +2952,7 @@ void analizar_inicializacion_variables(Nodo* arbol, char* linea, int* num_linea,
         if(numVariablesMismoTipo > 1){
             for(int i = 0; i < numVariablesMismoTipo; i++){
                 trim(partesVariableMismoTipo[i]);
-                Nodo* nodo_variable = crear_nodo("variable", partesVariableMismoTipo[i]);
+                Nodo* nodo_variable = crear_nodo(NODO_VARIABLE, partesVariableMismoTipo[i]);
                 agregar_hijo(nodo_variables, nodo_variable);
                 
                 if (variable_existe(partesVariableMismoTipo[i])) {
@@ -918,7 +2962,7 @@ void analizar_inicializacion_variables(Nodo* arbol, char* linea, int* num_linea,
                 }
                 
                 if(i < numVariablesMismoTipo - 1){
-                    Nodo* nodo_coma = crear_nodo("coma", ",");
+                    Nodo* nodo_coma = crear_nodo(NODO_COMA, ",");
                     agregar_hijo(nodo_variables, nodo_coma);
                 }
             }
@@ -935,39 +2979,31 @@ void analizar_inicializacion_variables(Nodo* arbol, char* linea, int* num_linea,
         if(!isValidType){
             mostrar_error("Tipo de dato no valido", *num_linea, buffer);
         }
-        Nodo* nodo_dos_puntos = crear_nodo("dos_puntos", ":");
+        Nodo* nodo_dos_puntos = crear_nodo(NODO_DOS_PUNTOS, ":");
         agregar_hijo(nodo_asignacion, nodo_dos_puntos);
-        Nodo* nodo_tipo = crear_nodo("tipo", partesInicializacion[1]);
+        Nodo* nodo_tipo = crear_nodo(NODO_TIPO, partesInicializacion[1]);
         agregar_hijo(nodo_asignacion, nodo_tipo);
         
-        for(int i = 0; i < count; i++){
-            free(partesInicializacion[i]);
-        }
-        free(partesInicializacion);
-        
-        for(int i = 0; i < numVariablesMismoTipo; i++){
-            free(partesVariableMismoTipo[i]);
-        }
-        free(partesVariableMismoTipo);
+        soltar(partesVariableMismoTipo);
+        soltar(partesInicializacion);
     }
     strcpy(linea, buffer);
+    soltar(buffer);
 }
 
-void analizar_palabra_clave(Nodo* arbol, const char* linea, int *num_linea, bool fromF_Or_P, FILE* archivo) {
-    char buffer[256]; 
+void analizar_palabra_clave(Nodo* arbol, const char* linea, int *num_linea, bool fromF_Or_P, Fuente* fuente) {
+    VistaTokens vista;
     trim((char*)linea);
-    char palabra_temp[256];
-    strcpy(palabra_temp, linea);
     
     char first_word[256] = {0};
-    sscanf(palabra_temp, "%s", first_word);
+    sscanf(linea, "%255s", first_word);
     trim_semicolon(first_word);
 
     if (strncmp(first_word, "end", 3) == 0) {
         if (strlen(linea) > 3) {
             char last_char = linea[strlen(linea) - 1];
             if (last_char == '.' || last_char == ';') {
-                Nodo* nodo_keyword = crear_nodo("palabra_clave", linea);
+                Nodo* nodo_keyword = crear_nodo(NODO_PALABRA_CLAVE, linea);
                 agregar_hijo(arbol, nodo_keyword);
                 return;
             }
@@ -978,56 +3014,57 @@ void analizar_palabra_clave(Nodo* arbol, const char* linea, int *num_linea, bool
         return;
     }
 
-    const int num_palabras_clave = sizeof(palabras_clave) / sizeof(palabras_clave[0]);
-    bool palabra_clave_valida = false;
-    
-    for (int i = 0; i < num_palabras_clave; i++) {
-        if (strcmp(first_word, palabras_clave[i]) == 0) {
-            palabra_clave_valida = true;
-            break;
-        }
-    }
-    
-    if (!palabra_clave_valida) {
+    PalabraClave palabra = reconocer_palabra_clave(first_word, strlen(first_word));
+    if (palabra < PALABRA_BEGIN || palabra > PALABRA_PROCEDURE) {
         mostrar_error("Palabra clave no reconocida", *num_linea, first_word);
         return;
     }
 
-    if (strcmp(first_word, "begin") == 0) {
-        Nodo* nodo_keyword = crear_nodo("palabra_clave", linea);
+    if (palabra == PALABRA_BEGIN) {
+        Nodo* nodo_keyword = crear_nodo(NODO_PALABRA_CLAVE, linea);
         agregar_hijo(arbol, nodo_keyword);
-        while (fgets(buffer, sizeof(buffer), archivo)) {
+        char* buffer = (char*)retener(nuevo_buffer_linea(fuente));
+        while (leer_linea(fuente, buffer, fuente->tam_linea, &vista)) {
             (*num_linea)++;
             trim(buffer);
             if (buffer[0] == '\0') continue;
 
-            if (starts_with(buffer, "if")) {
-                analizar_if(nodo_keyword, buffer, num_linea, archivo);
+            if (vista_empieza_con(vista, PALABRA_IF)) {
+                analizar_if(nodo_keyword, buffer, vista, num_linea, fuente);
             }
-            else if (starts_with(buffer, "while")) {
-                analizar_while(nodo_keyword, buffer, num_linea, archivo);
+            else if (vista_empieza_con(vista, PALABRA_WHILE)) {
+                analizar_while(nodo_keyword, buffer, vista, num_linea, fuente);
             }
-            else if (starts_with(buffer, "writeln")) {
+            else if (vista_empieza_con_identificador(vista, "writeln")) {
                 analizar_writeln(nodo_keyword, buffer, *num_linea);
             }
-            else if (starts_with(buffer, "for")) {
-                analizar_for(nodo_keyword, buffer, num_linea, archivo);
+            else if (vista_empieza_con(vista, PALABRA_FOR)) {
+                analizar_for(nodo_keyword, buffer, vista, num_linea, fuente);
             }
-            else if (starts_with(buffer, "end")) {
-                Nodo* nodo_keyword = crear_nodo("palabra_clave", buffer);
+            else if (vista_empieza_con(vista, PALABRA_END)) {
+                Nodo* nodo_keyword = crear_nodo(NODO_PALABRA_CLAVE, buffer);
                 agregar_hijo(arbol, nodo_keyword);
                 break;
             }
-            else if (strstr(buffer, ":=") != NULL) {
+            else if (vista_buscar(vista, TOKEN_ASIGNACION, 0) >= 0) {
                 analizar_asignacion(nodo_keyword, buffer, *num_linea);
             }
-            else if (es_llamada_funcion(buffer)) {
+            else if (vista_es_llamada_funcion(vista)) {
                 procesar_llamada_funcion(buffer, *num_linea);
             }
+            else {
+                // Mismo control de errores tipograficos que hace main con cada linea
+                char* palabra = (char*)retener(strdup(buffer));
+                toLowerCase(palabra);
+                trim_semicolon(palabra);
+                es_palabra_clave_similar(palabra, *num_linea);
+                soltar(palabra);
+            }
         }
+        soltar(buffer);
         return;
     } else {
-        Nodo* nodo_keyword = crear_nodo("palabra_clave", linea);
+        Nodo* nodo_keyword = crear_nodo(NODO_PALABRA_CLAVE, linea);
         agregar_hijo(arbol, nodo_keyword);
     }
 }
@@ -1045,7 +3082,7 @@ void analizar_cabecera_funcion(Nodo* arbol, char* linea, int num_linea, char* no
         return;
     }
     
-    printf("DEBUG: Procesando declaracion de funcion: '%s'\n", nombre_funcion);
+    TRAZA(TRAZA_DECLARACIONES, TRAZA_INFO, "Procesando declaracion de funcion: '%s'\n", nombre_funcion);
 
     if (strncmp(linea, "function ", 9) != 0) {
         mostrar_error("La declaracion debe iniciar con 'function'", num_linea, linea);
@@ -1055,74 +3092,82 @@ void analizar_cabecera_funcion(Nodo* arbol, char* linea, int num_linea, char* no
     char *cierra_paren = strchr(linea, ')');
     if (abre_paren == NULL || cierra_paren == NULL || cierra_paren < abre_paren) {
         mostrar_error("Error en la definicion de los parentesis", num_linea, linea);
+        return;
     }
 
     char *dos_puntos = strchr(cierra_paren, ':');
     if (dos_puntos == NULL) {
         mostrar_error("Se esperaba ':' despues de la lista de parametros", num_linea, linea);
+        return;
     }
 
     if (!semicolon) {
         mostrar_error("La declaracion debe terminar con ';'", num_linea, linea);
     }
 
-    Nodo* nodo_funcion = crear_nodo("funcion", nombre_funcion); 
+    Nodo* nodo_funcion = crear_nodo(NODO_FUNCION, nombre_funcion); 
     agregar_hijo(arbol, nodo_funcion);
-    Nodo *nodo_cabecera_funcion = crear_nodo("cabecera", ""); 
+    Nodo *nodo_cabecera_funcion = crear_nodo(NODO_CABECERA, ""); 
     agregar_hijo(nodo_funcion, nodo_cabecera_funcion);
-    char **partes = split_function(linea, &count);
+    char **partes = retener_partes(split_function(linea, &count));
     trim(partes[0]);
-    Nodo *nodo_funcion1 = crear_nodo("header pt1", partes[0]); 
+    Nodo *nodo_funcion1 = crear_nodo(NODO_HEADER_PT1, partes[0]); 
     agregar_hijo(nodo_cabecera_funcion, nodo_funcion1);
-    Nodo* nodo_dos_puntos = crear_nodo("dos puntos", ":"); 
+    Nodo* nodo_dos_puntos = crear_nodo(NODO_DOS_PUNTOS_CABECERA, ":"); 
     agregar_hijo(nodo_cabecera_funcion, nodo_dos_puntos);
-    Nodo* nodo_funcion2 = crear_nodo("header pt2", partes[1]); 
+    Nodo* nodo_funcion2 = crear_nodo(NODO_HEADER_PT2, partes[1]); 
     agregar_hijo(nodo_cabecera_funcion, nodo_funcion2);
     
     trim(partes[1]);
     trim_semicolon(partes[1]);
     toLowerCase(partes[1]);
     TipoDato tipo_retorno = obtener_tipo_desde_string(partes[1]);
-    Funcion* func = buscar_funcion(nombre_funcion);
-    if (func) {
-        func->tipo_retorno = tipo_retorno;
-        func->linea_declaracion = num_linea;
-        printf("DEBUG: Actualizada funcion '%s' con tipo %d\n", nombre_funcion, tipo_retorno);
+    if (funcion_existe(nombre_funcion)) {
+        redeclarar_funcion(nombre_funcion, tipo_retorno, num_linea);
+        TRAZA(TRAZA_DECLARACIONES, TRAZA_INFO, "Actualizada funcion '%s' con tipo %s\n", nombre_funcion, nombres_tipo_dato[tipo_retorno]);
     } else {
         agregar_funcion(nombre_funcion, tipo_retorno, num_linea);
-        printf("DEBUG: Agregada funcion '%s' con tipo %d\n", nombre_funcion, tipo_retorno);
+        TRAZA(TRAZA_DECLARACIONES, TRAZA_INFO, "Agregada funcion '%s' con tipo %s\n", nombre_funcion, nombres_tipo_dato[tipo_retorno]);
     }
     
-    if (sscanf(partes[0], "function %[^;];", nombre_funcion_nosirve) == 1) {
-        char *contenido_parentesis = extraer_parentesis(partes[0]);
+    if (sscanf(partes[0], "function %255[^;];", nombre_funcion_nosirve) == 1) {
+        char *contenido_parentesis = (char*)retener(extraer_parentesis(partes[0]));
         if (contenido_parentesis != NULL) {
             if (!validar_parametros_funcion(contenido_parentesis, num_linea)) {
+                soltar(contenido_parentesis);
+                soltar(partes);
                 return;
             }
         }
-        Nodo* nodo_parentesis1 = crear_nodo("parentesis", "'('");
-        Nodo* nodo_parentesis2 = crear_nodo("parametros", contenido_parentesis);
-        Nodo* nodo_parentesis3 = crear_nodo("parentesis", "')'");
+        Nodo* nodo_parentesis1 = crear_nodo(NODO_PARENTESIS, "'('");
+        Nodo* nodo_parentesis2 = crear_nodo(NODO_PARAMETROS, contenido_parentesis);
+        Nodo* nodo_parentesis3 = crear_nodo(NODO_PARENTESIS, "')'");
         agregar_hijo(nodo_funcion1, nodo_parentesis1);
         agregar_hijo(nodo_funcion1, nodo_parentesis2);
         agregar_hijo(nodo_funcion1, nodo_parentesis3);
         if (contenido_parentesis == NULL) {
-            free(partes);
+            soltar(partes);
             mostrar_error("Funcion mal formada", num_linea, linea);
+            return;
         }
-        char **params = split(contenido_parentesis, ";", &count);
+        char **params = retener_partes(split(contenido_parentesis, ";", &count));
         int elem = contar_elementos(params);
         for (int i = 0; i < elem; i++) {
-            Nodo* nodo_parametro = crear_nodo("parametro", params[i]);
+            Nodo* nodo_parametro = crear_nodo(NODO_PARAMETRO, params[i]);
             agregar_hijo(nodo_parentesis2, nodo_parametro);
             if (i < elem - 1) {
-                Nodo* nodo_coma = crear_nodo("punto y coma", ";");
+                Nodo* nodo_coma = crear_nodo(NODO_PUNTO_Y_COMA, ";");
                 agregar_hijo(nodo_parentesis2, nodo_coma);
             }
 
-            char **parametros = split(params[i], ":", &count);
+            char **parametros = retener_partes(split(params[i], ":", &count));
             int count3 = contar_elementos(parametros);
-            char **paramsSameType = split(parametros[0], ",", &count);
+            if (count3 < 2) {
+                mostrar_error("Tipo de dato no valido", num_linea, linea);
+                soltar(parametros);
+                continue;
+            }
+            char **paramsSameType = retener_partes(split(parametros[0], ",", &count));
             int numParamsSameType = contar_elementos(paramsSameType);
             
             trim(parametros[1]);
@@ -1137,382 +3182,752 @@ void analizar_cabecera_funcion(Nodo* arbol, char* linea, int num_linea, char* no
             }
             
             for (int j = 0; j < count3; j++) {
-                Nodo* nodo_param_inner = crear_nodo("parametro_inner", parametros[j]);
+                Nodo* nodo_param_inner = crear_nodo(NODO_PARAMETRO_INNER, parametros[j]);
                 agregar_hijo(nodo_parametro, nodo_param_inner);
                 if (j < count3 - 1) {
-                    Nodo* nodo_dos_puntos = crear_nodo("dos puntos", ":");
+                    Nodo* nodo_dos_puntos = crear_nodo(NODO_DOS_PUNTOS_CABECERA, ":");
                     agregar_hijo(nodo_parametro, nodo_dos_puntos);
                     if (numParamsSameType > 1) {
                         for (int k = 0; k < numParamsSameType; k++) {
-                            Nodo* nodo_param_inner2 = crear_nodo("parametro_inner", paramsSameType[k]);
+                            Nodo* nodo_param_inner2 = crear_nodo(NODO_PARAMETRO_INNER, paramsSameType[k]);
                             agregar_hijo(nodo_param_inner, nodo_param_inner2);
                             if (k < numParamsSameType - 1) {
-                                Nodo* nodo_coma = crear_nodo("coma", ",");
+                                Nodo* nodo_coma = crear_nodo(NODO_COMA, ",");
                                 agregar_hijo(nodo_param_inner, nodo_coma);
                             }
                         }
                     }
                 }
-                trim(parametros[1]);
-                toLowerCase(parametros[1]);
-                int chars = strlen(parametros[1]);
-                int isValidType = es_tipo_valido(parametros[1]);
-                if (!isValidType) {
-                    mostrar_error("Tipo de dato no valido", num_linea, linea);
-                }
             }
-            trim(partes[1]);
-            trim_semicolon(partes[1]);
-            toLowerCase(partes[1]);
-            int isValidType = es_tipo_valido(partes[1]);
-            if (!isValidType) {
-                mostrar_error("Tipo de retorno de la funcion dato no valido", num_linea, linea);
+            if (!es_tipo_valido(parametros[1])) {
+                mostrar_error("Tipo de dato no valido", num_linea, linea);
             }
-            free(parametros);
+            soltar(paramsSameType);
+            soltar(parametros);
+        }
+        if (!es_tipo_valido(partes[1])) {
+            mostrar_error("Tipo de retorno de la funcion dato no valido", num_linea, linea);
         }
-        free(partes);
-        free(contenido_parentesis);
-        free(params);
+        soltar(params);
+        soltar(contenido_parentesis);
+        soltar(partes);
     } else {
+        soltar(partes);
         mostrar_error("Expresion ilegal", num_linea, linea);
     }
 }
 
-void analizar_funcion(Nodo* arbol, char* linea, int* num_linea, FILE* archivo, char* nombre_funcion) {
-    char buffer[256]; 
+void analizar_funcion(Nodo* arbol, char* linea, int* num_linea, Fuente* fuente, char* nombre_funcion) {
+    char* buffer = (char*)retener(nuevo_buffer_linea(fuente));
+    VistaTokens vista;
     bool cabecera_analizada = false; 
-    int count = 0;
+    // Los parametros se registran ya dentro del ambito de la funcion
+    entrar_ambito("");
     if(!cabecera_analizada) {
         analizar_cabecera_funcion(arbol, linea, *num_linea, nombre_funcion);
         cabecera_analizada = true;
     }
-    Nodo* nodo_cuerpo_funcion = crear_nodo("cuerpo_funcion", "");
+    nombrar_ambito(nombre_funcion);
+    Nodo* nodo_cuerpo_funcion = crear_nodo(NODO_CUERPO_FUNCION, "");
     agregar_hijo(arbol, nodo_cuerpo_funcion);
     
-    char ambito_anterior[50];
-    strcpy(ambito_anterior, tabla.ambito_actual);
-    strcpy(tabla.ambito_actual, nombre_funcion);
-    
     bool retorno_encontrado = false;
     Funcion* func = buscar_funcion(nombre_funcion);
     TipoDato tipo_retorno = func ? func->tipo_retorno : TIPO_DESCONOCIDO;
+    bool fin_cuerpo = false;
 
-    while (fgets(buffer, sizeof(buffer), archivo)) {
+    while (leer_linea(fuente, buffer, fuente->tam_linea, &vista)) {
         (*num_linea)++;
         trim(buffer);
         if(buffer[0] == '\0'){
             continue;
         }
 
-        if(strstr(buffer, ":=") != NULL){
-            char** partesRetornoFuncion = split(buffer, ":=", &count);
-            if (count >= 2) {
-                trim(partesRetornoFuncion[0]);
-                trim(partesRetornoFuncion[1]);
-
-                char lowerFuncName[50];
-                char lowerVarName[50];
-                strcpy(lowerFuncName, nombre_funcion);
-                strcpy(lowerVarName, partesRetornoFuncion[0]);
-                toLowerCase(lowerFuncName);
-                toLowerCase(lowerVarName);
+        int asignacion = vista_buscar(vista, TOKEN_ASIGNACION, 0);
+        if(asignacion >= 0){
+            const char* pos_asignacion = token_en_linea(buffer, vista, asignacion);
+            if (pos_asignacion > buffer && pos_asignacion[2] != '\0') {
+                size_t len_izquierda = pos_asignacion - buffer;
+                while (len_izquierda > 0 && isspace((unsigned char)buffer[len_izquierda - 1])) {
+                    len_izquierda--;
+                }
+                const char* derecha = pos_asignacion + 2;
+                while (isspace((unsigned char)*derecha)) {
+                    derecha++;
+                }
                 
-                if(partesRetornoFuncion[0][0] == '\0'){
+                if(len_izquierda == 0){
                     mostrar_error("No se ha asignado una variable al valor de retorno", *num_linea, buffer);
-                }else if(partesRetornoFuncion[1][0] == '\0'){
+                }else if(derecha[0] == '\0'){
                     mostrar_error("No se ha asignado un valor a la variable de retorno", *num_linea, buffer);
-                }else if(strcmp(lowerVarName, lowerFuncName) == 0){
+                }else if(len_izquierda == strlen(nombre_funcion) && strncasecmp(buffer, nombre_funcion, len_izquierda) == 0){
                     retorno_encontrado = true;
                     marcar_funcion_con_retorno(nombre_funcion);
                     
-                    TipoDato tipo_valor = inferir_tipo_expresion(partesRetornoFuncion[1]);
-                    if (!verificar_tipos_compatibles(tipo_retorno, tipo_valor)) {
+                    TipoDato tipo_valor = inferir_tipo_expresion(derecha);
+                    if (tipo_valor != TIPO_DESCONOCIDO && !verificar_tipos_compatibles(tipo_retorno, tipo_valor)) {
                         char mensaje[100];
                         sprintf(mensaje, "Tipo de retorno incompatible. Se esperaba %d pero se encontro %d", 
                                 tipo_retorno, tipo_valor);
-                        mostrar_error(mensaje, *num_linea, buffer);
+                        mostrar_error_tipos(mensaje, *num_linea, buffer, tipo_retorno, tipo_valor);
                     }
                 }
                 analizar_asignacion(nodo_cuerpo_funcion, buffer, *num_linea);
-
-                for(int i = 0; i < count; i++) {
-                    free(partesRetornoFuncion[i]);
-                }
-                free(partesRetornoFuncion);
             }
-        } else if(strstr(buffer, "writeln") != NULL){
+        } else if(vista_contiene_identificador(vista, "writeln")){
             analizar_writeln(nodo_cuerpo_funcion, buffer, *num_linea);
-        } else if(contiene_palabra_clave(buffer, palabras_clave, sizeof(palabras_clave) / sizeof(palabras_clave[0]))){
-            analizar_palabra_clave(nodo_cuerpo_funcion, buffer, num_linea, true, archivo);
+        } else if(vista_contiene_palabra_clave(vista)){
+            analizar_palabra_clave(nodo_cuerpo_funcion, buffer, num_linea, true, fuente);
+            // El bloque begin ya consumio su end; el cuerpo termina con el
+            fin_cuerpo = vista_empieza_con(vista, PALABRA_BEGIN);
         }
         
-        if (strcmp(buffer, "end;") == 0) {
-    if (!retorno_encontrado && tipo_retorno != TIPO_DESCONOCIDO) {
-        char mensaje[100];
-        sprintf(mensaje, "La funcion '%s' debe retornar un valor de tipo %d", nombre_funcion, tipo_retorno);
-        mostrar_error(mensaje, *num_linea, nombre_funcion);
-    }
-  
-    strcpy(tabla.ambito_actual, ambito_anterior);
+        if (fin_cuerpo || strcmp(buffer, "end;") == 0) {
+            if (func && leer_retorno_asignado(func)) {
+                retorno_encontrado = true;
+            }
+            if (!retorno_encontrado && tipo_retorno != TIPO_DESCONOCIDO) {
+                char mensaje[100];
+                sprintf(mensaje, "La funcion '%s' debe retornar un valor de tipo %d", nombre_funcion, tipo_retorno);
+                mostrar_error_tipos(mensaje, *num_linea, nombre_funcion, tipo_retorno, TIPO_DESCONOCIDO);
+            }
+            if (func) {
+                fijar_tiene_retorno(nombre_funcion, retorno_encontrado);
+            }
             break;
         }
     }
+    salir_ambito();
+    resolver_referencias_pendientes(nombre_funcion);
+    soltar(buffer);
 }
 
-void analizar_expresion(Nodo* arbol, char* expr, int num_linea) {
-    removeSpaces(expr);
-    trim_semicolon(expr);
-    int count = strlen(expr);
-    int num_operadores = sizeof(operadoresAritmeticos) / sizeof(operadoresAritmeticos[0]);
-    
-    char temp_expr[256];
-    strcpy(temp_expr, expr);
-    char *token = strtok(temp_expr, "+-*/()");
-
-    TipoDato tipo_resultado = TIPO_DESCONOCIDO;
-    bool first_operand = true;
+// Lector del analizador de expresiones por precedencia; sin diagnosticar no crea nodos ni reporta, solo calcula el tipo
+typedef struct {
+    const char* texto;
+    int pos;
+    int fin;
+    Token token;
+    bool hay_token;
+    bool diagnosticar;
+    bool valida;               // falso si sobran simbolos, falta un operando o un ')'
+    int num_linea;
+    char* valor;
+} LectorExpresion;
+
+#define PRECEDENCIA_UNARIA 4
+
+void avanzar_expresion(LectorExpresion* lector) {
+    int pos = escanear_token(lector->texto, lector->pos, lector->fin, &lector->token);
+    lector->hay_token = pos >= 0;
+    if (lector->hay_token) {
+        lector->pos = pos;
+    }
+}
 
-    while (token != NULL) {
-        trim(token);
-        if (isalpha(token[0])) {  
-            Variable* var = buscar_variable(token);
-            if (var) {
-                if (!var->inicializada) {
-                    char mensaje[100];
-                    sprintf(mensaje, "Variable '%s' utilizada antes de ser inicializada", token);
-                    mostrar_advertencia(mensaje, num_linea);
-                }
+bool es_puntuacion_expresion(const LectorExpresion* lector, char c) {
+    return lector->hay_token && lector->token.tipo == TOKEN_PUNTUACION && lector->texto[lector->token.offset] == c;
+}
 
-                if (first_operand) {
-                    tipo_resultado = var->tipo;
-                    first_operand = false;
-                } else {
-                    if (!verificar_tipos_compatibles(tipo_resultado, var->tipo)) {
-                        char mensaje[100];
-                        sprintf(mensaje, "Tipos incompatibles en la expresion. No se puede operar %d con %d", 
-                                tipo_resultado, var->tipo);
-                        mostrar_error(mensaje, num_linea, expr);
-                    }
-                    
-                    if ((tipo_resultado == TIPO_CHAR && (var->tipo == TIPO_INTEGER || var->tipo == TIPO_REAL)) ||
-                        (var->tipo == TIPO_CHAR && (tipo_resultado == TIPO_INTEGER || tipo_resultado == TIPO_REAL))) {
-                        char mensaje[100];
-                        sprintf(mensaje, "No se puede realizar operaciones aritmeticas entre char y tipos numericos");
-                        mostrar_error(mensaje, num_linea, expr);
-                    }
-                }
+// Relacionales 1, aditivos 2, multiplicativos 3; 0 si el token no es un operador binario
+int precedencia_binaria(const LectorExpresion* lector) {
+    if (!lector->hay_token) {
+        return 0;
+    }
+    const Token* token = &lector->token;
+    switch (token->tipo) {
+        case TOKEN_COMPARACION:
+            return 1;
+        case TOKEN_OPERADOR: {
+            char c = lector->texto[token->offset];
+            return (c == '+' || c == '-') ? 2 : 3;
+        }
+        case TOKEN_IDENTIFICADOR:
+            if (token_es_identificador(lector->texto, token, "or")) {
+                return 2;
+            }
+            if (token_es_identificador(lector->texto, token, "and") ||
+                token_es_identificador(lector->texto, token, "div") ||
+                token_es_identificador(lector->texto, token, "mod")) {
+                return 3;
             }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// Solo se reporta el primer error de forma de cada expresion; su tipo queda desconocido
+// aunque el prefijo que si se pudo leer tenga tipo
+void error_expresion(LectorExpresion* lector, const char* mensaje) {
+    if (lector->valida && lector->diagnosticar) {
+        mostrar_error(mensaje, lector->num_linea, lector->texto);
+    }
+    lector->valida = false;
+}
+
+const char* texto_token_expresion(LectorExpresion* lector, const Token* token) {
+    memcpy(lector->valor, lector->texto + token->offset, token->longitud);
+    lector->valor[token->longitud] = '\0';
+    return lector->valor;
+}
+
+Nodo* nodo_token_expresion(LectorExpresion* lector, TipoNodo tipo, const Token* token) {
+    if (!lector->diagnosticar) {
+        return NULL;
+    }
+    return crear_nodo(tipo, texto_token_expresion(lector, token));
+}
+
+TipoDato tipo_operacion_binaria(LectorExpresion* lector, const Token* operador, TipoDato izquierda, TipoDato derecha) {
+    bool comparacion = operador->tipo == TOKEN_COMPARACION;
+    if (izquierda == TIPO_DESCONOCIDO || derecha == TIPO_DESCONOCIDO) {
+        return comparacion ? TIPO_BOOLEAN : TIPO_DESCONOCIDO;
+    }
+    if (!verificar_tipos_compatibles(izquierda, derecha)) {
+        if (lector->diagnosticar) {
+            char mensaje[100];
+            sprintf(mensaje, "Tipos incompatibles en la expresion. No se puede operar %d con %d", 
+                    izquierda, derecha);
+            mostrar_error_tipos(mensaje, lector->num_linea, lector->texto, izquierda, derecha);
         }
-        token = strtok(NULL, "+-*/()");
+        return TIPO_DESCONOCIDO;
     }
-    
-    TipoDato tipo_expr = inferir_tipo_expresion(expr);
-    
-    for (int i = 0; i < count; i++) {
-        bool es_operador = false;
-        for (int j = 0; j < num_operadores; j++) {  
-            int op_len = strlen(operadoresAritmeticos[j]);
-
-            if (i + op_len <= count && strncmp(&expr[i], operadoresAritmeticos[j], op_len) == 0) {
-                Nodo* nodo_operador = crear_nodo("operador", operadoresAritmeticos[j]);
-                agregar_hijo(arbol, nodo_operador);
-                es_operador = true;
-                i += op_len - 1; 
+    if (comparacion) {
+        return TIPO_BOOLEAN;
+    }
+    if (operador->tipo == TOKEN_OPERADOR && lector->texto[operador->offset] == '/') {
+        return TIPO_REAL;
+    }
+    if (token_es_identificador(lector->texto, operador, "div") ||
+        token_es_identificador(lector->texto, operador, "mod")) {
+        return TIPO_INTEGER;
+    }
+    if (izquierda == TIPO_REAL || derecha == TIPO_REAL) {
+        return TIPO_REAL;
+    }
+    return izquierda;
+}
+
+Nodo* analizar_precedencia(LectorExpresion* lector, int minima, TipoDato* tipo);
+
+Nodo* analizar_llamada_en_expresion(LectorExpresion* lector, const Token* nombre, TipoDato* tipo) {
+    Nodo* nodo = nodo_token_expresion(lector, NODO_LLAMADA, nombre);
+    Funcion* func = buscar_funcion(texto_token_expresion(lector, nombre));
+    *tipo = func ? func->tipo_retorno : TIPO_DESCONOCIDO;
+
+    avanzar_expresion(lector);
+    if (!es_puntuacion_expresion(lector, ')')) {
+        while (lector->hay_token) {
+            TipoDato tipo_argumento;
+            Nodo* argumento = analizar_precedencia(lector, 1, &tipo_argumento);
+            if (nodo && argumento) {
+                agregar_hijo(nodo, argumento);
+            }
+            if (!es_puntuacion_expresion(lector, ',')) {
                 break;
             }
+            avanzar_expresion(lector);
         }
-
-        if (!es_operador) {
-            char operando[2] = {expr[i], '\0'};
-            Nodo* nodo_operando = crear_nodo("operando", operando);
-            agregar_hijo(arbol, nodo_operando);
-        }
     }
+    if (es_puntuacion_expresion(lector, ')')) {
+        avanzar_expresion(lector);
+    } else {
+        error_expresion(lector, "Falta ')' en la llamada de la expresion");
+    }
+    return nodo;
 }
 
-void analizar_llamada_funcion(const char* nombre_funcion, const char* argumentos, int num_linea) {
-    Funcion* func = buscar_funcion(nombre_funcion);
-    if (!func) {
-        mostrar_error("Funcion no declarada", num_linea, nombre_funcion);
-        return;
+Nodo* analizar_identificador_en_expresion(LectorExpresion* lector, const Token* token, TipoDato* tipo) {
+    if (es_puntuacion_expresion(lector, '(')) {
+        return analizar_llamada_en_expresion(lector, token, tipo);
     }
-    
-    int count = 0;
-    char** args = NULL;
-    if (strlen(argumentos) > 0) {
-        args = split(argumentos, ",", &count);
+    if (token_es_identificador(lector->texto, token, "true") ||
+        token_es_identificador(lector->texto, token, "false")) {
+        *tipo = TIPO_BOOLEAN;
+        return nodo_token_expresion(lector, NODO_OPERANDO, token);
     }
-    
-    if (count != func->num_parametros) {
-        char mensaje[100];
-        sprintf(mensaje, "Numero incorrecto de argumentos. Se esperaban %d pero se encontraron %d", 
-                func->num_parametros, count);
-        mostrar_error(mensaje, num_linea, nombre_funcion);
+
+    const char* nombre = texto_token_expresion(lector, token);
+    Variable* var = buscar_variable(nombre);
+    if (var) {
+        *tipo = var->tipo;
+        if (lector->diagnosticar) {
+            verificar_inicializada(nombre, lector->num_linea);
+        }
     } else {
-        for (int i = 0; i < count; i++) {
-            trim(args[i]);
-            TipoDato tipo_arg = inferir_tipo_expresion(args[i]);
-            TipoDato tipo_param = func->parametros[i].tipo;
-            
-            if (!verificar_tipos_compatibles(tipo_param, tipo_arg)) {
-                char mensaje[100];
-                sprintf(mensaje, "Tipo incompatible en el argumento %d. Se esperaba %d pero se encontro %d", 
-                        i+1, tipo_param, tipo_arg);
-                mostrar_error(mensaje, num_linea, args[i]);
+        Funcion* func = buscar_funcion(nombre);
+        *tipo = func ? func->tipo_retorno : TIPO_DESCONOCIDO;
+        if (!func && lector->diagnosticar) {
+            const char* sugerencia = sugerir_simbolo(nombre, true, true);
+            if (sugerencia) {
+                char error_msg[150];
+                snprintf(error_msg, sizeof(error_msg), "Variable o funcion no declarada (¿quiso escribir '%s'?)", sugerencia);
+                mostrar_error(error_msg, lector->num_linea, nombre);
+            } else {
+                mostrar_error("Variable o funcion no declarada", lector->num_linea, nombre);
             }
         }
     }
-    
-    if (args) {
-        for (int i = 0; i < count; i++) {
-            free(args[i]);
+    return nodo_token_expresion(lector, NODO_OPERANDO, token);
+}
+
+Nodo* analizar_operando(LectorExpresion* lector, TipoDato* tipo) {
+    *tipo = TIPO_DESCONOCIDO;
+    if (!lector->hay_token) {
+        error_expresion(lector, "Expresion incompleta: falta un operando");
+        return NULL;
+    }
+    Token token = lector->token;
+    avanzar_expresion(lector);
+
+    bool unario = token.tipo == TOKEN_OPERADOR || token_es_identificador(lector->texto, &token, "not");
+    if (unario) {
+        Nodo* nodo = nodo_token_expresion(lector, NODO_OPERADOR, &token);
+        Nodo* operando = analizar_precedencia(lector, PRECEDENCIA_UNARIA, tipo);
+        if (nodo && operando) {
+            agregar_hijo(nodo, operando);
         }
-        free(args);
+        return nodo;
+    }
+
+    switch (token.tipo) {
+        case TOKEN_NUMERO:
+            *tipo = memchr(lector->texto + token.offset, '.', token.longitud) ? TIPO_REAL : TIPO_INTEGER;
+            return nodo_token_expresion(lector, NODO_OPERANDO, &token);
+        case TOKEN_CADENA:
+            *tipo = TIPO_STRING;
+            return nodo_token_expresion(lector, NODO_OPERANDO, &token);
+        case TOKEN_IDENTIFICADOR:
+            return analizar_identificador_en_expresion(lector, &token, tipo);
+        case TOKEN_PUNTUACION:
+            if (lector->texto[token.offset] == '(') {
+                Nodo* nodo = analizar_precedencia(lector, 1, tipo);
+                if (es_puntuacion_expresion(lector, ')')) {
+                    avanzar_expresion(lector);
+                } else {
+                    error_expresion(lector, "Falta ')' en la expresion");
+                }
+                return nodo;
+            }
+            error_expresion(lector, "Expresion incompleta: falta un operando");
+            return NULL;
+        default:
+            error_expresion(lector, "Expresion incompleta: falta un operando");
+            return NULL;
     }
 }
 
-bool es_llamada_funcion(const char* expr) {
-    char* copia = strdup(expr);
-    char* token = strtok(copia, "( \t\n");
-    
-    if (token) {
-        trim(token);
-        if (isalpha(token[0]) || token[0] == '_') {
-            const char* resto = expr + strlen(token);
-            while (*resto && isspace(*resto)) resto++;
-            
-            free(copia);
-            return (*resto == '(');
+// Precedencia ascendente: cada operador cuelga sus dos operandos y el tipo sube desde las hojas
+Nodo* analizar_precedencia(LectorExpresion* lector, int minima, TipoDato* tipo) {
+    Nodo* izquierda = analizar_operando(lector, tipo);
+    int precedencia;
+    while ((precedencia = precedencia_binaria(lector)) > 0 && precedencia >= minima) {
+        Token operador = lector->token;
+        Nodo* nodo = nodo_token_expresion(lector, NODO_OPERADOR, &operador);
+        avanzar_expresion(lector);
+
+        TipoDato tipo_derecha;
+        Nodo* derecha = analizar_precedencia(lector, precedencia + 1, &tipo_derecha);
+        *tipo = tipo_operacion_binaria(lector, &operador, *tipo, tipo_derecha);
+        if (nodo) {
+            if (izquierda) {
+                agregar_hijo(nodo, izquierda);
+            }
+            if (derecha) {
+                agregar_hijo(nodo, derecha);
+            }
+            izquierda = nodo;
         }
     }
-    
-    free(copia);
-    return false;
+    return izquierda;
 }
 
-void procesar_llamada_funcion(const char* expr, int num_linea) {
-    char nombre_funcion[50] = {0};
-    int i = 0;
-    
-    while (expr[i] && expr[i] != '(' && i < 49) {
-        nombre_funcion[i] = expr[i];
-        i++;
+TipoDato recorrer_expresion(Nodo* arbol, const char* expr, int num_linea, bool diagnosticar) {
+    char local[256];
+    LectorExpresion lector;
+    lector.texto = expr;
+    lector.pos = 0;
+    lector.fin = strlen(expr);
+    lector.diagnosticar = diagnosticar;
+    lector.valida = true;
+    lector.num_linea = num_linea;
+    lector.valor = lector.fin < (int)sizeof(local) ? local : (char*)retener(malloc(lector.fin + 1));
+
+    avanzar_expresion(&lector);
+    TipoDato tipo;
+    Nodo* raiz = analizar_precedencia(&lector, 1, &tipo);
+    if (lector.hay_token) {
+        error_expresion(&lector, es_puntuacion_expresion(&lector, ')') ? "Sobra ')' en la expresion" :
+                                                                          "Expresion mal formada: sobran simbolos al final");
     }
-    nombre_funcion[i] = '\0';
-    trim(nombre_funcion);
-    
-    printf("DEBUG: Buscando funcion: '%s'\n", nombre_funcion);
-    printf("DEBUG: Funciones disponibles: %d\n", tabla.num_funciones);
-    for (int j = 0; j < tabla.num_funciones; j++) {
-        printf("DEBUG: Funcion %d: '%s'\n", j, tabla.funciones[j].nombre);
+    if (!lector.valida) {
+        tipo = TIPO_DESCONOCIDO;
+    }
+    if (arbol && raiz) {
+        agregar_hijo(arbol, raiz);
     }
 
-    char nombre_lower[50];
-    strcpy(nombre_lower, nombre_funcion);
-    toLowerCase(nombre_lower);
-    
-    Funcion* func = buscar_funcion(nombre_lower);
-    if (!func) {
-        char error_msg[100];
-        sprintf(error_msg, "Funcion no declarada -> %s -> %s", nombre_funcion, expr);
-        mostrar_error(error_msg, num_linea, expr);
-        return;
+    if (lector.valor != local) {
+        soltar(lector.valor);
     }
+    return tipo;
+}
 
-    char* argumentos = extraer_argumentos_funcion(expr);
-    if (!argumentos) {
-        mostrar_error("Error al extraer argumentos de la funcion", num_linea, expr);
-        return;
+// La clave es el texto sin espacios en los extremos ni ';' final; falso si no cabe
+bool clave_expresion(const char* expr, char* clave, size_t tam) {
+    while (isspace((unsigned char)*expr)) {
+        expr++;
     }
-    
-    int num_args = 0;
-    if (strlen(argumentos) > 0) {
-        char* args_copy = strdup(argumentos);
-        char* token = strtok(args_copy, ",");
-        while (token) {
-            num_args++;
-            token = strtok(NULL, ",");
-        }
-        free(args_copy);
+    size_t len = strlen(expr);
+    while (len > 0 && (isspace((unsigned char)expr[len - 1]) || expr[len - 1] == ';')) {
+        len--;
     }
+    if (len >= tam) {
+        return false;
+    }
+    memcpy(clave, expr, len);
+    clave[len] = '\0';
+    return true;
+}
 
-    if (num_args != func->num_parametros) {
-        char error_msg[100];
-        sprintf(error_msg, "Numero incorrecto de argumentos para la funcion %s. Esperados: %d, Recibidos: %d", 
-                nombre_funcion, func->num_parametros, num_args);
-        mostrar_error(error_msg, num_linea, expr);
-        free(argumentos);
-        return;
+bool tipo_memorizado(unsigned int id, TipoDato* tipo) {
+    TablaCadenas* t = &cadenas_arbol;
+    if ((int)id >= t->capacidad_tipos || t->generaciones[id] != generacion_declaraciones) {
+        return false;
     }
-    
-    free(argumentos);
+    *tipo = (TipoDato)t->tipos[id];
+    return true;
 }
 
-void analizar_asignacion(Nodo* arbol, const char* linea, int num_linea){
-    printf("ANALIZAR ASIGNACION\n");
-    printf("linea: %s\n", linea);
-     if (!validar_asignacion(linea, num_linea)) {
-        return;
+void memorizar_tipo(unsigned int id, TipoDato tipo) {
+    TablaCadenas* t = &cadenas_arbol;
+    if ((int)id >= t->capacidad_tipos) {
+        int capacidad = t->capacidad;
+        t->tipos = (unsigned char*)crecer_arreglo(t->tipos, capacidad, sizeof(unsigned char));
+        t->generaciones = (unsigned int*)crecer_arreglo(t->generaciones, capacidad, sizeof(unsigned int));
+        memset(t->generaciones + t->capacidad_tipos, 0, (capacidad - t->capacidad_tipos) * sizeof(unsigned int));
+        t->capacidad_tipos = capacidad;
+    }
+    t->tipos[id] = (unsigned char)tipo;
+    t->generaciones[id] = generacion_declaraciones;
+}
+
+// Solo el tipo: sin nodos ni diagnosticos. El mismo texto con las mismas declaraciones
+// visibles da el mismo tipo, asi que se memoriza por su id en la tabla de cadenas
+TipoDato inferir_tipo_expresion(const char* expr) {
+    char clave[256];
+    if (!clave_expresion(expr, clave, sizeof(clave))) {
+        return recorrer_expresion(NULL, expr, 0, false);
+    }
+    unsigned int id = internar_cadena(clave);
+    TipoDato tipo;
+    if (!tipo_memorizado(id, &tipo)) {
+        tipo = recorrer_expresion(NULL, clave, 0, false);
+        memorizar_tipo(id, tipo);
+    }
+    return tipo;
+}
+
+// Los nodos y diagnosticos se generan siempre; el tipo queda memorizado para las inferencias siguientes
+TipoDato analizar_expresion(Nodo* arbol, char* expr, int num_linea) {
+    trim_semicolon(expr);
+    TipoDato tipo = recorrer_expresion(arbol, expr, num_linea, true);
+    char clave[256];
+    if (clave_expresion(expr, clave, sizeof(clave))) {
+        memorizar_tipo(internar_cadena(clave), tipo);
+    }
+    return tipo;
+}
+
+bool es_llamada_funcion(const char* expr) {
+    Token primero, segundo;
+    int len = strlen(expr);
+    int pos = escanear_token(expr, 0, len, &primero);
+    if (pos < 0 || primero.tipo != TOKEN_IDENTIFICADOR || token_es_identificador(expr, &primero, "not")) {
+        return false;
+    }
+    pos = escanear_token(expr, pos, len, &segundo);
+    return pos >= 0 && segundo.tipo == TOKEN_PUNTUACION && expr[segundo.offset] == '(';
+}
+
+// Cuenta los argumentos separados por comas del primer nivel de parentesis
+int contar_argumentos(const char* argumentos) {
+    Token token;
+    int len = strlen(argumentos);
+    int pos = 0;
+    int num_args = 0;
+    int profundidad = 0;
+    while ((pos = escanear_token(argumentos, pos, len, &token)) >= 0) {
+        if (num_args == 0) {
+            num_args = 1;
+        }
+        if (token.tipo != TOKEN_PUNTUACION) {
+            continue;
+        }
+        char c = argumentos[token.offset];
+        if (c == '(') {
+            profundidad++;
+        } else if (c == ')') {
+            profundidad--;
+        } else if (c == ',' && profundidad == 0) {
+            num_args++;
+        }
+    }
+    return num_args;
+}
+
+// Infiere el tipo de cada argumento de primer nivel; devuelve cuantos hay
+int inferir_tipos_argumentos(const char* argumentos, TipoDato* tipos, int max) {
+    int num_args = contar_argumentos(argumentos);
+    if (num_args == 0) {
+        return 0;
+    }
+    Token token;
+    int len = strlen(argumentos);
+    char* argumento = (char*)malloc(len + 1);
+    int pos = 0;
+    int inicio = 0;
+    int profundidad = 0;
+    int i = 0;
+    while (i < num_args) {
+        pos = escanear_token(argumentos, pos, len, &token);
+        int corte = len;
+        if (pos >= 0) {
+            if (token.tipo != TOKEN_PUNTUACION) {
+                continue;
+            }
+            char c = argumentos[token.offset];
+            if (c == '(') {
+                profundidad++;
+                continue;
+            } else if (c == ')') {
+                profundidad--;
+                continue;
+            } else if (c != ',' || profundidad != 0) {
+                continue;
+            }
+            corte = token.offset;
+        }
+        copiar_fragmento(argumento, len + 1, argumentos + inicio, argumentos + corte);
+        trim(argumento);
+        if (i < max) {
+            tipos[i] = inferir_tipo_expresion(argumento);
+        }
+        i++;
+        inicio = corte + 1;
+    }
+    free(argumento);
+    return num_args;
+}
+
+bool verificar_argumentos(const Funcion* func, const char* nombre_funcion, int num_args, const TipoDato* tipos, const char* llamada, int num_linea) {
+    if (num_args != func->num_parametros) {
+        char error_msg[100];
+        sprintf(error_msg, "Numero incorrecto de argumentos para la funcion %s. Esperados: %d, Recibidos: %d", 
+                nombre_funcion, func->num_parametros, num_args);
+        mostrar_error(error_msg, num_linea, llamada);
+        return false;
+    }
+    for (int i = 0; i < num_args; i++) {
+        TipoDato tipo_param = tabla.parametros.tipos[func->primer_parametro + i];
+        if (tipos[i] != TIPO_DESCONOCIDO && !verificar_tipos_compatibles(tipo_param, tipos[i])) {
+            char mensaje[100];
+            sprintf(mensaje, "Tipo incompatible en el argumento %d. Se esperaba %d pero se encontro %d", 
+                    i+1, tipo_param, tipos[i]);
+            mostrar_error_tipos(mensaje, num_linea, llamada, tipo_param, tipos[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+void registrar_referencia_pendiente(const char* nombre_funcion, const char* llamada, int num_args, const TipoDato* tipos, int num_linea, bool requiere_retorno) {
+    anotar_operacion(OP_REFERENCIA_PENDIENTE, num_args, num_linea, requiere_retorno, nombre_funcion, llamada, tipos);
+    if (pendientes.num_referencias == pendientes.capacidad) {
+        pendientes.capacidad = pendientes.capacidad ? pendientes.capacidad * 2 : 8;
+        pendientes.referencias = (ReferenciaPendiente*)realloc(pendientes.referencias, pendientes.capacidad * sizeof(ReferenciaPendiente));
+    }
+    ReferenciaPendiente* ref = &pendientes.referencias[pendientes.num_referencias++];
+    snprintf(ref->nombre, sizeof(ref->nombre), "%s", nombre_funcion);
+    ref->llamada = strdup(llamada);
+    ref->num_argumentos = num_args;
+    ref->tipos_argumentos = (TipoDato*)malloc((num_args > 0 ? num_args : 1) * sizeof(TipoDato));
+    memcpy(ref->tipos_argumentos, tipos, num_args * sizeof(TipoDato));
+    ref->num_linea = num_linea;
+    ref->requiere_retorno = requiere_retorno;
+}
+
+// Verifica las llamadas que esperaban a esta funcion, en el orden en que aparecieron
+void resolver_referencias_pendientes(const char* nombre_funcion) {
+    anotar_operacion(OP_RESOLVER_PENDIENTES, 0, 0, false, nombre_funcion, NULL, NULL);
+    Funcion* func = buscar_funcion(nombre_funcion);
+    if (!func) {
+        return;
+    }
+    // Sus diagnosticos salen de nuevo al repetir la operacion, no se graban aparte
+    cache_bloques.dentro_de_operacion++;
+    for (int i = 0; i < pendientes.num_referencias; i++) {
+        ReferenciaPendiente* ref = &pendientes.referencias[i];
+        if (strcasecmp(ref->nombre, nombre_funcion) != 0) {
+            continue;
+        }
+        if (verificar_argumentos(func, ref->nombre, ref->num_argumentos, ref->tipos_argumentos, ref->llamada, ref->num_linea) &&
+            ref->requiere_retorno && func->tipo_retorno != TIPO_DESCONOCIDO && !func->tiene_retorno) {
+            char mensaje[128];
+            snprintf(mensaje, sizeof(mensaje), "La funcion '%s' no tiene un valor de retorno asignado", ref->nombre);
+            mostrar_error(mensaje, ref->num_linea, ref->llamada);
+        }
+    }
+    // Se retiran solo despues de verificarlas, asi un error deja la lista intacta para liberarla
+    int quedan = 0;
+    for (int i = 0; i < pendientes.num_referencias; i++) {
+        ReferenciaPendiente* ref = &pendientes.referencias[i];
+        if (strcasecmp(ref->nombre, nombre_funcion) == 0) {
+            free(ref->llamada);
+            free(ref->tipos_argumentos);
+        } else {
+            pendientes.referencias[quedan++] = *ref;
+        }
+    }
+    pendientes.num_referencias = quedan;
+    cache_bloques.dentro_de_operacion--;
+}
+
+// Al final del archivo, toda referencia sin resolver es una funcion no declarada
+void reportar_referencias_pendientes() {
+    for (int i = 0; i < pendientes.num_referencias; i++) {
+        ReferenciaPendiente* ref = &pendientes.referencias[i];
+        char error_msg[200];
+        const char* sugerencia = sugerir_simbolo(ref->nombre, false, true);
+        if (sugerencia) {
+            snprintf(error_msg, sizeof(error_msg), "Funcion no declarada -> %s -> %s (¿quiso escribir '%s'?)",
+                     ref->nombre, ref->llamada, sugerencia);
+        } else {
+            snprintf(error_msg, sizeof(error_msg), "Funcion no declarada -> %s -> %s", ref->nombre, ref->llamada);
+        }
+        mostrar_error(error_msg, ref->num_linea, ref->llamada);
+    }
+    liberar_referencias_pendientes();
+}
+
+void liberar_referencias_pendientes() {
+    for (int i = 0; i < pendientes.num_referencias; i++) {
+        free(pendientes.referencias[i].llamada);
+        free(pendientes.referencias[i].tipos_argumentos);
+    }
+    free(pendientes.referencias);
+    pendientes.referencias = NULL;
+    pendientes.num_referencias = 0;
+    pendientes.capacidad = 0;
+}
+
+bool analizar_llamada_funcion(const char* nombre_funcion, const char* llamada, int num_linea, bool requiere_retorno) {
+    char* argumentos = extraer_argumentos_funcion(llamada);
+    if (!argumentos) {
+        mostrar_error("Error al extraer argumentos de la funcion", num_linea, llamada);
+        return false;
+    }
+    // Casi todas las llamadas caben en el arreglo local; las muy largas piden memoria
+    TipoDato tipos_locales[20];
+    int num_args = contar_argumentos(argumentos);
+    TipoDato* tipos = num_args <= 20 ? tipos_locales : (TipoDato*)retener(malloc(num_args * sizeof(TipoDato)));
+    inferir_tipos_argumentos(argumentos, tipos, num_args);
+    free(argumentos);
+
+    Funcion* func = buscar_funcion(nombre_funcion);
+    if (!func) {
+        registrar_referencia_pendiente(nombre_funcion, llamada, num_args, tipos, num_linea, requiere_retorno);
+        if (tipos != tipos_locales) soltar(tipos);
+        return true;
+    }
+
+    bool argumentos_validos = verificar_argumentos(func, nombre_funcion, num_args, tipos, llamada, num_linea);
+    if (tipos != tipos_locales) soltar(tipos);
+    if (!argumentos_validos) {
+        return false;
+    }
+
+    // Una llamada recursiva no puede exigir el retorno antes de terminar el cuerpo
+    if (requiere_retorno && func->tipo_retorno != TIPO_DESCONOCIDO && !leer_tiene_retorno(func) &&
+        strcasecmp(ambito_actual()->nombre, nombre_funcion) != 0) {
+        char mensaje[100];
+        sprintf(mensaje, "La funcion '%s' no tiene un valor de retorno asignado", nombre_funcion);
+        mostrar_error(mensaje, num_linea, llamada);
+        return false;
+    }
+    return true;
+}
+
+void procesar_llamada_funcion(const char* expr, int num_linea) {
+    char nombre_funcion[50] = {0};
+    int i = 0;
+    
+    while (expr[i] && expr[i] != '(' && i < 49) {
+        nombre_funcion[i] = expr[i];
+        i++;
+    }
+    nombre_funcion[i] = '\0';
+    trim(nombre_funcion);
+    
+    TRAZA(TRAZA_LLAMADAS, TRAZA_INFO, "Buscando funcion: '%s'\n", nombre_funcion);
+    // Recorrer la tabla entera por llamada solo vale la pena con la traza detallada
+    if (TRAZA_ACTIVA(TRAZA_LLAMADAS, TRAZA_DETALLE)) {
+        trazar(TRAZA_LLAMADAS, "Funciones disponibles: %d\n", tabla.funciones.num);
+        for (int j = 0; j < tabla.funciones.num; j++) {
+            trazar(TRAZA_LLAMADAS, "Funcion %d: '%s'\n", j, tabla.funciones.nombres[j]);
+        }
+    }
+
+    analizar_llamada_funcion(nombre_funcion, expr, num_linea, false);
+}
+
+void analizar_asignacion(Nodo* arbol, const char* linea, int num_linea){
+    TRAZA(TRAZA_ASIGNACIONES, TRAZA_INFO, "Analizar asignacion: %s\n", linea);
+     if (!validar_asignacion(linea, num_linea)) {
+        return;
     }
     
     
-    int count = 0;
-    char** partes = split(linea, ":=", &count);
-    printf("Count: %i\n", count);
-    printf("Partes 0 %s\n", partes[0]);
-    printf("Partes 1 %s\n", partes[1]);
-    
-    if (!partes || count != 2) {
+    const char* asignacion = buscar_asignacion(linea);
+    if (!asignacion) {
         mostrar_error("Asignacion mal formada", num_linea, linea);
         return;
     }
 
+    size_t len = strlen(linea) + 1;
+    char* memoria_partes = (char*)retener(malloc(2 * len));
+    char* partes[2] = {memoria_partes, memoria_partes + len};
+    copiar_fragmento(partes[0], len, linea, asignacion);
+    strcpy(partes[1], asignacion + 2);
+    TRAZA(TRAZA_ASIGNACIONES, TRAZA_DETALLE, "Partes 0 %s\n", partes[0]);
+    TRAZA(TRAZA_ASIGNACIONES, TRAZA_DETALLE, "Partes 1 %s\n", partes[1]);
+
     trim(partes[0]);
     trim(partes[1]);
     
-    char lowerPartes0[256];
-    char lowerPartes1[256];
-    strcpy(lowerPartes0, partes[0]);
-    strcpy(lowerPartes1, partes[1]);
-    toLowerCase(lowerPartes0);
-    toLowerCase(lowerPartes1);
-
-    bool var_exists = false;
-    bool func_exists = false;
-    
-    for (int i = 0; i < tabla.num_variables; i++) {
-        char lowerVarName[50];
-        strcpy(lowerVarName, tabla.variables[i].nombre);
-        toLowerCase(lowerVarName);
-        if (strcmp(lowerVarName, lowerPartes0) == 0) {
-            var_exists = true;
-            break;
-        }
-    }
+    Variable* var_izquierda = buscar_variable(partes[0]);
+    Funcion* func_izquierda = var_izquierda ? NULL : buscar_funcion(partes[0]);
     
-    for (int i = 0; i < tabla.num_funciones; i++) {
-        char lowerFuncName[50];
-        strcpy(lowerFuncName, tabla.funciones[i].nombre);
-        toLowerCase(lowerFuncName);
-        if (strcmp(lowerFuncName, lowerPartes0) == 0) {
-            func_exists = true;
-            break;
+    if (!var_izquierda && !func_izquierda) {
+        const char* sugerencia = sugerir_simbolo(partes[0], true, true);
+        if (sugerencia) {
+            char error_msg[150];
+            snprintf(error_msg, sizeof(error_msg), "Variable o funcion no declarada (¿quiso escribir '%s'?)", sugerencia);
+            mostrar_error(error_msg, num_linea, partes[0]);
+        } else {
+            mostrar_error("Variable o funcion no declarada", num_linea, partes[0]);
         }
-    }
-    
-    if (!var_exists && !func_exists) {
-        mostrar_error("Variable o funcion no declarada", num_linea, partes[0]);
+        soltar(memoria_partes);
         return;
     }
 
     TipoDato tipo_izquierda;
-    if (variable_existe(partes[0])) {
-        Variable* var = buscar_variable(partes[0]);
-        tipo_izquierda = var->tipo;
+    if (var_izquierda) {
+        tipo_izquierda = var_izquierda->tipo;
         marcar_variable_inicializada(partes[0]);
     } else {
-        Funcion* func = buscar_funcion(partes[0]);
-        tipo_izquierda = func->tipo_retorno;
+        tipo_izquierda = func_izquierda->tipo_retorno;
         marcar_funcion_con_retorno(partes[0]);
     }
 
@@ -1526,94 +3941,39 @@ void analizar_asignacion(Nodo* arbol, const char* linea, int num_linea){
         func_name[i] = '\0';
         trim(func_name);
 
-        char func_name_lower[50];
-        strcpy(func_name_lower, func_name);
-        toLowerCase(func_name_lower);
-
-        Funcion* func = buscar_funcion(func_name_lower);
-        if (func) {
-            char* argumentos = extraer_argumentos_funcion(partes[1]);
-            if (!argumentos) {
-                mostrar_error("Error al extraer argumentos de la funcion", num_linea, partes[1]);
-                for (int i = 0; i < count; i++) {
-                    free(partes[i]);
-                }
-                free(partes);
-                return;
-            }
-
-            int num_args = 0;
-            if (strlen(argumentos) > 0) {
-                char* args_copy = strdup(argumentos);
-                char* token = strtok(args_copy, ",");
-                while (token) {
-                    num_args++;
-                    token = strtok(NULL, ",");
-                }
-                free(args_copy);
-            }
-       
-            if (num_args != func->num_parametros) {
-                char error_msg[100];
-                sprintf(error_msg, "Numero incorrecto de argumentos para la funcion %s. Esperados: %d, Recibidos: %d", 
-                        func_name, func->num_parametros, num_args);
-                mostrar_error(error_msg, num_linea, partes[1]);
-                free(argumentos);
-                for (int i = 0; i < count; i++) {
-                    free(partes[i]);
-                }
-                free(partes);
-                return;
-            }
-            
-            free(argumentos);
-
-            if (func->tipo_retorno != TIPO_DESCONOCIDO && !func->tiene_retorno) {
-                char mensaje[100];
-                sprintf(mensaje, "La funcion '%s' no tiene un valor de retorno asignado", func_name);
-                mostrar_error(mensaje, num_linea, partes[1]);
- 
-                for (int i = 0; i < count; i++) {
-                    free(partes[i]);
-                }
-                free(partes);
-                return;
-            }
+        if (!analizar_llamada_funcion(func_name, partes[1], num_linea, true)) {
+            soltar(memoria_partes);
+            return;
         }
     }
 
-    TipoDato tipo_derecha = inferir_tipo_expresion(partes[1]);
-    
-    if (!verificar_tipos_compatibles(tipo_izquierda, tipo_derecha)) {
-        char mensaje[100];
-        sprintf(mensaje, "Tipos incompatibles en la asignacion. Se esperaba %d pero se encontro %d", 
-                tipo_izquierda, tipo_derecha);
-        mostrar_error(mensaje, num_linea, linea);
-    }
-
-    Nodo* nodo_asignacion = crear_nodo("asignacion", "");
+    Nodo* nodo_asignacion = crear_nodo(NODO_ASIGNACION, "");
     agregar_hijo(arbol, nodo_asignacion);
     
-    Nodo* nodo_variable = crear_nodo("variable", partes[0]);
-    Nodo* nodo_asignacion_operador = crear_nodo("asignacion_operador", ":=");
-    Nodo* nodo_expresion = crear_nodo("expresion", partes[1]);
+    Nodo* nodo_variable = crear_nodo(NODO_VARIABLE, partes[0]);
+    Nodo* nodo_asignacion_operador = crear_nodo(NODO_ASIGNACION_OPERADOR, ":=");
+    Nodo* nodo_expresion = crear_nodo(NODO_EXPRESION, partes[1]);
 
     agregar_hijo(nodo_asignacion, nodo_variable);
     agregar_hijo(nodo_asignacion, nodo_asignacion_operador);
     agregar_hijo(nodo_asignacion, nodo_expresion);
-    if(strlen(partes[1]) > 1){
-        analizar_expresion(nodo_expresion, partes[1], num_linea);
-    }
-    for (int i = 0; i < count; i++) {
-        free(partes[i]);
+
+    TipoDato tipo_derecha = analizar_expresion(nodo_expresion, partes[1], num_linea);
+    if (tipo_derecha != TIPO_DESCONOCIDO && !verificar_tipos_compatibles(tipo_izquierda, tipo_derecha)) {
+        char mensaje[100];
+        sprintf(mensaje, "Tipos incompatibles en la asignacion. Se esperaba %d pero se encontro %d", 
+                tipo_izquierda, tipo_derecha);
+        mostrar_error_tipos(mensaje, num_linea, linea, tipo_izquierda, tipo_derecha);
     }
-    free(partes);
+    soltar(memoria_partes);
 }
 
-void analizar_procedure(Nodo* arbol, const char* linea, int* num_linea, FILE* archivo, char* nombre_procedure) {
-    char buffer[256]; 
+void analizar_procedure(Nodo* arbol, const char* linea, int* num_linea, Fuente* fuente, char* nombre_procedure,
+                        size_t tam_nombre) {
+    char* buffer = (char*)retener(nuevo_buffer_linea(fuente));
+    VistaTokens vista;
 	trim((char*)linea);
-    obtenerNombreProcedure(linea, nombre_procedure, sizeof(nombre_procedure));
+    obtenerNombreProcedure(linea, nombre_procedure, tam_nombre);
     
     if (strncmp(linea, "procedure ", 10) != 0) {
         mostrar_error("La declaracion debe iniciar con 'procedure'", *num_linea, linea);
@@ -1623,10 +3983,11 @@ void analizar_procedure(Nodo* arbol, const char* linea, int* num_linea, FILE* ar
         mostrar_error("La declaracion debe terminar con ';'", *num_linea, linea);
     }
 
-    Nodo* nodo_procedure = crear_nodo("procedure", nombre_procedure);
+    Nodo* nodo_procedure = crear_nodo(NODO_PROCEDURE, nombre_procedure);
     agregar_hijo(arbol, nodo_procedure);
+    entrar_ambito(nombre_procedure);
 
-    while (fgets(buffer, sizeof(buffer), archivo)) {
+    while (leer_linea(fuente, buffer, fuente->tam_linea, &vista)) {
         (*num_linea)++;
         trim(buffer);
         
@@ -1634,11 +3995,14 @@ void analizar_procedure(Nodo* arbol, const char* linea, int* num_linea, FILE* ar
             
             continue;
         }
-        if(contiene_palabra_clave(buffer, palabras_clave, sizeof(palabras_clave) / sizeof(palabras_clave[0]))){
-            analizar_palabra_clave(nodo_procedure, buffer, num_linea, true, archivo);
+        if(vista_contiene_palabra_clave(vista)){
+            analizar_palabra_clave(nodo_procedure, buffer, num_linea, true, fuente);
+            if (vista_empieza_con(vista, PALABRA_BEGIN)) {
+                break;
+            }
         }
 
-        if(strstr(buffer, "writeln") != NULL){
+        if(vista_contiene_identificador(vista, "writeln")){
             analizar_writeln(nodo_procedure, buffer, *num_linea);
         }
 
@@ -1646,10 +4010,12 @@ void analizar_procedure(Nodo* arbol, const char* linea, int* num_linea, FILE* ar
             break;
         }
     }
+    salir_ambito();
+    soltar(buffer);
 }
 
 void analizar_writeln(Nodo* arbol, const char* linea, int num_linea) {
-    char contenido[256];
+    char* contenido = (char*)retener(malloc(strlen(linea) + 1));
     contenidoWriteln((char*)linea, contenido);
     trim((char*)linea);
     if (!end_with_semicolon(linea)) {
@@ -1657,22 +4023,30 @@ void analizar_writeln(Nodo* arbol, const char* linea, int num_linea) {
     }
     if (strstr(linea, "writel") != NULL && strstr(linea, "writeln") == NULL) {
         mostrar_error("Comando incorrecto. ¿Quiso escribir 'writeln'?", num_linea, linea);
+        soltar(contenido);
         return;
     }
-    Nodo* nodo_writeln = crear_nodo("writeln", linea);
+    Nodo* nodo_writeln = crear_nodo(NODO_WRITELN, linea);
     agregar_hijo(arbol, nodo_writeln);
-    char* contenido_en_parentesis = extraer_parentesis(linea);
+    char* contenido_en_parentesis = (char*)retener(extraer_parentesis(linea));
+    // writeln; y writeln() solo imprimen un salto de linea
+    if (contenido_en_parentesis == NULL || contenido_en_parentesis[0] == '\0') {
+        agregar_hijo(nodo_writeln, crear_nodo(NODO_CONTENIDO, ""));
+        soltar(contenido_en_parentesis);
+        soltar(contenido);
+        return;
+    }
     if((starts_with(contenido_en_parentesis, "\'"))){
-        printf("%s empieza con comillas simples\n", contenido_en_parentesis);
+        TRAZA(TRAZA_WRITELN, TRAZA_DETALLE, "%s empieza con comillas simples\n", contenido_en_parentesis);
         if(!ends_with(contenido_en_parentesis, "\'")){
-            printf("no termina con comillas simples\n");
+            TRAZA(TRAZA_WRITELN, TRAZA_INFO, "no termina con comillas simples\n");
             mostrar_error("Comilla simple faltante", num_linea, linea);
         }
     }
     if(ends_with(contenido_en_parentesis, "\'")){
-        printf("%s termina con comillas simples\n", contenido_en_parentesis);
+        TRAZA(TRAZA_WRITELN, TRAZA_DETALLE, "%s termina con comillas simples\n", contenido_en_parentesis);
         if(!starts_with(contenido_en_parentesis, "\'")){
-            printf("no empieza con comillas simples\n");
+            TRAZA(TRAZA_WRITELN, TRAZA_INFO, "no empieza con comillas simples\n");
             mostrar_error("Comilla simple faltante", num_linea, linea);
         }
     }
@@ -1694,342 +4068,2418 @@ void analizar_writeln(Nodo* arbol, const char* linea, int num_linea) {
 
     if(!starts_with(contenido_en_parentesis, "\'") && !ends_with(contenido_en_parentesis, "\'")){
     }
-    Nodo* contenido_writeln = crear_nodo("contenido", contenido_en_parentesis);
+    Nodo* contenido_writeln = crear_nodo(NODO_CONTENIDO, contenido_en_parentesis);
     agregar_hijo(nodo_writeln, contenido_writeln);
-    
+    soltar(contenido_en_parentesis);
+    soltar(contenido);
 }
 
-void analizar_if(Nodo* arbol, const char* linea, int *num_linea, FILE* archivo) {
-    char condicion[256];
-    char buffer[256];
-    extraer_condicion_if(linea, condicion);
+void analizar_if(Nodo* arbol, const char* linea, VistaTokens vista, int *num_linea, Fuente* fuente) {
+    char* condicion = (char*)retener(nuevo_buffer_linea(fuente));
+    char* buffer = (char*)retener(nuevo_buffer_linea(fuente));
+    VistaTokens vista_buffer;
+    extraer_condicion_if(linea, vista, condicion, fuente->tam_linea);
     trim((char*)linea);
     
-    if (strstr(linea, "then") != NULL && !starts_with(linea, "if")) {
+    if (vista_buscar_palabra(vista, PALABRA_THEN, 0) >= 0 && !vista_empieza_con(vista, PALABRA_IF)) {
         mostrar_error("'then' debe ser precedido por 'if'", *num_linea, linea);
+        soltar(condicion);
+        soltar(buffer);
         return;
     }
 
-    int terminaConThen = ends_with(linea, "then");
+    int terminaConThen = vista.num_tokens > 0 && vista.tokens[vista.num_tokens - 1].palabra == PALABRA_THEN;
     if (!terminaConThen) {
         mostrar_error("La estructura if debe terminar con 'then'", *num_linea, linea);
     }
 
     if (!validar_condicion(condicion, *num_linea)) {
+        soltar(condicion);
+        soltar(buffer);
         return;
     }
-    Nodo* nodo_if_statement = crear_nodo("if_statement", linea);
+    Nodo* nodo_if_statement = crear_nodo(NODO_IF_STATEMENT, linea);
     agregar_hijo(arbol, nodo_if_statement);
-    Nodo* nodo_if = crear_nodo("if", "if");
+    Nodo* nodo_if = crear_nodo(NODO_IF, "if");
     agregar_hijo(nodo_if_statement, nodo_if);
-    Nodo* contenido_if = crear_nodo("contenido", condicion);
+    Nodo* contenido_if = crear_nodo(NODO_CONTENIDO, condicion);
     agregar_hijo(nodo_if, contenido_if);
-    int num_operadores = sizeof(operadoresDeComparacion) / sizeof(operadoresDeComparacion[0]);
-    int count = 0;
-    for (int i = 0; i < sizeof(operadoresDeComparacion) / sizeof(operadoresDeComparacion[0]); i++) {
-        if (strstr(condicion, operadoresDeComparacion[i]) != NULL) {
-            char** partesCondicion = split(condicion, operadoresDeComparacion[i], &count);
-            Nodo* nodo_operador_izq = crear_nodo("nodo_operador_izq", partesCondicion[0]);
-            Nodo* nodo_operador_der = crear_nodo("nodo_operador_der", partesCondicion[1]);
-            Nodo* nodo_operador = crear_nodo("operador", operadoresDeComparacion[i]);
-            agregar_hijo(contenido_if, nodo_operador_izq);
-            agregar_hijo(contenido_if, nodo_operador);
-            agregar_hijo(contenido_if, nodo_operador_der);
-            break;
-        }
-    }
-    Nodo* then = crear_nodo("then", "then");
+    int inicio = vista_buscar_palabra(vista, PALABRA_IF, 0) + 1;
+    int fin = vista_buscar_palabra(vista, PALABRA_THEN, inicio);
+    int op = vista_buscar(vista, TOKEN_COMPARACION, inicio);
+    if (op >= 0 && op < fin) {
+        char* izquierda = nuevo_buffer_linea(fuente);
+        char* derecha = nuevo_buffer_linea(fuente);
+        char operador[4];
+        const char* pos_op = token_en_linea(linea, vista, op);
+        copiar_fragmento(izquierda, fuente->tam_linea, token_en_linea(linea, vista, inicio), pos_op);
+        copiar_fragmento(derecha, fuente->tam_linea, pos_op + vista.tokens[op].longitud, token_en_linea(linea, vista, fin));
+        copiar_fragmento(operador, sizeof(operador), pos_op, pos_op + vista.tokens[op].longitud);
+        Nodo* nodo_operador_izq = crear_nodo(NODO_NODO_OPERADOR_IZQ, izquierda);
+        Nodo* nodo_operador_der = crear_nodo(NODO_NODO_OPERADOR_DER, derecha);
+        Nodo* nodo_operador = crear_nodo(NODO_OPERADOR, operador);
+        agregar_hijo(contenido_if, nodo_operador_izq);
+        agregar_hijo(contenido_if, nodo_operador);
+        agregar_hijo(contenido_if, nodo_operador_der);
+        free(izquierda);
+        free(derecha);
+    }
+    Nodo* then = crear_nodo(NODO_THEN, "then");
     agregar_hijo(nodo_if_statement, then);
-    while (fgets(buffer, sizeof(buffer), archivo)) {
+    while (leer_linea(fuente, buffer, fuente->tam_linea, &vista_buffer)) {
         (*num_linea)++;
         trim((char*)buffer);
         if (linea[0] == '\0') {
             continue;
         }
-        if (starts_with(buffer, "while") || starts_with(buffer, "for")) {
+        if (vista_empieza_con(vista_buffer, PALABRA_WHILE) || vista_empieza_con(vista_buffer, PALABRA_FOR)) {
             strcpy((char*)linea, buffer);
             break;
         }
-        Nodo* nodo_sentencia = crear_nodo("sentencia", "");
+        Nodo* nodo_sentencia = crear_nodo(NODO_SENTENCIA, "");
         agregar_hijo(nodo_if_statement, nodo_sentencia);
-        if (strstr(buffer, "writeln") != NULL) {
+        if (vista_contiene_identificador(vista_buffer, "writeln")) {
             analizar_writeln(nodo_sentencia, buffer, *num_linea);
         }
     }
+    soltar(condicion);
+    soltar(buffer);
 }
 
-void analizar_while(Nodo* arbol, const char* linea, int *num_linea, FILE* archivo){
-    char condicion[256];
-    char buffer[256];
+void analizar_while(Nodo* arbol, const char* linea, VistaTokens vista, int *num_linea, Fuente* fuente){
+    char* condicion = (char*)retener(nuevo_buffer_linea(fuente));
+    char* buffer = (char*)retener(nuevo_buffer_linea(fuente));
+    VistaTokens vista_buffer;
     trim((char*)linea);
-    extraer_condicion_while(linea, condicion);
+    extraer_condicion_while(linea, vista, condicion, fuente->tam_linea);
     if (!validar_condicion(condicion, *num_linea)) {
+        soltar(condicion);
+        soltar(buffer);
         return;
     }
-    int terminaConDo = ends_with(linea, "do");
-    printf("Termina con do: %i\n", terminaConDo);
+    int terminaConDo = vista.tokens[vista.num_tokens - 1].palabra == PALABRA_DO;
+    TRAZA(TRAZA_CONTROL, TRAZA_DETALLE, "while termina con do: %i\n", terminaConDo);
     if(!terminaConDo){
         mostrar_error("La estructura while debe terminar con 'do'", *num_linea, linea);
     }
-    Nodo* while_statement = crear_nodo("while_statement", linea);
+    Nodo* while_statement = crear_nodo(NODO_WHILE_STATEMENT, linea);
     agregar_hijo(arbol, while_statement);
-    Nodo* nodo_while = crear_nodo("while", "while");
+    Nodo* nodo_while = crear_nodo(NODO_WHILE, "while");
     agregar_hijo(while_statement, nodo_while);
     trim(condicion);
-    Nodo* contenido_while = crear_nodo("contenido", condicion);
+    Nodo* contenido_while = crear_nodo(NODO_CONTENIDO, condicion);
     agregar_hijo(nodo_while, contenido_while);
-    int num_operadores = sizeof(operadoresDeComparacion) / sizeof(operadoresDeComparacion[0]);
-    int count = 0;
-    for(int i = 0; i < num_operadores; i++){
-        if(strstr(condicion, operadoresDeComparacion[i]) != NULL){
-           char** partesCondicion = split(condicion, operadoresDeComparacion[i], &count);
-            Nodo* nodo_operador_izq = crear_nodo("nodo_operador_izq", partesCondicion[0]);
-            Nodo* nodo_operador_der = crear_nodo("nodo_operador_der", partesCondicion[1]);
-            Nodo* nodo_operador = crear_nodo("operador", operadoresDeComparacion[i]);
-            agregar_hijo(contenido_while, nodo_operador_izq);
-            agregar_hijo(contenido_while, nodo_operador);
-            agregar_hijo(contenido_while, nodo_operador_der);
-            break;
-        }
-    }
-
-    Nodo* nodo_do = crear_nodo("do", "do");
+    int inicio = vista_buscar_palabra(vista, PALABRA_WHILE, 0) + 1;
+    int fin = vista_buscar_palabra(vista, PALABRA_DO, inicio);
+    int op = vista_buscar(vista, TOKEN_COMPARACION, inicio);
+    if(op >= 0 && op < fin){
+        char* izquierda = nuevo_buffer_linea(fuente);
+        char* derecha = nuevo_buffer_linea(fuente);
+        char operador[4];
+        const char* pos_op = token_en_linea(linea, vista, op);
+        const char* fin_condicion = token_en_linea(linea, vista, fin - 1) + vista.tokens[fin - 1].longitud;
+        copiar_fragmento(izquierda, fuente->tam_linea, token_en_linea(linea, vista, inicio), pos_op);
+        copiar_fragmento(derecha, fuente->tam_linea, pos_op + vista.tokens[op].longitud, fin_condicion);
+        copiar_fragmento(operador, sizeof(operador), pos_op, pos_op + vista.tokens[op].longitud);
+        Nodo* nodo_operador_izq = crear_nodo(NODO_NODO_OPERADOR_IZQ, izquierda);
+        Nodo* nodo_operador_der = crear_nodo(NODO_NODO_OPERADOR_DER, derecha);
+        Nodo* nodo_operador = crear_nodo(NODO_OPERADOR, operador);
+        agregar_hijo(contenido_while, nodo_operador_izq);
+        agregar_hijo(contenido_while, nodo_operador);
+        agregar_hijo(contenido_while, nodo_operador_der);
+        free(izquierda);
+        free(derecha);
+    }
+
+    Nodo* nodo_do = crear_nodo(NODO_DO, "do");
     agregar_hijo(while_statement, nodo_do);
-    while(fgets(buffer, sizeof(buffer), archivo)){
+    while(leer_linea(fuente, buffer, fuente->tam_linea, &vista_buffer)){
         (*num_linea)++;
         trim((char*)buffer);
         if(linea[0] == '\0'){
             continue;
         }
-        if(starts_with(buffer, "if") || starts_with(buffer, "for") || starts_with(buffer, "while")){
+        if(vista_empieza_con(vista_buffer, PALABRA_IF) || vista_empieza_con(vista_buffer, PALABRA_FOR) || vista_empieza_con(vista_buffer, PALABRA_WHILE)){
             strcpy((char*)linea, buffer);
             break;
         }
-        Nodo* nodo_sentencia = crear_nodo("sentencia", "");
+        Nodo* nodo_sentencia = crear_nodo(NODO_SENTENCIA, "");
         agregar_hijo(while_statement, nodo_sentencia);
-        if(strstr(buffer, "writeln") != NULL){
+        if(vista_contiene_identificador(vista_buffer, "writeln")){
             analizar_writeln(nodo_sentencia, buffer, *num_linea);
         }
     }
-
+    soltar(condicion);
+    soltar(buffer);
 }
 
 
 
-void analizar_for(Nodo* arbol, const char* linea, int *num_linea, FILE* archivo) {
-    char buffer[256];
-    char inicializacion[256];
+void analizar_for(Nodo* arbol, const char* linea, VistaTokens vista, int *num_linea, Fuente* fuente) {
     char operador_control[10];
-    char final[50];
+    VistaTokens vista_buffer;
     
 
-    const char* ptr = linea + 4; 
-    while (*ptr && isspace(*ptr)) ptr++;
-    
-    char variable[50] = {0};
-    int i = 0;
-    while (*ptr && !isspace(*ptr) && *ptr != ':' && i < 49) {
-        variable[i++] = *ptr++;
+    char* variable = (char*)retener(nuevo_buffer_linea(fuente));
+    variable[0] = '\0';
+    if (vista.num_tokens > 1 && vista.tokens[1].tipo == TOKEN_IDENTIFICADOR) {
+        const char* pos_variable = token_en_linea(linea, vista, 1);
+        copiar_fragmento(variable, fuente->tam_linea, pos_variable, pos_variable + vista.tokens[1].longitud);
     }
-    variable[i] = '\0';
     
     if (!variable_existe(variable)) {
-        char error_msg[100];
-        sprintf(error_msg, "Variable o funcion no declarada -> %s", variable);
+        char error_msg[200];
+        const char* sugerencia = sugerir_simbolo(variable, true, false);
+        if (sugerencia) {
+            snprintf(error_msg, sizeof(error_msg), "Variable o funcion no declarada -> %s (¿quiso escribir '%s'?)", variable, sugerencia);
+        } else {
+            snprintf(error_msg, sizeof(error_msg), "Variable o funcion no declarada -> %s", variable);
+        }
         mostrar_error(error_msg, *num_linea, linea);
+        soltar(variable);
         return;
     }
+    soltar(variable);
     
-    if (!validar_condicion_for(linea, *num_linea)) {
+    if (!validar_condicion_for(linea, vista, *num_linea)) {
         return;
     }
     
-    extraer_condicion_for(linea, inicializacion, operador_control, final);
+    char* inicializacion = (char*)retener(nuevo_buffer_linea(fuente));
+    char* final = (char*)retener(nuevo_buffer_linea(fuente));
+    extraer_condicion_for(linea, vista, inicializacion, operador_control, final, fuente->tam_linea);
     
-    printf("Inicializacion del for: %s\n", inicializacion);
-    printf("Operador de control: %s\n", operador_control);
-    printf("Valor final: %s\n", final);
+    TRAZA(TRAZA_CONTROL, TRAZA_INFO, "for: inicializacion '%s', operador '%s', valor final '%s'\n",
+          inicializacion, operador_control, final);
     
     
-    Nodo* nodo_for_statement = crear_nodo("for_statement", linea);
+    Nodo* nodo_for_statement = crear_nodo(NODO_FOR_STATEMENT, linea);
     agregar_hijo(arbol, nodo_for_statement);
     
-    Nodo* nodo_for = crear_nodo("for", "for");
+    Nodo* nodo_for = crear_nodo(NODO_FOR, "for");
     agregar_hijo(nodo_for_statement, nodo_for);
     
     analizar_asignacion(nodo_for_statement, inicializacion, *num_linea);
     
-    Nodo* nodo_operador_control = crear_nodo("operador_control", operador_control);
+    Nodo* nodo_operador_control = crear_nodo(NODO_OPERADOR_CONTROL, operador_control);
     agregar_hijo(nodo_for_statement, nodo_operador_control);
     
-    Nodo* nodo_final = crear_nodo("final", final);
+    Nodo* nodo_final = crear_nodo(NODO_FINAL, final);
     agregar_hijo(nodo_for_statement, nodo_final);
+    soltar(final);
+    soltar(inicializacion);
     
-    Nodo* nodo_do = crear_nodo("do", "do");
+    Nodo* nodo_do = crear_nodo(NODO_DO, "do");
     agregar_hijo(nodo_for_statement, nodo_do);
     
     bool has_begin_block = false;
-    long pos = ftell(archivo); 
+    int pos = fuente->linea_actual; 
+    char* buffer = (char*)retener(nuevo_buffer_linea(fuente));
     
-    if (fgets(buffer, sizeof(buffer), archivo)) {
+    if (leer_linea(fuente, buffer, fuente->tam_linea, &vista_buffer)) {
         trim(buffer);
-        if (strcmp(buffer, "begin") == 0) {
+        if (vista_buffer.num_tokens == 1 && vista_buffer.tokens[0].palabra == PALABRA_BEGIN) {
             has_begin_block = true;
             (*num_linea)++;
-            analizar_palabra_clave(nodo_for_statement, buffer, num_linea, false, archivo);
+            analizar_palabra_clave(nodo_for_statement, buffer, num_linea, false, fuente);
         } else {
-            fseek(archivo, pos, SEEK_SET); 
+            fuente->linea_actual = pos; 
         }
-    } else {
-        fseek(archivo, pos, SEEK_SET);  
     }
     
     if (!has_begin_block) {
-        if (fgets(buffer, sizeof(buffer), archivo)) {
+        if (leer_linea(fuente, buffer, fuente->tam_linea, &vista_buffer)) {
             (*num_linea)++;
             trim(buffer);
             
-            Nodo* nodo_sentencia = crear_nodo("sentencia", "");
+            Nodo* nodo_sentencia = crear_nodo(NODO_SENTENCIA, "");
             agregar_hijo(nodo_for_statement, nodo_sentencia);
             
-            if (starts_with(buffer, "writeln")) {
+            if (vista_empieza_con_identificador(vista_buffer, "writeln")) {
                 analizar_writeln(nodo_sentencia, buffer, *num_linea);
             } 
-            else if (strstr(buffer, ":=") != NULL) {
+            else if (vista_buscar(vista_buffer, TOKEN_ASIGNACION, 0) >= 0) {
                 analizar_asignacion(nodo_sentencia, buffer, *num_linea);
             }
-            else if (es_llamada_funcion(buffer)) {
+            else if (vista_es_llamada_funcion(vista_buffer)) {
                 procesar_llamada_funcion(buffer, *num_linea);
             }
         }
     }
     
-    printf("Termina con do: %d\n", 1);
+    soltar(buffer);
 }
 
 
-void imprimir_arbol(Nodo* nodo, int nivel) {
-    for (int i = 0; i < nivel; i++) printf("  ");  
-    printf("%s(%s)\n", nodo->tipo, nodo->valor);  
+#define TAM_VACIADO_ARBOL (1024 * 1024)
 
-    for (int i = 0; i < nodo->num_hijos; i++) {
-        imprimir_arbol(nodo->hijos[i], nivel + 1); 
+void abrir_arbol(Escritor* escritor) {
+    if (formato_arbol == ARBOL_DOT) {
+        escribir_texto(escritor, "digraph arbol {\n  node [shape=box];\n");
     }
 }
 
-int main() {
-    FILE* archivo = fopen("codigo_pascal.txt", "r");
-    if (!archivo) {
-        perror("Error al abrir el archivo");
-        return 1; 
+// padre es el numero del nodo que lo contiene, -1 en la raiz
+void entrar_nodo(Escritor* escritor, const Nodo* nodo, int nivel, long numero, long padre) {
+    const char* tipo = nombres_tipo_nodo[nodo->tipo];
+    const char* valor = cadenas_arbol.textos[nodo->valor];
+    switch (formato_arbol) {
+        case ARBOL_TEXTO:
+            escribir_repetido(escritor, ' ', 2 * (size_t)nivel);
+            escribir_texto(escritor, tipo);
+            escribir_bytes(escritor, "(", 1);
+            escribir_texto(escritor, valor);
+            escribir_bytes(escritor, ")\n", 2);
+            break;
+        case ARBOL_DOT:
+            // Las etiquetas usan las mismas secuencias de escape que JSON
+            escribir(escritor, "  n%ld [label=\"%s(", numero, tipo);
+            escribir_escapado(escritor, valor);
+            escribir_texto(escritor, ")\"];\n");
+            if (padre >= 0) {
+                escribir(escritor, "  n%ld -> n%ld;\n", padre, numero);
+            }
+            break;
+        case ARBOL_SEXP:
+            if (padre >= 0) {
+                escribir_bytes(escritor, "\n", 1);
+            }
+            escribir_repetido(escritor, ' ', 2 * (size_t)nivel);
+            // Los tipos con espacios van entre barras, como los simbolos de Lisp
+            escribir(escritor, strchr(tipo, ' ') ? "(|%s| " : "(%s ", tipo);
+            escribir_json(escritor, valor);
+            break;
     }
+}
 
-    inicializar_tabla_simbolos();
+void salir_nodo(Escritor* escritor) {
+    if (formato_arbol == ARBOL_SEXP) {
+        escribir_bytes(escritor, ")", 1);
+    }
+}
 
-    Nodo* arbol = crear_nodo("programaPrueba", "");
-    char linea[256];
-    char nombre_funcion[50];
-    char nombre_procedure[50];  
-    int num_linea = 0;
- 
-    while (fgets(linea, sizeof(linea), archivo)) {
-        trim(linea);
-        if (*linea == '\0') {
-            num_linea++;
-            continue;
-        }
- 
-        char linea_lower[256];
-        strcpy(linea_lower, linea);
-        toLowerCase(linea_lower);
-        
-        if (starts_with(linea_lower, "function")) {
-            char temp_nombre[50] = {0};
-            
-            const char* ptr = linea + 9; 
-            while (*ptr && isspace(*ptr)) ptr++; 
-            
-            int i = 0;
-            while (*ptr && !isspace(*ptr) && *ptr != '(' && i < 49) {
-                temp_nombre[i++] = *ptr++;
-            }
-            temp_nombre[i] = '\0';
+void cerrar_arbol(Escritor* escritor) {
+    if (formato_arbol == ARBOL_DOT) {
+        escribir_texto(escritor, "}\n");
+    } else if (formato_arbol == ARBOL_SEXP) {
+        escribir_bytes(escritor, "\n", 1);
+    }
+}
 
-            toLowerCase(temp_nombre);
-            
-            printf("DEBUG: declaracion de funcion encontrada: '%s'\n", temp_nombre);
-
-            char* dos_puntos = strrchr(linea, ':');
-            if (dos_puntos) {
-                char tipo_str[50] = {0};
-                char* semicolon = strchr(dos_puntos, ';');
-                if (semicolon) {
-                    strncpy(tipo_str, dos_puntos + 1, semicolon - dos_puntos - 1);
-                } else {
-                    strcpy(tipo_str, dos_puntos + 1);
-                }
-                trim(tipo_str);
-                toLowerCase(tipo_str);
-                
-                TipoDato tipo_retorno = obtener_tipo_desde_string(tipo_str);
-                if (!funcion_existe(temp_nombre)) {
-                agregar_funcion(temp_nombre, tipo_retorno, num_linea);
-                printf("DEBUG: Funcion pre-registrada '%s' con tipo %d\n", temp_nombre, tipo_retorno);
-                }
+// Recorre en preorden con una pila propia, sin recursion, y escribe en un buffer que se
+// vuelca a la salida cada TAM_VACIADO_ARBOL bytes
+void imprimir_arbol(Nodo* arbol) {
+    typedef struct {
+        Nodo* nodo;
+        long numero;
+    } Abierto;
+
+    Escritor escritor = {0};
+    Abierto* pila = NULL;
+    int num_pila = 0;
+    int capacidad_pila = 0;
+    long numero = 0;
+    abrir_arbol(&escritor);
+    for (Nodo* nodo = arbol; nodo != NULL; ) {
+        entrar_nodo(&escritor, nodo, num_pila, numero, num_pila > 0 ? pila[num_pila - 1].numero : -1);
+        if (escritor.tam >= TAM_VACIADO_ARBOL) {
+            fwrite(escritor.datos, 1, escritor.tam, salida);
+            escritor.tam = 0;
+        }
+        if (nodo->primer_hijo) {
+            if (num_pila == capacidad_pila) {
+                capacidad_pila = capacidad_pila ? capacidad_pila * 2 : 64;
+                pila = (Abierto*)realloc(pila, capacidad_pila * sizeof(Abierto));
             }
+            pila[num_pila].nodo = nodo;
+            pila[num_pila++].numero = numero++;
+            nodo = nodo->primer_hijo;
+            continue;
         }
-        
-        num_linea++;
+        numero++;
+        salir_nodo(&escritor);
+        // Sube cerrando los nodos que no tienen mas hermanos
+        while (nodo->siguiente == NULL && num_pila > 0) {
+            nodo = pila[--num_pila].nodo;
+            salir_nodo(&escritor);
+        }
+        nodo = nodo == arbol ? NULL : nodo->siguiente;
     }
+    cerrar_arbol(&escritor);
+    fwrite(escritor.datos, 1, escritor.tam, salida);
+    free(escritor.datos);
+    free(pila);
+}
 
-    rewind(archivo);
-    num_linea = 0;
+// Arbol binario: cabecera, tabla de nodos en preorden, desplazamientos de las cadenas y
+// sus textos terminados en '\0', en el orden de bytes de la maquina, para usarlo con mmap
+// sin leerlo. Las primeras num_tipos cadenas son los nombres de los tipos de nodo y el valor
+// de cada nodo es el indice de su cadena. El nodo 0 es la raiz
+#define MAGIA_ARBOL "PSA1"
+#define SIN_NODO 0xffffffffu
 
-    while (fgets(linea, sizeof(linea), archivo)) {
-        trim(linea);
-        char ultima_linea[256];
-        if (*linea == '\0') {
-            num_linea++;
-            continue;
-        };  
-        for (int i = 0; linea[i]; i++) linea[i] = tolower(linea[i]);
+typedef struct {
+    char magia[4];
+    unsigned int num_nodos;             // la tabla de nodos empieza justo despues de la cabecera
+    unsigned int num_tipos;
+    unsigned int num_cadenas;           // nombres de tipos mas valores
+    unsigned long long inicio_cadenas;  // num_cadenas + 1 desplazamientos desde inicio_textos
+    unsigned long long inicio_textos;
+} CabeceraArbol;
 
-        char palabra_temp[256];
-        strcpy(palabra_temp, linea);
-        trim_semicolon(palabra_temp);
-        if (es_palabra_clave_similar(palabra_temp, num_linea)) {
-            continue;
-        }
+typedef struct {
+    unsigned int tipo;                  // TipoNodo, nombrado por la cadena del mismo indice
+    unsigned int valor;                 // indice en la tabla de cadenas
+    unsigned int linea_inicio;          // lineas de la fuente que cubre el subarbol; 0 si ninguna
+    unsigned int linea_fin;
+    unsigned int primer_hijo;           // indices en la tabla de nodos, o SIN_NODO
+    unsigned int siguiente;
+} NodoArbol;
+
+// En el modo por lotes el nombre sale de la ruta del archivo, con las barras cambiadas por '_'
+void ruta_salida_arbol(char* destino, size_t tam, const char* ruta) {
+    if (!arbol_binario_por_archivo) {
+        snprintf(destino, tam, "%s", ruta_arbol_binario);
+        return;
+    }
+    int n = snprintf(destino, tam, "%s/", ruta_arbol_binario);
+    for (const char* p = ruta; *p && n + 5 < (int)tam; p++) {
+        destino[n++] = (*p == '/' || *p == '\\') ? '_' : *p;
+    }
+    snprintf(destino + n, tam - n, ".ast");
+}
 
-        if(starts_with(linea, "var")) {
-            analizar_inicializacion_variables(arbol, linea, &num_linea, archivo, ultima_linea);
+// Arma el archivo completo en memoria y lo escribe de una vez
+bool escribir_arbol_binario(Nodo* arbol, const char* ruta) {
+    typedef struct {
+        Nodo* nodo;
+        unsigned int indice;
+    } Pendiente;
+
+    // Preorden sin recursion, los arboles de expresiones pueden ser muy hondos. La pila guarda
+    // los nodos cuyo siguiente hermano todavia no tiene indice. Solo se guardan las cadenas que
+    // usa el arbol, numeradas en el orden en que aparecen
+    unsigned int* cadena_guardada = (unsigned int*)calloc(cadenas_arbol.num_textos + 1, sizeof(unsigned int));
+    unsigned int* usadas = (unsigned int*)malloc((cadenas_arbol.num_textos + 1) * sizeof(unsigned int));
+    unsigned int num_usadas = 0;
+    NodoArbol* nodos = NULL;
+    unsigned int num_nodos = 0;
+    unsigned int capacidad = 0;
+    Pendiente* pila = NULL;
+    int num_pila = 0;
+    int capacidad_pila = 0;
+    for (Nodo* nodo = arbol; nodo != NULL; ) {
+        if (num_nodos == capacidad) {
+            capacidad = capacidad ? capacidad * 2 : 256;
+            nodos = (NodoArbol*)realloc(nodos, capacidad * sizeof(NodoArbol));
         }
-        else if (starts_with(linea, "function")) {
-            analizar_funcion(arbol, linea, &num_linea, archivo, nombre_funcion);
+        unsigned int i = num_nodos++;
+        nodos[i].tipo = nodo->tipo;
+        if (cadena_guardada[nodo->valor] == 0) {
+            usadas[num_usadas++] = nodo->valor;
+            cadena_guardada[nodo->valor] = num_usadas;
         }
-        else if(starts_with(linea, "procedure")){
-            analizar_procedure(arbol, linea, &num_linea, archivo, nombre_procedure);
+        nodos[i].valor = NUM_TIPOS_NODO + cadena_guardada[nodo->valor] - 1;
+        nodos[i].linea_inicio = nodos[i].linea_fin = (unsigned int)nodo->linea;
+        nodos[i].primer_hijo = SIN_NODO;
+        nodos[i].siguiente = SIN_NODO;
+        if (nodo->primer_hijo) {
+            if (num_pila == capacidad_pila) {
+                capacidad_pila = capacidad_pila ? capacidad_pila * 2 : 64;
+                pila = (Pendiente*)realloc(pila, capacidad_pila * sizeof(Pendiente));
+            }
+            pila[num_pila].nodo = nodo;
+            pila[num_pila++].indice = i;
+            nodos[i].primer_hijo = num_nodos;
+            nodo = nodo->primer_hijo;
+            continue;
         }
-        else if(starts_with(linea, "if")){
-            analizar_if(arbol, linea, &num_linea, archivo);
+        while (nodo->siguiente == NULL && num_pila > 0) {
+            nodo = pila[--num_pila].nodo;
+            i = pila[num_pila].indice;
         }
-        else if(starts_with(linea, "begin")){
-            analizar_palabra_clave(arbol, linea, &num_linea, false, archivo);
+        if (nodo == arbol || nodo->siguiente == NULL) {
+            break;
         }
-        else if(starts_with(linea, "while")){
-            analizar_while(arbol, linea, &num_linea, archivo);
+        nodos[i].siguiente = num_nodos;
+        nodo = nodo->siguiente;
+    }
+    free(pila);
+    free(cadena_guardada);
+
+    // Los hijos tienen indices mayores, asi que de atras hacia adelante ya tienen su rango
+    for (unsigned int i = num_nodos; i-- > 0; ) {
+        for (unsigned int h = nodos[i].primer_hijo; h != SIN_NODO; h = nodos[h].siguiente) {
+            if (nodos[h].linea_inicio && (!nodos[i].linea_inicio || nodos[h].linea_inicio < nodos[i].linea_inicio)) {
+                nodos[i].linea_inicio = nodos[h].linea_inicio;
+            }
+            if (nodos[h].linea_fin > nodos[i].linea_fin) {
+                nodos[i].linea_fin = nodos[h].linea_fin;
+            }
         }
-        else if(starts_with(linea, "for")){
-            analizar_for(arbol, linea, &num_linea, archivo);
+    }
+
+    unsigned int num_cadenas = NUM_TIPOS_NODO + num_usadas;
+    size_t tam_textos = 0;
+    for (unsigned int i = 0; i < num_cadenas; i++) {
+        const char* texto = i < NUM_TIPOS_NODO ? nombres_tipo_nodo[i] : cadenas_arbol.textos[usadas[i - NUM_TIPOS_NODO]];
+        tam_textos += strlen(texto) + 1;
+    }
+    CabeceraArbol cabecera;
+    memset(&cabecera, 0, sizeof(cabecera));
+    memcpy(cabecera.magia, MAGIA_ARBOL, 4);
+    cabecera.num_nodos = num_nodos;
+    cabecera.num_tipos = NUM_TIPOS_NODO;
+    cabecera.num_cadenas = num_cadenas;
+    cabecera.inicio_cadenas = sizeof(cabecera) + (unsigned long long)num_nodos * sizeof(NodoArbol);
+    cabecera.inicio_textos = cabecera.inicio_cadenas + (num_cadenas + 1ull) * sizeof(unsigned int);
+    size_t tam = (size_t)cabecera.inicio_textos + tam_textos;
+
+    char* datos = (char*)malloc(tam);
+    memcpy(datos, &cabecera, sizeof(cabecera));
+    memcpy(datos + sizeof(cabecera), nodos, (size_t)num_nodos * sizeof(NodoArbol));
+    free(nodos);
+    unsigned int* desplazamientos = (unsigned int*)(datos + cabecera.inicio_cadenas);
+    char* textos = datos + cabecera.inicio_textos;
+    unsigned int desplazamiento = 0;
+    for (unsigned int i = 0; i < num_cadenas; i++) {
+        const char* texto = i < NUM_TIPOS_NODO ? nombres_tipo_nodo[i] : cadenas_arbol.textos[usadas[i - NUM_TIPOS_NODO]];
+        size_t longitud = strlen(texto) + 1;
+        desplazamientos[i] = desplazamiento;
+        memcpy(textos + desplazamiento, texto, longitud);
+        desplazamiento += (unsigned int)longitud;
+    }
+    desplazamientos[num_cadenas] = desplazamiento;
+    free(usadas);
+
+#ifndef _WIN32
+    int fd = open(ruta, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool escrito = fd >= 0;
+    // Un write basta salvo que el sistema lo corte
+    for (size_t hecho = 0; escrito && hecho < tam; ) {
+        ssize_t n = write(fd, datos + hecho, tam - hecho);
+        escrito = n > 0;
+        hecho += escrito ? (size_t)n : 0;
+    }
+    int error = errno;
+    if (fd >= 0 && close(fd) != 0 && escrito) {
+        escrito = false;
+        error = errno;
+    }
+#else
+    FILE* archivo = fopen(ruta, "wb");
+    bool escrito = archivo && fwrite(datos, 1, tam, archivo) == tam;
+    int error = errno;
+    if (archivo && fclose(archivo) != 0 && escrito) {
+        escrito = false;
+        error = errno;
+    }
+#endif
+    free(datos);
+    errno = error;
+    return escrito;
+}
+
+double reloj_segundos() {
+#ifndef _WIN32
+    struct timespec ahora;
+    clock_gettime(CLOCK_MONOTONIC, &ahora);
+    return ahora.tv_sec + ahora.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// Solo se lee el reloj al pasar de una fase a otra, no en cada linea
+void cambiar_fase(FaseAnalisis fase) {
+    if (fase == fase_en_curso) {
+        return;
+    }
+    double ahora = reloj_segundos();
+    if (fase_en_curso != FASE_NINGUNA) {
+        metricas_hilo.tiempos[fase_en_curso] += ahora - inicio_fase;
+    }
+    fase_en_curso = fase;
+    inicio_fase = ahora;
+}
+
+void terminar_fase() {
+    if (fase_en_curso != FASE_NINGUNA) {
+        metricas_hilo.tiempos[fase_en_curso] += reloj_segundos() - inicio_fase;
+        fase_en_curso = FASE_NINGUNA;
+    }
+}
+
+// Suma las metricas del hilo a las del proceso; cada hilo la llama al terminar
+void acumular_metricas() {
+#ifndef _WIN32
+    pthread_mutex_lock(&mutex_metricas);
+#endif
+    for (int i = 0; i < NUM_FASES; i++) {
+        metricas_totales.tiempos[i] += metricas_hilo.tiempos[i];
+    }
+    for (int i = 0; i < NUM_CONTADORES; i++) {
+        metricas_totales.contadores[i] += metricas_hilo.contadores[i];
+    }
+#ifndef _WIN32
+    pthread_mutex_unlock(&mutex_metricas);
+#endif
+    memset(&metricas_hilo, 0, sizeof(metricas_hilo));
+}
+
+// En el lote los tiempos son la suma de todos los hilos
+void informar_metricas(FILE* destino) {
+    const Metricas* m = &metricas_totales;
+    if (formato_metricas == METRICAS_JSON) {
+        fprintf(destino, "{\"fases\":{");
+        for (int i = 0; i < NUM_FASES; i++) {
+            fprintf(destino, "%s\"%s\":%.6f", i ? "," : "", nombres_fase[i], m->tiempos[i]);
         }
-        else if(starts_with(linea, "writeln")){
-            analizar_writeln(arbol, linea, num_linea);
+        fprintf(destino, "},\"contadores\":{");
+        for (int i = 0; i < NUM_CONTADORES; i++) {
+            fprintf(destino, "%s\"%s\":%lld", i ? "," : "", nombres_contador[i], m->contadores[i]);
         }
-        num_linea++;
+        fprintf(destino, "}}\n");
+        return;
+    }
+    double total = 0;
+    for (int i = 0; i < NUM_FASES; i++) {
+        total += m->tiempos[i];
     }
+    fprintf(destino, "%-16s %12s %7s\n", "fase", "segundos", "%");
+    for (int i = 0; i < NUM_FASES; i++) {
+        fprintf(destino, "%-16s %12.6f %6.1f%%\n", nombres_fase[i], m->tiempos[i],
+                total > 0 ? 100 * m->tiempos[i] / total : 0.0);
+    }
+    fprintf(destino, "%-16s %12.6f\n\n", "total", total);
+    fprintf(destino, "%-16s %12s\n", "contador", "total");
+    for (int i = 0; i < NUM_CONTADORES; i++) {
+        fprintf(destino, "%-16s %12lld\n", nombres_contador[i], m->contadores[i]);
+    }
+}
 
-    fclose(archivo);
-    imprimir_arbol(arbol, 0);
+#define MAX_BLOQUES_GUARDADOS (1 << 16)
 
-    return 0; 
+unsigned long long hash_lineas_fuente(const Fuente* fuente, int desde, int num_lineas) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (int i = desde; i < desde + num_lineas; i++) {
+        VistaLinea linea = obtener_linea(fuente, i);
+        hash = hash64(hash, linea.inicio, linea.longitud);
+        hash = hash64(hash, "\n", 1);
+    }
+    return hash;
+}
+
+void liberar_operaciones(Operacion* operaciones, int num_operaciones) {
+    for (int i = 0; i < num_operaciones; i++) {
+        free((char*)operaciones[i].texto);
+        free((char*)operaciones[i].texto2);
+        free((TipoDato*)operaciones[i].tipos);
+    }
+}
+
+void liberar_bloque_guardado(BloqueGuardado* bloque) {
+    free(bloque->salida);
+    for (int i = 0; i < bloque->num_nodos; i++) {
+        free(bloque->nodos[i].valor);
+    }
+    free(bloque->nodos);
+    liberar_operaciones(bloque->operaciones, bloque->num_operaciones);
+    free(bloque->operaciones);
+    memset(bloque, 0, sizeof(*bloque));
+}
+
+void vaciar_cache_bloques() {
+    for (int i = 0; i < cache_bloques.capacidad; i++) {
+        if (cache_bloques.bloques[i].clave != 0) {
+            liberar_bloque_guardado(&cache_bloques.bloques[i]);
+        }
+    }
+    free(cache_bloques.bloques);
+    cache_bloques.bloques = NULL;
+    cache_bloques.capacidad = 0;
+    cache_bloques.num_bloques = 0;
+    liberar_operaciones(cache_bloques.diario, cache_bloques.num_diario);
+    free(cache_bloques.diario);
+    cache_bloques.diario = NULL;
+    cache_bloques.num_diario = 0;
+    cache_bloques.capacidad_diario = 0;
+}
+
+BloqueGuardado* buscar_bloque_guardado(unsigned long long clave) {
+    if (cache_bloques.capacidad == 0) {
+        return NULL;
+    }
+    int pos = (int)(clave & (cache_bloques.capacidad - 1));
+    while (cache_bloques.bloques[pos].clave != 0) {
+        if (cache_bloques.bloques[pos].clave == clave) {
+            return &cache_bloques.bloques[pos];
+        }
+        pos = (pos + 1) & (cache_bloques.capacidad - 1);
+    }
+    return NULL;
+}
+
+// Casilla para guardar un bloque; si ya habia uno con la misma clave se reemplaza
+BloqueGuardado* reservar_bloque_guardado(unsigned long long clave) {
+    BloqueGuardado* anterior = buscar_bloque_guardado(clave);
+    if (anterior) {
+        liberar_bloque_guardado(anterior);
+        anterior->clave = clave;
+        return anterior;
+    }
+    CacheBloques* c = &cache_bloques;
+    if (2 * (c->num_bloques + 1) > c->capacidad) {
+        if (c->capacidad >= MAX_BLOQUES_GUARDADOS) {
+            // Sin desalojo fino: al llenarse se empieza de nuevo
+            vaciar_cache_bloques();
+        }
+        int capacidad = c->capacidad ? c->capacidad * 2 : 256;
+        BloqueGuardado* bloques = (BloqueGuardado*)calloc(capacidad, sizeof(BloqueGuardado));
+        for (int i = 0; i < c->capacidad; i++) {
+            if (c->bloques[i].clave != 0) {
+                int pos = (int)(c->bloques[i].clave & (capacidad - 1));
+                while (bloques[pos].clave != 0) pos = (pos + 1) & (capacidad - 1);
+                bloques[pos] = c->bloques[i];
+            }
+        }
+        free(c->bloques);
+        c->bloques = bloques;
+        c->capacidad = capacidad;
+    }
+    int pos = (int)(clave & (c->capacidad - 1));
+    while (c->bloques[pos].clave != 0) pos = (pos + 1) & (c->capacidad - 1);
+    c->bloques[pos].clave = clave;
+    c->num_bloques++;
+    return &c->bloques[pos];
+}
+
+void guardar_nodos(BloqueGuardado* bloque, Nodo* nodo, int profundidad, int inicio, int* capacidad) {
+    for (; nodo != NULL; nodo = nodo->siguiente) {
+        if (bloque->num_nodos == *capacidad) {
+            *capacidad = *capacidad ? *capacidad * 2 : 16;
+            bloque->nodos = (NodoGuardado*)realloc(bloque->nodos, *capacidad * sizeof(NodoGuardado));
+        }
+        NodoGuardado* guardado = &bloque->nodos[bloque->num_nodos++];
+        guardado->tipo = nodo->tipo;
+        guardado->profundidad = profundidad;
+        guardado->linea = nodo->linea - inicio;
+        guardado->valor = strdup(cadenas_arbol.textos[nodo->valor]);
+        guardar_nodos(bloque, nodo->primer_hijo, profundidad + 1, inicio, capacidad);
+    }
+}
+
+void reconstruir_nodos(Nodo* arbol, const BloqueGuardado* bloque, int inicio) {
+    // En preorden la profundidad crece de a uno, asi que basta el ultimo nodo de cada nivel
+    Nodo** padres = (Nodo**)malloc((bloque->num_nodos + 1) * sizeof(Nodo*));
+    padres[0] = arbol;
+    for (int i = 0; i < bloque->num_nodos; i++) {
+        const NodoGuardado* guardado = &bloque->nodos[i];
+        Nodo* nodo = crear_nodo((TipoNodo)guardado->tipo, guardado->valor);
+        nodo->linea = inicio + guardado->linea;
+        agregar_hijo(padres[guardado->profundidad], nodo);
+        padres[guardado->profundidad + 1] = nodo;
+    }
+    free(padres);
+}
+
+void reproducir_operacion(const Operacion* op, int base_linea) {
+    int linea = op->linea + base_linea;
+    switch (op->tipo) {
+        case OP_ENTRAR_AMBITO: entrar_ambito(op->texto); break;
+        case OP_NOMBRAR_AMBITO: nombrar_ambito(op->texto); break;
+        case OP_SALIR_AMBITO: salir_ambito(); break;
+        case OP_AGREGAR_VARIABLE: agregar_variable(op->texto, (TipoDato)op->entero, linea); break;
+        case OP_INICIALIZAR_VARIABLE: marcar_variable_inicializada(op->texto); break;
+        case OP_AGREGAR_FUNCION: agregar_funcion(op->texto, (TipoDato)op->entero, linea); break;
+        case OP_REDECLARAR_FUNCION: redeclarar_funcion(op->texto, (TipoDato)op->entero, linea); break;
+        case OP_AGREGAR_PARAMETRO: agregar_parametro_funcion(op->texto, op->texto2, (TipoDato)op->entero); break;
+        case OP_RETORNO_ASIGNADO: marcar_funcion_con_retorno(op->texto); break;
+        case OP_TIENE_RETORNO: fijar_tiene_retorno(op->texto, op->bandera); break;
+        case OP_REFERENCIA_PENDIENTE:
+            registrar_referencia_pendiente(op->texto, op->texto2, op->entero, op->tipos, linea, op->bandera);
+            break;
+        case OP_RESOLVER_PENDIENTES: resolver_referencias_pendientes(op->texto); break;
+        case OP_VERIFICAR_INICIALIZADA: verificar_inicializada(op->texto, linea); break;
+        case OP_DIAGNOSTICO: agregar_diagnostico((Severidad)op->entero, linea, op->texto, op->texto2, op->tipos); break;
+    }
+}
+
+// Pasa al bloque lo grabado: la salida capturada, los nodos agregados despues de ultimo_hijo
+// y el diario de operaciones
+void guardar_bloque(BloqueGuardado* bloque, Nodo* arbol, Nodo* ultimo_hijo, const Fuente* fuente, int inicio,
+                    int avance_linea, int num_errores) {
+    CacheBloques* c = &cache_bloques;
+    bloque->num_lineas = fuente->linea_actual - inicio;
+    bloque->hash_lineas = hash_lineas_fuente(fuente, inicio, bloque->num_lineas);
+    bloque->avance_linea = avance_linea;
+    bloque->num_errores = num_errores;
+    bloque->salida = c->captura.datos;
+    bloque->tam_salida = c->captura.tam;
+    c->captura.datos = NULL;
+    int capacidad_nodos = 0;
+    guardar_nodos(bloque, ultimo_hijo ? ultimo_hijo->siguiente : arbol->primer_hijo, 0, inicio, &capacidad_nodos);
+    bloque->operaciones = c->diario;
+    bloque->num_operaciones = c->num_diario;
+    c->diario = NULL;
+    c->num_diario = 0;
+    c->capacidad_diario = 0;
+}
+
+// Los errores del bloque no deben alcanzar el maximo: al repetirlo no se detendria donde corresponde
+bool cabe_en_max_errores(const BloqueGuardado* bloque) {
+    return !(max_errores > 0 && diagnosticos.num_errores + bloque->num_errores >= max_errores);
+}
+
+// Aplica un bloque grabado como si se acabara de analizar desde la linea inicio
+void repetir_bloque(Nodo* arbol, const BloqueGuardado* bloque, int* num_linea, Fuente* fuente, int inicio) {
+    fwrite(bloque->salida, 1, bloque->tam_salida, salida);
+    reconstruir_nodos(arbol, bloque, inicio);
+    for (int i = 0; i < bloque->num_operaciones; i++) {
+        reproducir_operacion(&bloque->operaciones[i], *num_linea);
+    }
+    fuente->linea_actual = inicio + bloque->num_lineas;
+    *num_linea += bloque->avance_linea;
+}
+
+// Deja de grabar y devuelve la salida capturada a su destino; si se aborto, el diario se descarta
+void terminar_grabacion() {
+    CacheBloques* c = &cache_bloques;
+    if (!c->grabando) {
+        return;
+    }
+    c->grabando = false;
+    cerrar_captura(&c->captura);
+    salida = c->salida_anterior;
+    fwrite(c->captura.datos, 1, c->captura.tam, salida);
+}
+
+// Cuerpos en paralelo: una primera pasada aplica solo las declaraciones de cada bloque de
+// nivel superior (las secciones var y las cabeceras) y las graba en un diario. Con ese diario
+// cada trabajador arma la tabla que habria al empezar un tramo de bloques y revisa sus cuerpos,
+// grabandolos como analizar_bloque. El hilo principal sigue analizando en orden y, al llegar a
+// cada bloque, repite lo grabado si el trabajador vio las mismas declaraciones y los mismos
+// datos de otros cuerpos; si no, lo analiza el mismo.
+typedef struct {
+    Fuente fuente;             // copia para los trabajadores; el texto y los tokens se comparten
+    CuerpoParalelo* cuerpos;
+    int num_cuerpos;
+    int capacidad_cuerpos;
+    Operacion* cabeceras;      // declaraciones de todos los bloques, sin los cuerpos
+    int num_cabeceras;
+    int tam_tramo;
+    int siguiente;             // primer bloque del proximo tramo
+    int num_trabajadores;
+    bool cancelado;
+#ifndef _WIN32
+    pthread_mutex_t mutex;
+    pthread_cond_t terminado;
+    pthread_t* hilos;
+    int num_hilos;
+#endif
+} TrabajoCuerpos;
+
+TrabajoCuerpos* trabajo_cuerpos = NULL;
+
+void anotar_lectura(TipoLectura tipo, const char* nombre, bool valor) {
+    CuerpoParalelo* cuerpo = &trabajo_cuerpos->cuerpos[cuerpo_en_curso];
+    if (cuerpo->num_lecturas == cuerpo->capacidad_lecturas) {
+        cuerpo->capacidad_lecturas = cuerpo->capacidad_lecturas ? cuerpo->capacidad_lecturas * 2 : 8;
+        cuerpo->lecturas = (Lectura*)realloc(cuerpo->lecturas, cuerpo->capacidad_lecturas * sizeof(Lectura));
+    }
+    Lectura* lectura = &cuerpo->lecturas[cuerpo->num_lecturas++];
+    lectura->tipo = tipo;
+    lectura->valor = valor;
+    lectura->nombre = strdup(nombre);
+}
+
+// Si la funcion la declaro un bloque de otro trabajador, espera a que termine y toma el
+// valor con que lo dejo su cuerpo
+void importar_tiene_retorno(Funcion* func, const char* nombre) {
+#ifndef _WIN32
+    TrabajoCuerpos* t = trabajo_cuerpos;
+    int d = cuerpo_en_curso - 1;
+    while (d >= 0 && strcasecmp(t->cuerpos[d].nombre, nombre) != 0) {
+        d--;
+    }
+    if (d < 0) {
+        return;
+    }
+    pthread_mutex_lock(&t->mutex);
+    bool propio = t->cuerpos[d].trabajador == trabajador_actual;
+    while (!propio && !t->cuerpos[d].listo) {
+        pthread_cond_wait(&t->terminado, &t->mutex);
+    }
+    pthread_mutex_unlock(&t->mutex);
+    if (propio || !t->cuerpos[d].valido) {
+        return;
+    }
+    const BloqueGuardado* bloque = &t->cuerpos[d].resultado;
+    for (int i = bloque->num_operaciones - 1; i >= 0; i--) {
+        const Operacion* op = &bloque->operaciones[i];
+        if (op->tipo == OP_TIENE_RETORNO && strcasecmp(op->texto, nombre) == 0) {
+            func->tiene_retorno = op->bandera;
+            return;
+        }
+    }
+#endif
+}
+
+// Si el bloque ya escribio el dato, su valor no depende de los otros cuerpos
+bool escrito_por_el_bloque(TipoOperacion tipo, const char* nombre) {
+    for (int i = cache_bloques.num_diario - 1; i >= 0; i--) {
+        const Operacion* op = &cache_bloques.diario[i];
+        if ((op->tipo == tipo || op->tipo == OP_AGREGAR_FUNCION) && strcasecmp(op->texto, nombre) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// tiene_retorno y retorno_asignado los escriben los cuerpos; en un trabajador su lectura se anota
+bool leer_tiene_retorno(Funcion* func) {
+    const char* nombre = tabla.funciones.nombres[func - tabla.funciones.datos];
+    if (cuerpo_en_curso >= 0 && cache_bloques.dentro_de_operacion == 0 && !escrito_por_el_bloque(OP_TIENE_RETORNO, nombre)) {
+        importar_tiene_retorno(func, nombre);
+        anotar_lectura(LECTURA_TIENE_RETORNO, nombre, func->tiene_retorno);
+    }
+    return func->tiene_retorno;
+}
+
+bool leer_retorno_asignado(Funcion* func) {
+    const char* nombre = tabla.funciones.nombres[func - tabla.funciones.datos];
+    if (cuerpo_en_curso >= 0 && cache_bloques.dentro_de_operacion == 0 && !escrito_por_el_bloque(OP_RETORNO_ASIGNADO, nombre)) {
+        anotar_lectura(LECTURA_RETORNO_ASIGNADO, nombre, func->retorno_asignado);
+    }
+    return func->retorno_asignado;
+}
+
+#ifndef _WIN32
+// Aplica las declaraciones del bloque k grabadas en la pasada de cabeceras
+void repetir_cabeceras(const TrabajoCuerpos* t, int k) {
+    int fin = k + 1 < t->num_cuerpos ? t->cuerpos[k + 1].primera_cabecera : t->num_cabeceras;
+    for (int i = t->cuerpos[k].primera_cabecera; i < fin; i++) {
+        if (t->cabeceras[i].tipo != OP_DIAGNOSTICO) {
+            reproducir_operacion(&t->cabeceras[i], 0);
+        }
+    }
+}
+
+// Deja vacio el estado del hilo: tabla, pendientes, diagnosticos y diario
+void reiniciar_estado_hilo() {
+    liberar_referencias_pendientes();
+    descartar_diagnosticos();
+    inicializar_tabla_simbolos();
+    liberar_operaciones(cache_bloques.diario, cache_bloques.num_diario);
+    cache_bloques.num_diario = 0;
+    cache_bloques.dentro_de_operacion = 0;
+}
+
+// Pasada de cabeceras en el hilo principal. Devuelve NULL si no hay cuerpos que repartir o si
+// la pasada se detuvo por el maximo de errores
+TrabajoCuerpos* preparar_cuerpos_en_paralelo(Fuente* fuente) {
+    TrabajoCuerpos* volatile t = (TrabajoCuerpos*)calloc(1, sizeof(TrabajoCuerpos));
+    CacheBloques* c = &cache_bloques;
+    Nodo* raiz = crear_nodo(NODO_PROGRAMA, "");
+    char* linea = nuevo_buffer_linea(fuente);
+    char* ultima_linea = nuevo_buffer_linea(fuente);
+    char nombre[50];
+    volatile int num_cuerpos_revisables = 0;
+    // La salida de esta pasada se descarta; la de verdad sale al analizar
+    Captura descarte;
+    if (!abrir_captura(&descarte)) {
+        free(linea);
+        free(ultima_linea);
+        free(t);
+        return NULL;
+    }
+    FILE* salida_anterior = salida;
+    salida = descarte.archivo;
+    liberar_operaciones(c->diario, c->num_diario);
+    c->num_diario = 0;
+    c->base_linea = 0;
+    c->grabando = true;
+
+    volatile bool abortado = false;
+    int marca_reservas = reservas_en_uso.num_reservas;
+    jmp_buf salto;
+    if (setjmp(salto) == 0) {
+        salida_analisis = &salto;
+        bool en_cabecera = false;
+        VistaTokens vista;
+        fuente->linea_actual = 0;
+        while (leer_linea(fuente, linea, fuente->tam_linea, &vista)) {
+            int i = fuente->linea_actual - 1;
+            if (vista_empieza_con(vista, PALABRA_BEGIN)) {
+                en_cabecera = false;
+                continue;
+            }
+            bool es_var = vista_empieza_con(vista, PALABRA_VAR);
+            bool es_funcion = vista_empieza_con(vista, PALABRA_FUNCTION);
+            // Las variables locales entre la cabecera y el begin no se declaran al analizar
+            if ((!es_var && !es_funcion && !vista_empieza_con(vista, PALABRA_PROCEDURE)) || (es_var && en_cabecera)) {
+                continue;
+            }
+            if (t->num_cuerpos == t->capacidad_cuerpos) {
+                t->capacidad_cuerpos = t->capacidad_cuerpos ? t->capacidad_cuerpos * 2 : 64;
+                t->cuerpos = (CuerpoParalelo*)realloc(t->cuerpos, t->capacidad_cuerpos * sizeof(CuerpoParalelo));
+            }
+            CuerpoParalelo* cuerpo = &t->cuerpos[t->num_cuerpos++];
+            memset(cuerpo, 0, sizeof(*cuerpo));
+            cuerpo->linea = i;
+            cuerpo->es_var = es_var;
+            cuerpo->primera_cabecera = c->num_diario;
+            cuerpo->trabajador = -1;
+
+            trim(linea);
+            for (int j = 0; linea[j]; j++) linea[j] = tolower(linea[j]);
+            int num_linea = i;
+            if (es_var) {
+                analizar_inicializacion_variables(raiz, linea, &num_linea, fuente, ultima_linea);
+                fuente->linea_actual = i + 1;
+            } else {
+                if (es_funcion) {
+                    // Lo mismo que declara analizar_funcion antes del cuerpo
+                    entrar_ambito("");
+                    analizar_cabecera_funcion(raiz, linea, num_linea, nombre);
+                    nombrar_ambito(nombre);
+                    salir_ambito();
+                    snprintf(cuerpo->nombre, sizeof(cuerpo->nombre), "%s", nombre);
+                }
+                en_cabecera = true;
+                num_cuerpos_revisables++;
+            }
+            descartar_diagnosticos();
+        }
+    } else {
+        liberar_reservas(marca_reservas);
+        abortado = true;
+    }
+    salida_analisis = NULL;
+    c->grabando = false;
+    cerrar_captura(&descarte);
+    free(descarte.datos);
+    salida = salida_anterior;
+    t->fuente = *fuente;
+    t->fuente.linea_actual = 0;
+    t->cabeceras = c->diario;
+    t->num_cabeceras = c->num_diario;
+    c->diario = NULL;
+    c->num_diario = 0;
+    c->capacidad_diario = 0;
+    reiniciar_estado_hilo();
+    fuente->linea_actual = 0;
+    free(linea);
+    free(ultima_linea);
+
+    if (abortado || num_cuerpos_revisables == 0) {
+        liberar_operaciones(t->cabeceras, t->num_cabeceras);
+        free(t->cabeceras);
+        free(t->cuerpos);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// Revisa el bloque k en el hilo actual; devuelve false si el analisis se detuvo a la mitad
+bool revisar_cuerpo(TrabajoCuerpos* t, int k, Fuente* fuente, Nodo* raiz, char* linea) {
+    CuerpoParalelo* cuerpo = &t->cuerpos[k];
+    CacheBloques* c = &cache_bloques;
+    VistaTokens vista;
+    fuente->linea_actual = cuerpo->linea;
+    leer_linea(fuente, linea, fuente->tam_linea, &vista);
+    trim(linea);
+    for (int i = 0; linea[i]; i++) linea[i] = tolower(linea[i]);
+
+    cuerpo->huella_declaraciones = tabla.huella_declaraciones;
+    Nodo* ultimo_hijo = raiz->ultimo_hijo;
+    int num_linea = cuerpo->linea;
+    char nombre[50];
+    liberar_operaciones(c->diario, c->num_diario);
+    c->num_diario = 0;
+    c->base_linea = num_linea;
+    if (!abrir_captura(&c->captura)) {
+        return true;
+    }
+    salida = c->captura.archivo;
+    c->grabando = true;
+    cuerpo_en_curso = k;
+
+    volatile bool abortado = false;
+    int marca_reservas = reservas_en_uso.num_reservas;
+    jmp_buf salto;
+    if (setjmp(salto) == 0) {
+        salida_analisis = &salto;
+        if (vista_empieza_con(vista, PALABRA_FUNCTION)) {
+            analizar_funcion(raiz, linea, &num_linea, fuente, nombre);
+        } else {
+            analizar_procedure(raiz, linea, &num_linea, fuente, nombre, sizeof(nombre));
+        }
+    } else {
+        liberar_reservas(marca_reservas);
+        abortado = true;
+    }
+    salida_analisis = NULL;
+    cuerpo_en_curso = -1;
+    c->grabando = false;
+    cerrar_captura(&c->captura);
+    salida = NULL;
+    if (abortado) {
+        free(c->captura.datos);
+        c->captura.datos = NULL;
+        return false;
+    }
+    guardar_bloque(&cuerpo->resultado, raiz, ultimo_hijo, fuente, cuerpo->linea,
+                   num_linea - cuerpo->linea, diagnosticos.num_errores);
+    cuerpo->valido = true;
+    // Cada bloque cuenta solo sus errores, como al repetirlo
+    descartar_diagnosticos();
+    return true;
+}
+
+void* trabajador_cuerpos(void* arg) {
+    TrabajoCuerpos* t = (TrabajoCuerpos*)arg;
+    pthread_mutex_lock(&t->mutex);
+    trabajador_actual = t->num_trabajadores++;
+    pthread_mutex_unlock(&t->mutex);
+
+    inicializar_tabla_simbolos();
+    Fuente fuente = t->fuente;
+    fuente_arbol = &fuente;
+    Nodo* raiz = crear_nodo(NODO_PROGRAMA, "");
+    char* linea = nuevo_buffer_linea(&fuente);
+    int aplicados = 0;  // bloques cuyas declaraciones ya estan en la tabla
+    while (true) {
+        pthread_mutex_lock(&t->mutex);
+        if (t->cancelado || t->siguiente >= t->num_cuerpos) {
+            pthread_mutex_unlock(&t->mutex);
+            break;
+        }
+        int desde = t->siguiente;
+        int hasta = desde + t->tam_tramo < t->num_cuerpos ? desde + t->tam_tramo : t->num_cuerpos;
+        t->siguiente = hasta;
+        for (int k = desde; k < hasta; k++) {
+            t->cuerpos[k].trabajador = trabajador_actual;
+        }
+        pthread_mutex_unlock(&t->mutex);
+
+        for (; aplicados < desde; aplicados++) {
+            repetir_cabeceras(t, aplicados);
+        }
+        for (int k = desde; k < hasta; k++) {
+            if (t->cuerpos[k].es_var) {
+                repetir_cabeceras(t, k);
+                continue;
+            }
+            if (!revisar_cuerpo(t, k, &fuente, raiz, linea)) {
+                // La tabla quedo a medias: se rehace con las declaraciones hasta este bloque
+                reiniciar_estado_hilo();
+                for (int j = 0; j <= k; j++) {
+                    repetir_cabeceras(t, j);
+                }
+            }
+            pthread_mutex_lock(&t->mutex);
+            t->cuerpos[k].listo = true;
+            pthread_cond_broadcast(&t->terminado);
+            pthread_mutex_unlock(&t->mutex);
+        }
+        aplicados = hasta;
+    }
+
+    free(linea);
+    fuente_arbol = NULL;
+    reiniciar_estado_hilo();
+    free(cache_bloques.diario);
+    cache_bloques.diario = NULL;
+    cache_bloques.capacidad_diario = 0;
+    liberar_tabla_simbolos();
+    liberar_arbol();
+    liberar_traza();
+    liberar_reservas(0);
+    acumular_metricas();
+    return NULL;
+}
+
+void iniciar_cuerpos_en_paralelo(TrabajoCuerpos* t, int num_hilos) {
+    if (num_hilos <= 0) {
+        num_hilos = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_hilos < 1) {
+        num_hilos = 1;
+    }
+    // Tramos de bloques seguidos: dentro de un tramo el trabajador ve los efectos de sus cuerpos
+    t->tam_tramo = t->num_cuerpos / (4 * num_hilos);
+    if (t->tam_tramo < 1) {
+        t->tam_tramo = 1;
+    }
+    for (int k = 0; k < t->num_cuerpos; k++) {
+        t->cuerpos[k].listo = t->cuerpos[k].es_var;
+    }
+    pthread_mutex_init(&t->mutex, NULL);
+    pthread_cond_init(&t->terminado, NULL);
+    t->hilos = (pthread_t*)malloc(num_hilos * sizeof(pthread_t));
+    t->num_hilos = num_hilos;
+    for (int i = 0; i < num_hilos; i++) {
+        pthread_create(&t->hilos[i], NULL, trabajador_cuerpos, t);
+    }
+}
+
+void terminar_cuerpos_en_paralelo() {
+    TrabajoCuerpos* t = trabajo_cuerpos;
+    if (!t) {
+        return;
+    }
+    pthread_mutex_lock(&t->mutex);
+    t->cancelado = true;
+    pthread_mutex_unlock(&t->mutex);
+    for (int i = 0; i < t->num_hilos; i++) {
+        pthread_join(t->hilos[i], NULL);
+    }
+    free(t->hilos);
+    pthread_cond_destroy(&t->terminado);
+    pthread_mutex_destroy(&t->mutex);
+    for (int k = 0; k < t->num_cuerpos; k++) {
+        CuerpoParalelo* cuerpo = &t->cuerpos[k];
+        liberar_bloque_guardado(&cuerpo->resultado);
+        for (int i = 0; i < cuerpo->num_lecturas; i++) {
+            free(cuerpo->lecturas[i].nombre);
+        }
+        free(cuerpo->lecturas);
+    }
+    liberar_operaciones(t->cabeceras, t->num_cabeceras);
+    free(t->cabeceras);
+    free(t->cuerpos);
+    free(t);
+    trabajo_cuerpos = NULL;
+}
+
+// En el hilo principal: si un trabajador reviso el bloque que empieza en la linea inicio y su
+// resultado vale para la tabla actual, lo repite
+bool usar_cuerpo_en_paralelo(Nodo* arbol, int* num_linea, Fuente* fuente) {
+    TrabajoCuerpos* t = trabajo_cuerpos;
+    int inicio = fuente->linea_actual - 1;
+    int bajo = 0;
+    int alto = t->num_cuerpos - 1;
+    while (bajo < alto) {
+        int medio = (bajo + alto) / 2;
+        if (t->cuerpos[medio].linea < inicio) {
+            bajo = medio + 1;
+        } else {
+            alto = medio;
+        }
+    }
+    CuerpoParalelo* cuerpo = &t->cuerpos[bajo];
+    if (cuerpo->linea != inicio || cuerpo->es_var) {
+        return false;
+    }
+    pthread_mutex_lock(&t->mutex);
+    while (!cuerpo->listo) {
+        pthread_cond_wait(&t->terminado, &t->mutex);
+    }
+    pthread_mutex_unlock(&t->mutex);
+
+    if (!cuerpo->valido || cuerpo->huella_declaraciones != tabla.huella_declaraciones ||
+        !cabe_en_max_errores(&cuerpo->resultado)) {
+        return false;
+    }
+    for (int i = 0; i < cuerpo->num_lecturas; i++) {
+        const Lectura* lectura = &cuerpo->lecturas[i];
+        Funcion* func = buscar_funcion(lectura->nombre);
+        bool valor = func && (lectura->tipo == LECTURA_TIENE_RETORNO ? func->tiene_retorno : func->retorno_asignado);
+        if (!func || valor != lectura->valor) {
+            return false;
+        }
+    }
+    repetir_bloque(arbol, &cuerpo->resultado, num_linea, fuente, inicio);
+    return true;
+}
+#endif
+
+// Analiza un bloque var/function/procedure de nivel superior cuya cabecera ya se leyo. Con la
+// cache activa, si el bloque tiene las mismas lineas y la tabla llega en el mismo estado que
+// la vez anterior, se repite su resultado en lugar de analizarlo
+void analizar_bloque(Nodo* arbol, char* linea, VistaTokens vista, int* num_linea, Fuente* fuente,
+                     char* ultima_linea, char* nombre_funcion, char* nombre_procedure, size_t tam_nombre_procedure) {
+#ifndef _WIN32
+    if (trabajo_cuerpos && usar_cuerpo_en_paralelo(arbol, num_linea, fuente)) {
+        return;
+    }
+#endif
+    if (!cache_bloques_activo) {
+        if (vista_empieza_con(vista, PALABRA_VAR)) {
+            analizar_inicializacion_variables(arbol, linea, num_linea, fuente, ultima_linea);
+        } else if (vista_empieza_con(vista, PALABRA_FUNCTION)) {
+            analizar_funcion(arbol, linea, num_linea, fuente, nombre_funcion);
+        } else {
+            analizar_procedure(arbol, linea, num_linea, fuente, nombre_procedure, tam_nombre_procedure);
+        }
+        return;
+    }
+
+    CacheBloques* c = &cache_bloques;
+    int inicio = fuente->linea_actual - 1;
+    VistaLinea cabecera = obtener_linea(fuente, inicio);
+    unsigned long long clave = hash64(tabla.huella ^ 0x9e3779b97f4a7c15ull, cabecera.inicio, cabecera.longitud);
+    if (clave == 0) {
+        clave = 1;
+    }
+
+    BloqueGuardado* bloque = buscar_bloque_guardado(clave);
+    if (bloque && inicio + bloque->num_lineas <= fuente->num_lineas && cabe_en_max_errores(bloque) &&
+        hash_lineas_fuente(fuente, inicio, bloque->num_lineas) == bloque->hash_lineas) {
+        repetir_bloque(arbol, bloque, num_linea, fuente, inicio);
+        c->reutilizados++;
+        return;
+    }
+
+    Nodo* ultimo_hijo = arbol->ultimo_hijo;
+    int linea_inicial = *num_linea;
+    int errores_iniciales = diagnosticos.num_errores;
+    liberar_operaciones(c->diario, c->num_diario);
+    c->num_diario = 0;
+    c->base_linea = *num_linea;
+    if (!abrir_captura(&c->captura)) {
+        return;
+    }
+    c->salida_anterior = salida;
+    salida = c->captura.archivo;
+    c->grabando = true;
+
+    if (vista_empieza_con(vista, PALABRA_VAR)) {
+        analizar_inicializacion_variables(arbol, linea, num_linea, fuente, ultima_linea);
+    } else if (vista_empieza_con(vista, PALABRA_FUNCTION)) {
+        analizar_funcion(arbol, linea, num_linea, fuente, nombre_funcion);
+    } else {
+        analizar_procedure(arbol, linea, num_linea, fuente, nombre_procedure, tam_nombre_procedure);
+    }
+
+    terminar_grabacion();
+    c->analizados++;
+    guardar_bloque(reservar_bloque_guardado(clave), arbol, ultimo_hijo, fuente, inicio,
+                   *num_linea - linea_inicial, diagnosticos.num_errores - errores_iniciales);
+}
+
+// Analiza una fuente ya cargada y la libera; ruta solo nombra el archivo en la salida
+int analizar_fuente(const char* ruta, Fuente* fuente) {
+    inicializar_tabla_simbolos();
+    fuente_arbol = fuente;
+#ifndef _WIN32
+    if (cuerpos_en_paralelo) {
+        cambiar_fase(FASE_PREESCANEO);
+        trabajo_cuerpos = preparar_cuerpos_en_paralelo(fuente);
+        if (trabajo_cuerpos) {
+            iniciar_cuerpos_en_paralelo(trabajo_cuerpos, hilos_cuerpos);
+        }
+    }
+#endif
+
+    Nodo* arbol = crear_nodo(NODO_PROGRAMA, "");
+    char* linea = nuevo_buffer_linea(fuente);
+    char* palabra_temp = nuevo_buffer_linea(fuente);
+    char* ultima_linea = nuevo_buffer_linea(fuente);
+    char nombre_funcion[50];
+    char nombre_procedure[50];  
+    int num_linea = 0;
+    VistaTokens vista;
+
+    double inicio_analisis = reloj_segundos();
+    cambiar_fase(FASE_PRINCIPAL);
+    int marca_reservas = reservas_en_uso.num_reservas;
+    jmp_buf salto;
+    if (setjmp(salto) != 0) {
+        salida_analisis = NULL;
+        liberar_reservas(marca_reservas);
+        terminar_grabacion();
+        free(cache_bloques.captura.datos);
+        cache_bloques.captura.datos = NULL;
+        cache_bloques.dentro_de_operacion = 0;
+#ifndef _WIN32
+        terminar_cuerpos_en_paralelo();
+#endif
+        tiempos_fases.analisis = reloj_segundos() - inicio_analisis;
+        double inicio_salida = reloj_segundos();
+        cambiar_fase(FASE_DIAGNOSTICOS);
+        volcar_diagnosticos(ruta, fuente);
+        terminar_fase();
+        tiempos_fases.salida = reloj_segundos() - inicio_salida;
+        liberar_referencias_pendientes();
+        liberar_tabla_simbolos();
+        free(linea);
+        free(palabra_temp);
+        free(ultima_linea);
+        fuente_arbol = NULL;
+        liberar_fuente(fuente);
+        liberar_arbol();
+        vaciar_traza();
+        return 1;
+    }
+    salida_analisis = &salto;
+ 
+    while (leer_linea(fuente, linea, fuente->tam_linea, &vista)) {
+        trim(linea);
+        if (*linea == '\0') {
+            num_linea++;
+            continue;
+        };  
+        for (int i = 0; linea[i]; i++) linea[i] = tolower(linea[i]);
+
+        strcpy(palabra_temp, linea);
+        trim_semicolon(palabra_temp);
+        if (es_palabra_clave_similar(palabra_temp, num_linea)) {
+            continue;
+        }
+
+        // El reloj solo se lee cuando cambia la fase
+        if (vista_empieza_con(vista, PALABRA_VAR)) {
+            cambiar_fase(FASE_VARIABLES);
+        } else if (vista_empieza_con(vista, PALABRA_FUNCTION) || vista_empieza_con(vista, PALABRA_PROCEDURE)) {
+            cambiar_fase(FASE_CUERPOS);
+        } else {
+            cambiar_fase(FASE_PRINCIPAL);
+        }
+        if(vista_empieza_con(vista, PALABRA_VAR) || vista_empieza_con(vista, PALABRA_FUNCTION) ||
+           vista_empieza_con(vista, PALABRA_PROCEDURE)) {
+            analizar_bloque(arbol, linea, vista, &num_linea, fuente, ultima_linea, nombre_funcion, nombre_procedure,
+                            sizeof(nombre_procedure));
+        }
+        else if(vista_empieza_con(vista, PALABRA_IF)){
+            analizar_if(arbol, linea, vista, &num_linea, fuente);
+        }
+        else if(vista_empieza_con(vista, PALABRA_BEGIN)){
+            analizar_palabra_clave(arbol, linea, &num_linea, false, fuente);
+        }
+        else if(vista_empieza_con(vista, PALABRA_WHILE)){
+            analizar_while(arbol, linea, vista, &num_linea, fuente);
+        }
+        else if(vista_empieza_con(vista, PALABRA_FOR)){
+            analizar_for(arbol, linea, vista, &num_linea, fuente);
+        }
+        else if(vista_empieza_con_identificador(vista, "writeln")){
+            analizar_writeln(arbol, linea, num_linea);
+        }
+        num_linea++;
+    }
+
+    reportar_referencias_pendientes();
+    salida_analisis = NULL;
+#ifndef _WIN32
+    terminar_cuerpos_en_paralelo();
+#endif
+    tiempos_fases.analisis = reloj_segundos() - inicio_analisis;
+
+    double inicio_salida = reloj_segundos();
+    cambiar_fase(FASE_DIAGNOSTICOS);
+    fuente_arbol = NULL;
+    // El arbol binario sigue la misma regla que el impreso: solo si no hubo errores
+    bool arbol_escrito = true;
+    if (ruta_arbol_binario && diagnosticos.num_errores == 0) {
+        char destino[4096];
+        ruta_salida_arbol(destino, sizeof(destino), ruta);
+        arbol_escrito = escribir_arbol_binario(arbol, destino);
+        if (!arbol_escrito && formato_diagnosticos == FORMATO_TEXTO) {
+            fprintf(salida_errores, "Error al escribir el arbol binario %s: %s\n", destino, strerror(errno));
+        } else if (!arbol_escrito) {
+            agregar_diagnostico(SEVERIDAD_ERROR, 0, "Error al escribir el arbol binario", strerror(errno), NULL);
+        }
+    }
+    int num_errores = arbol_escrito ? diagnosticos.num_errores : diagnosticos.num_errores + 1;
+    volcar_diagnosticos(ruta, fuente);
+
+    free(linea);
+    free(palabra_temp);
+    free(ultima_linea);
+    liberar_fuente(fuente);
+    liberar_tabla_simbolos();
+    // Con errores el arbol queda incompleto, asi que solo se imprime si no hubo ninguno
+    if (num_errores == 0 && !omitir_arbol) {
+        cambiar_fase(FASE_ARBOL);
+        imprimir_arbol(arbol);
+    }
+    terminar_fase();
+    liberar_arbol();
+    vaciar_traza();
+    tiempos_fases.salida = reloj_segundos() - inicio_salida;
+
+    return num_errores > 0 ? 1 : 0; 
+}
+
+int analizar_archivo(const char* ruta) {
+    Fuente fuente;
+    memset(&tiempos_fases, 0, sizeof(tiempos_fases));
+    double inicio_carga = reloj_segundos();
+    if (!cargar_fuente(&fuente, ruta)) {
+        if (formato_diagnosticos == FORMATO_TEXTO) {
+            fprintf(salida_errores, "Error al abrir el archivo: %s\n", strerror(errno));
+        } else {
+            agregar_diagnostico(SEVERIDAD_ERROR, 0, "Error al abrir el archivo", strerror(errno), NULL);
+            volcar_diagnosticos(ruta, NULL);
+        }
+        return 1; 
+    }
+    tiempos_fases.carga = reloj_segundos() - inicio_carga;
+    metricas_hilo.tiempos[FASE_CARGA] += tiempos_fases.carga;
+    return analizar_fuente(ruta, &fuente);
+}
+
+// Cache de resultados en disco: cada entrada guarda la salida y los errores de un archivo,
+// bajo el hash de su contenido, la version del analizador, el limite de errores y los formatos.
+// Formato: "PSC1", clave, resultado, tam_salida, tam_errores y los dos textos
+#define MAGIA_CACHE "PSC1"
+
+typedef struct {
+    char magia[4];
+    int resultado;
+    unsigned long long clave;
+    unsigned long long tam_salida;
+    unsigned long long tam_errores;
+} CabeceraCache;
+
+bool clave_archivo(const char* ruta, unsigned long long* clave) {
+    FILE* archivo = fopen(ruta, "rb");
+    if (!archivo) {
+        return false;
+    }
+    unsigned long long hash = hash64_texto(14695981039346656037ull, VERSION_ANALIZADOR);
+    hash = hash64(hash, &max_errores, sizeof(max_errores));
+    hash = hash64(hash, &formato_diagnosticos, sizeof(formato_diagnosticos));
+    hash = hash64(hash, &formato_arbol, sizeof(formato_arbol));
+    // Los registros estructurados llevan la ruta; en texto la agrega el lote al imprimir
+    if (formato_diagnosticos != FORMATO_TEXTO) {
+        hash = hash64_texto(hash, ruta);
+    }
+    char bloque[64 * 1024];
+    size_t leido;
+    while ((leido = fread(bloque, 1, sizeof(bloque), archivo)) > 0) {
+        hash = hash64(hash, bloque, leido);
+    }
+    fclose(archivo);
+    // La clave 0 queda libre para marcar entradas invalidas
+    *clave = hash ? hash : 1;
+    return true;
+}
+
+void ruta_entrada_cache(char* destino, size_t tam, unsigned long long clave) {
+    snprintf(destino, tam, "%s/%016llx", directorio_cache, clave);
+}
+
+// Si hay entrada la escribe en la salida actual; al usarla se toca su fecha para el desalojo
+bool leer_entrada_cache(unsigned long long clave, int* resultado) {
+    char ruta[4096];
+    ruta_entrada_cache(ruta, sizeof(ruta), clave);
+    FILE* archivo = fopen(ruta, "rb");
+    if (!archivo) {
+        return false;
+    }
+    CabeceraCache cabecera;
+    struct stat info;
+    bool valida = fread(&cabecera, sizeof(cabecera), 1, archivo) == 1 &&
+                  memcmp(cabecera.magia, MAGIA_CACHE, 4) == 0 && cabecera.clave == clave &&
+                  fstat(fileno(archivo), &info) == 0 &&
+                  (unsigned long long)info.st_size == sizeof(cabecera) + cabecera.tam_salida + cabecera.tam_errores;
+    char* datos = NULL;
+    if (valida) {
+        size_t tam = (size_t)(cabecera.tam_salida + cabecera.tam_errores);
+        datos = (char*)malloc(tam ? tam : 1);
+        valida = fread(datos, 1, tam, archivo) == tam;
+    }
+    fclose(archivo);
+    if (!valida) {
+        free(datos);
+        return false;
+    }
+    fwrite(datos, 1, cabecera.tam_salida, salida);
+    fwrite(datos + cabecera.tam_salida, 1, cabecera.tam_errores, salida_errores);
+    free(datos);
+    utime(ruta, NULL);
+    *resultado = cabecera.resultado;
+    return true;
+}
+
+// Escribe en un temporal propio y lo renombra, asi otros procesos o hilos nunca ven una
+// entrada a medias. La direccion de una variable local al hilo distingue a los hilos del lote
+void escribir_entrada_cache(unsigned long long clave, int resultado, const Captura* salida_archivo, const Captura* errores) {
+    char ruta[4096];
+    char temporal[4096 + 64];
+    ruta_entrada_cache(ruta, sizeof(ruta), clave);
+#ifndef _WIN32
+    long proceso = (long)getpid();
+#else
+    long proceso = (long)GetCurrentProcessId();
+#endif
+    snprintf(temporal, sizeof(temporal), "%s.%ld.%p.tmp", ruta, proceso, (void*)&tiempos_fases);
+    FILE* archivo = fopen(temporal, "wb");
+    if (!archivo) {
+        return;
+    }
+    CabeceraCache cabecera;
+    memset(&cabecera, 0, sizeof(cabecera));
+    memcpy(cabecera.magia, MAGIA_CACHE, 4);
+    cabecera.resultado = resultado;
+    cabecera.clave = clave;
+    cabecera.tam_salida = salida_archivo->tam;
+    cabecera.tam_errores = errores->tam;
+    bool escrito = fwrite(&cabecera, sizeof(cabecera), 1, archivo) == 1 &&
+                   fwrite(salida_archivo->datos, 1, salida_archivo->tam, archivo) == salida_archivo->tam &&
+                   fwrite(errores->datos, 1, errores->tam, archivo) == errores->tam;
+    escrito = fclose(archivo) == 0 && escrito;
+#ifndef _WIN32
+    escrito = escrito && rename(temporal, ruta) == 0;
+#else
+    escrito = escrito && MoveFileExA(temporal, ruta, MOVEFILE_REPLACE_EXISTING);
+#endif
+    if (!escrito) {
+        remove(temporal);
+    }
+}
+
+// Con la cache activa, un archivo ya analizado con la misma version no se vuelve a leer ni analizar
+int analizar_archivo_con_cache(const char* ruta) {
+    unsigned long long clave;
+    // La entrada estandar solo se puede leer una vez y la cache no guarda el arbol binario
+    if (directorio_cache == NULL || strcmp(ruta, "-") == 0 || ruta_arbol_binario || !clave_archivo(ruta, &clave)) {
+        return analizar_archivo(ruta);
+    }
+    int resultado;
+    if (leer_entrada_cache(clave, &resultado)) {
+        return resultado;
+    }
+    Captura salida_archivo;
+    Captura errores;
+    if (!abrir_captura(&salida_archivo)) {
+        return analizar_archivo(ruta);
+    }
+    if (!abrir_captura(&errores)) {
+        cerrar_captura(&salida_archivo);
+        free(salida_archivo.datos);
+        return analizar_archivo(ruta);
+    }
+    FILE* salida_anterior = salida;
+    FILE* errores_anterior = salida_errores;
+    salida = salida_archivo.archivo;
+    salida_errores = errores.archivo;
+    resultado = analizar_archivo(ruta);
+    salida = salida_anterior;
+    salida_errores = errores_anterior;
+    cerrar_captura(&salida_archivo);
+    cerrar_captura(&errores);
+    fwrite(salida_archivo.datos, 1, salida_archivo.tam, salida);
+    fwrite(errores.datos, 1, errores.tam, salida_errores);
+    escribir_entrada_cache(clave, resultado, &salida_archivo, &errores);
+    free(salida_archivo.datos);
+    free(errores.datos);
+    return resultado;
+}
+
+typedef struct {
+    char* ruta;
+    long long tam;
+    time_t usado;
+} EntradaCache;
+
+int comparar_entradas_cache(const void* a, const void* b) {
+    const EntradaCache* x = (const EntradaCache*)a;
+    const EntradaCache* y = (const EntradaCache*)b;
+    return (x->usado > y->usado) - (x->usado < y->usado);
+}
+
+// Borra las entradas usadas hace mas tiempo hasta que la cache quepa en tam_maximo_cache;
+// los temporales de mas de una hora son de escrituras que no terminaron
+void recortar_cache() {
+    DIR* dir = opendir(directorio_cache);
+    if (!dir) {
+        return;
+    }
+    EntradaCache* entradas = NULL;
+    int num_entradas = 0;
+    int capacidad = 0;
+    long long total = 0;
+    time_t ahora = time(NULL);
+    struct dirent* entrada;
+    while ((entrada = readdir(dir)) != NULL) {
+        if (entrada->d_name[0] == '.') {
+            continue;
+        }
+        size_t tam_ruta = strlen(directorio_cache) + strlen(entrada->d_name) + 2;
+        char* ruta = (char*)malloc(tam_ruta);
+        snprintf(ruta, tam_ruta, "%s/%s", directorio_cache, entrada->d_name);
+        struct stat info;
+        if (stat(ruta, &info) != 0 || !S_ISREG(info.st_mode)) {
+            free(ruta);
+            continue;
+        }
+        if (ends_with(entrada->d_name, ".tmp")) {
+            if (ahora - info.st_mtime > 3600) {
+                remove(ruta);
+            }
+            free(ruta);
+            continue;
+        }
+        if (num_entradas == capacidad) {
+            capacidad = capacidad ? capacidad * 2 : 64;
+            entradas = (EntradaCache*)realloc(entradas, capacidad * sizeof(EntradaCache));
+        }
+        entradas[num_entradas].ruta = ruta;
+        entradas[num_entradas].tam = (long long)info.st_size;
+        entradas[num_entradas].usado = info.st_mtime;
+        num_entradas++;
+        total += info.st_size;
+    }
+    closedir(dir);
+
+    qsort(entradas, num_entradas, sizeof(EntradaCache), comparar_entradas_cache);
+    for (int i = 0; i < num_entradas; i++) {
+        if (total > tam_maximo_cache && remove(entradas[i].ruta) == 0) {
+            total -= entradas[i].tam;
+        }
+        free(entradas[i].ruta);
+    }
+    free(entradas);
+}
+
+typedef struct {
+    char** rutas;
+    int num_rutas;
+    int capacidad;
+} ListaArchivos;
+
+void agregar_archivo(ListaArchivos* lista, const char* ruta) {
+    if (lista->num_rutas == lista->capacidad) {
+        lista->capacidad = lista->capacidad ? lista->capacidad * 2 : 16;
+        lista->rutas = (char**)realloc(lista->rutas, lista->capacidad * sizeof(char*));
+    }
+    lista->rutas[lista->num_rutas++] = strdup(ruta);
+}
+
+void liberar_lista_archivos(ListaArchivos* lista) {
+    for (int i = 0; i < lista->num_rutas; i++) {
+        free(lista->rutas[i]);
+    }
+    free(lista->rutas);
+    lista->rutas = NULL;
+    lista->num_rutas = 0;
+    lista->capacidad = 0;
+}
+
+bool es_directorio(const char* ruta) {
+    struct stat info;
+    return stat(ruta, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+int comparar_nombres(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Recorre el directorio en orden alfabetico para que el lote sea reproducible
+void agregar_directorio(ListaArchivos* lista, const char* ruta) {
+    DIR* dir = opendir(ruta);
+    if (!dir) {
+        agregar_archivo(lista, ruta);
+        return;
+    }
+    ListaArchivos nombres = {0};
+    struct dirent* entrada;
+    while ((entrada = readdir(dir)) != NULL) {
+        if (entrada->d_name[0] != '.') {
+            agregar_archivo(&nombres, entrada->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(nombres.rutas, nombres.num_rutas, sizeof(char*), comparar_nombres);
+
+    for (int i = 0; i < nombres.num_rutas; i++) {
+        size_t tam = strlen(ruta) + strlen(nombres.rutas[i]) + 2;
+        char* completa = (char*)malloc(tam);
+        snprintf(completa, tam, "%s/%s", ruta, nombres.rutas[i]);
+        if (es_directorio(completa)) {
+            agregar_directorio(lista, completa);
+        } else {
+            agregar_archivo(lista, completa);
+        }
+        free(completa);
+    }
+    liberar_lista_archivos(&nombres);
+}
+
+// Una ruta por linea; las lineas vacias se ignoran
+bool leer_lista_archivos(ListaArchivos* lista, const char* ruta_lista) {
+    FILE* archivo = strcmp(ruta_lista, "-") == 0 ? stdin : fopen(ruta_lista, "r");
+    if (!archivo) {
+        return false;
+    }
+    char ruta[4096];
+    while (fgets(ruta, sizeof(ruta), archivo)) {
+        trim(ruta);
+        if (ruta[0] != '\0') {
+            agregar_archivo(lista, ruta);
+        }
+    }
+    if (archivo != stdin) {
+        fclose(archivo);
+    }
+    return true;
+}
+
+typedef struct {
+    Captura salida;
+    Captura errores;
+    int resultado;
+    bool listo;
+} ResultadoArchivo;
+
+typedef struct {
+    ListaArchivos* archivos;
+    ResultadoArchivo* resultados;
+    int siguiente;
+#ifndef _WIN32
+    pthread_mutex_t mutex;
+    pthread_cond_t terminado;
+#endif
+} Lote;
+
+void analizar_en_lote(Lote* lote, int i) {
+    ResultadoArchivo* resultado = &lote->resultados[i];
+    if (!abrir_captura(&resultado->salida) || !abrir_captura(&resultado->errores)) {
+        fprintf(stderr, "Error: no se pudo reservar la salida de %s\n", lote->archivos->rutas[i]);
+        exit(1);
+    }
+    salida = resultado->salida.archivo;
+    salida_errores = resultado->errores.archivo;
+    resultado->resultado = analizar_archivo_con_cache(lote->archivos->rutas[i]);
+    cerrar_captura(&resultado->salida);
+    cerrar_captura(&resultado->errores);
+}
+
+#ifndef _WIN32
+void* trabajador_lote(void* arg) {
+    Lote* lote = (Lote*)arg;
+    while (true) {
+        pthread_mutex_lock(&lote->mutex);
+        int i = lote->siguiente++;
+        pthread_mutex_unlock(&lote->mutex);
+        if (i >= lote->archivos->num_rutas) {
+            break;
+        }
+        analizar_en_lote(lote, i);
+        pthread_mutex_lock(&lote->mutex);
+        lote->resultados[i].listo = true;
+        pthread_cond_broadcast(&lote->terminado);
+        pthread_mutex_unlock(&lote->mutex);
+    }
+    liberar_traza();
+    liberar_buffer_lectura();
+    liberar_reservas(0);
+    acumular_metricas();
+    return NULL;
+}
+#endif
+
+// Los errores se prefijan con la ruta para saber de que archivo vienen; los registros
+// estructurados ya la llevan y en SARIF solo hace falta la coma entre archivos
+void escribir_resultado(const char* ruta, ResultadoArchivo* resultado, bool* hay_resultados_sarif) {
+    fprintf(stdout, "==> %s <==\n", ruta);
+    fwrite(resultado->salida.datos, 1, resultado->salida.tam, stdout);
+    if (formato_diagnosticos != FORMATO_TEXTO) {
+        if (formato_diagnosticos == FORMATO_SARIF && resultado->errores.tam > 0) {
+            if (*hay_resultados_sarif) {
+                fputs(",\n", stderr);
+            }
+            *hay_resultados_sarif = true;
+        }
+        fwrite(resultado->errores.datos, 1, resultado->errores.tam, stderr);
+        fflush(stderr);
+        free(resultado->salida.datos);
+        free(resultado->errores.datos);
+        return;
+    }
+    const char* inicio = resultado->errores.datos;
+    const char* fin = inicio + resultado->errores.tam;
+    while (inicio < fin) {
+        const char* salto = memchr(inicio, '\n', fin - inicio);
+        const char* corte = salto ? salto + 1 : fin;
+        fprintf(stderr, "%s: ", ruta);
+        fwrite(inicio, 1, corte - inicio, stderr);
+        inicio = corte;
+    }
+    free(resultado->salida.datos);
+    free(resultado->errores.datos);
+}
+
+// Analiza los archivos en num_hilos hilos e imprime los resultados en el orden de la lista
+int analizar_lote(ListaArchivos* archivos, int num_hilos) {
+    Lote lote;
+    lote.archivos = archivos;
+    lote.resultados = (ResultadoArchivo*)calloc(archivos->num_rutas ? archivos->num_rutas : 1, sizeof(ResultadoArchivo));
+    lote.siguiente = 0;
+    int con_errores = 0;
+    bool hay_resultados_sarif = false;
+
+#ifndef _WIN32
+    if (num_hilos <= 0) {
+        num_hilos = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_hilos > archivos->num_rutas) {
+        num_hilos = archivos->num_rutas;
+    }
+    if (num_hilos < 1) {
+        num_hilos = 1;
+    }
+    pthread_mutex_init(&lote.mutex, NULL);
+    pthread_cond_init(&lote.terminado, NULL);
+    pthread_t* hilos = (pthread_t*)malloc(num_hilos * sizeof(pthread_t));
+    for (int i = 0; i < num_hilos; i++) {
+        pthread_create(&hilos[i], NULL, trabajador_lote, &lote);
+    }
+    for (int i = 0; i < archivos->num_rutas; i++) {
+        pthread_mutex_lock(&lote.mutex);
+        while (!lote.resultados[i].listo) {
+            pthread_cond_wait(&lote.terminado, &lote.mutex);
+        }
+        pthread_mutex_unlock(&lote.mutex);
+        escribir_resultado(archivos->rutas[i], &lote.resultados[i], &hay_resultados_sarif);
+        con_errores += lote.resultados[i].resultado != 0;
+    }
+    for (int i = 0; i < num_hilos; i++) {
+        pthread_join(hilos[i], NULL);
+    }
+    free(hilos);
+    pthread_cond_destroy(&lote.terminado);
+    pthread_mutex_destroy(&lote.mutex);
+#else
+    for (int i = 0; i < archivos->num_rutas; i++) {
+        analizar_en_lote(&lote, i);
+        escribir_resultado(archivos->rutas[i], &lote.resultados[i], &hay_resultados_sarif);
+        con_errores += lote.resultados[i].resultado != 0;
+    }
+#endif
+
+    salida = stdout;
+    salida_errores = stderr;
+    if (formato_diagnosticos == FORMATO_TEXTO) {
+        fprintf(stderr, "Archivos analizados: %d, con errores: %d\n", archivos->num_rutas, con_errores);
+    }
+    free(lote.resultados);
+    return con_errores > 0 ? 1 : 0;
+}
+
+// Cantidad fija de simbolos, asi el costo por linea se compara entre tamaños;
+// cada funcion agrega ademas sus dos parametros como variables
+#define BENCH_ENTEROS 20
+#define BENCH_CADENAS 10
+#define BENCH_REALES 10
+#define BENCH_FUNCIONES 20
+
+// Bloque de sentencias de 14 lineas que usa las estructuras que acepta el analizador
+void generar_bloque(FILE* destino, long k) {
+    int v = (int)(k % BENCH_ENTEROS);
+    int w = (int)((k + 7) % BENCH_ENTEROS);
+    fprintf(destino, "  v%d := v%d + %ld;\n", v, w, k % 97);
+    fprintf(destino, "  s%ld := 'texto %ld';\n", k % BENCH_CADENAS, k);
+    fprintf(destino, "  r%ld := r%ld * 2.5;\n", k % BENCH_REALES, (k + 3) % BENCH_REALES);
+    fprintf(destino, "  v%d := F%ld(v%d, %ld);\n", w, k % BENCH_FUNCIONES, v, k % 13);
+    fprintf(destino, "  writeln('bloque %ld');\n", k);
+    fprintf(destino, "  while v%d > 100 do\n", v);
+    fprintf(destino, "    v%d := v%d - 1;\n", v, v);
+    fprintf(destino, "  if v%d > 10 then\n", w);
+    fprintf(destino, "    writeln(v%d);\n", w);
+    fprintf(destino, "  for i := 1 to 10 do\n");
+    fprintf(destino, "    v%d := v%d + i;\n", w, w);
+    fprintf(destino, "  v%d := v%d * 2;\n", v, w);
+    fprintf(destino, "  s%ld := s%ld + 'x';\n", (k + 1) % BENCH_CADENAS, k % BENCH_CADENAS);
+    fprintf(destino, "  writeln(v%d);\n", v);
+}
+
+// Escribe un programa de aproximadamente num_lineas lineas: declaraciones, funciones,
+// procedimientos con bloques de sentencias y el programa principal. Devuelve las lineas escritas.
+long generar_programa(FILE* destino, long num_lineas) {
+    long lineas = 0;
+    fprintf(destino, "program Sintetico;\n\nvar\n");
+    lineas += 3;
+    for (int i = 0; i < BENCH_ENTEROS; i += 5) {
+        fprintf(destino, "  v%d, v%d, v%d, v%d, v%d: integer;\n", i, i + 1, i + 2, i + 3, i + 4);
+        lineas++;
+    }
+    for (int i = 0; i < BENCH_CADENAS; i += 5) {
+        fprintf(destino, "  s%d, s%d, s%d, s%d, s%d: string;\n", i, i + 1, i + 2, i + 3, i + 4);
+        lineas++;
+    }
+    for (int i = 0; i < BENCH_REALES; i += 5) {
+        fprintf(destino, "  r%d, r%d, r%d, r%d, r%d: real;\n", i, i + 1, i + 2, i + 3, i + 4);
+        lineas++;
+    }
+    fprintf(destino, "  i: integer;\n\n");
+    lineas += 2;
+
+    // Se inicializa todo primero para no llenar el reporte de advertencias
+    fprintf(destino, "procedure Inicializar;\nbegin\n");
+    lineas += 2;
+    for (int i = 0; i < BENCH_ENTEROS; i++) {
+        fprintf(destino, "  v%d := %d;\n", i, i);
+    }
+    for (int i = 0; i < BENCH_CADENAS; i++) {
+        fprintf(destino, "  s%d := 'cadena';\n", i);
+    }
+    for (int i = 0; i < BENCH_REALES; i++) {
+        fprintf(destino, "  r%d := 1.5;\n", i);
+    }
+    fprintf(destino, "end;\n\n");
+    lineas += BENCH_ENTEROS + BENCH_CADENAS + BENCH_REALES + 2;
+
+    for (int f = 0; f < BENCH_FUNCIONES; f++) {
+        fprintf(destino, "function F%d(a%d, b%d: integer): integer;\nbegin\n  F%d := a%d + b%d * %d;\nend;\n\n",
+                f, f, f, f, f, f, f + 2);
+        lineas += 6;
+    }
+
+    // La mitad del tamano en procedimientos de 8 bloques y el resto en el programa principal
+    long k = 0;
+    long num_procedimiento = 0;
+    while (lineas + 8 * 14 + 4 < num_lineas / 2) {
+        fprintf(destino, "procedure P%ld;\nbegin\n", num_procedimiento++);
+        for (int b = 0; b < 8; b++) {
+            generar_bloque(destino, k++);
+        }
+        fprintf(destino, "end;\n\n");
+        lineas += 8 * 14 + 4;
+    }
+
+    fprintf(destino, "begin\n");
+    lineas++;
+    do {
+        generar_bloque(destino, k++);
+        lineas += 14;
+    } while (lineas + 14 < num_lineas);
+    fprintf(destino, "end.\n");
+    return lineas + 1;
+}
+
+long memoria_pico_kb() {
+#ifndef _WIN32
+    struct rusage uso;
+    getrusage(RUSAGE_SELF, &uso);
+    return uso.ru_maxrss;
+#else
+    return 0;
+#endif
+}
+
+// Genera un programa por tamano, lo analiza descartando la salida y reporta
+// lineas por segundo, tiempo por fase y memoria pico del proceso
+int ejecutar_bench(const long* tamanos, int num_tamanos) {
+#ifndef _WIN32
+    FILE* descarte = fopen("/dev/null", "w");
+#else
+    FILE* descarte = fopen("NUL", "w");
+#endif
+    if (!descarte) {
+        perror("Error al abrir el destino de la salida");
+        return 1;
+    }
+    fprintf(stdout, "%10s %12s %10s %11s %10s %10s %12s %12s %8s\n",
+            "lineas", "bytes", "carga(s)", "analisis(s)", "salida(s)", "total(s)", "lineas/s", "RSS pico(KB)", "errores");
+    int resultado = 0;
+    for (int i = 0; i < num_tamanos; i++) {
+        char ruta[64];
+#ifndef _WIN32
+        snprintf(ruta, sizeof(ruta), "/tmp/bench_pascal_XXXXXX");
+        int fd = mkstemp(ruta);
+        FILE* archivo = fd >= 0 ? fdopen(fd, "w") : NULL;
+#else
+        snprintf(ruta, sizeof(ruta), "bench_pascal_%d.txt", i);
+        FILE* archivo = fopen(ruta, "w");
+#endif
+        if (!archivo) {
+            perror("Error al crear el programa de prueba");
+            resultado = 1;
+            break;
+        }
+        long lineas = generar_programa(archivo, tamanos[i]);
+        long bytes = ftell(archivo);
+        fclose(archivo);
+
+        salida = descarte;
+        salida_errores = descarte;
+        int errores = analizar_archivo(ruta);
+        salida = stdout;
+        salida_errores = stderr;
+        remove(ruta);
+
+        double total = tiempos_fases.carga + tiempos_fases.analisis + tiempos_fases.salida;
+        fprintf(stdout, "%10ld %12ld %10.4f %11.4f %10.4f %10.4f %12.0f %12ld %8s\n",
+                lineas, bytes, tiempos_fases.carga, tiempos_fases.analisis, tiempos_fases.salida,
+                total, total > 0 ? lineas / total : 0.0, memoria_pico_kb(), errores ? "si" : "no");
+        fflush(stdout);
+    }
+    fclose(descarte);
+    return resultado;
+}
+
+// Vuelve a analizar el archivo cada vez que cambia, hasta que deja de existir; los bloques
+// que no cambiaron se repiten desde la cache
+int vigilar_archivo(const char* ruta) {
+    cache_bloques_activo = true;
+    struct stat info;
+    time_t modificado = 0;
+    long long tam = -1;
+    int resultado = 1;
+    while (stat(ruta, &info) == 0) {
+        if (info.st_mtime != modificado || (long long)info.st_size != tam) {
+            modificado = info.st_mtime;
+            tam = info.st_size;
+            int reutilizados = cache_bloques.reutilizados;
+            int analizados = cache_bloques.analizados;
+            double inicio = reloj_segundos();
+            // En SARIF cada analisis es un documento completo
+            if (formato_diagnosticos == FORMATO_SARIF) {
+                abrir_documento_sarif(salida_errores);
+            }
+            resultado = analizar_archivo(ruta);
+            fflush(salida);
+            if (formato_diagnosticos == FORMATO_SARIF) {
+                cerrar_documento_sarif(salida_errores);
+            } else if (formato_diagnosticos == FORMATO_TEXTO) {
+                fprintf(salida_errores, "==> %s: %.3f s, bloques reutilizados: %d, analizados: %d <==\n", ruta,
+                        reloj_segundos() - inicio, cache_bloques.reutilizados - reutilizados,
+                        cache_bloques.analizados - analizados);
+            }
+            fflush(salida_errores);
+        }
+#ifndef _WIN32
+        usleep(200000);
+#else
+        Sleep(200);
+#endif
+    }
+    vaciar_cache_bloques();
+    return resultado;
+}
+
+// Modo servidor: lee solicitudes de una linea y responde a cada una con sus diagnosticos en
+// JSON Lines y una linea final con "fin". La cache de bloques, la tabla de palabras clave y los
+// buffers del hilo quedan de una solicitud a la siguiente.
+//   analizar RUTA          analiza el archivo
+//   buffer NOMBRE BYTES    analiza los BYTES que siguen a la linea, a nombre de NOMBRE
+//   salir                  termina el servidor
+// Devuelve true si se pidio salir; false si el flujo termino o quedo a medias
+bool atender_solicitudes(FILE* entrada, FILE* respuesta) {
+    char solicitud[4096 + 64];
+    while (fgets(solicitud, sizeof(solicitud), entrada)) {
+        size_t largo = strcspn(solicitud, "\r\n");
+        bool completa = solicitud[largo] != '\0';
+        solicitud[largo] = '\0';
+        if (!completa && !feof(entrada)) {
+            fprintf(respuesta, "{\"error\":\"Solicitud demasiado larga\"}\n");
+            fflush(respuesta);
+            return false;
+        }
+        if (largo == 0) {
+            continue;
+        }
+        if (strcmp(solicitud, "salir") == 0) {
+            return true;
+        }
+
+        double inicio = reloj_segundos();
+        const char* nombre = NULL;
+        int resultado;
+        FILE* errores_anterior = salida_errores;
+        salida_errores = respuesta;
+        if (strncmp(solicitud, "analizar ", 9) == 0 && strcmp(solicitud + 9, "-") != 0) {
+            nombre = solicitud + 9;
+            resultado = analizar_archivo(nombre);
+        } else if (strncmp(solicitud, "buffer ", 7) == 0 && strrchr(solicitud, ' ') > solicitud + 7) {
+            // El nombre puede tener espacios: el tamano es la ultima palabra
+            char* espacio = strrchr(solicitud, ' ');
+            *espacio = '\0';
+            nombre = solicitud + 7;
+            char* fin;
+            unsigned long long tam = strtoull(espacio + 1, &fin, 10);
+            Fuente fuente;
+            memset(&fuente, 0, sizeof(fuente));
+            if (*fin != '\0' || !leer_flujo(&fuente, entrada, (size_t)tam) || fuente.longitud != tam) {
+                salida_errores = errores_anterior;
+                fprintf(respuesta, "{\"error\":\"Buffer incompleto\"}\n");
+                fflush(respuesta);
+                return false;
+            }
+            memset(&tiempos_fases, 0, sizeof(tiempos_fases));
+            indexar_fuente(&fuente);
+            resultado = analizar_fuente(nombre, &fuente);
+        }
+        salida_errores = errores_anterior;
+
+        Escritor escritor = {0};
+        if (nombre == NULL) {
+            escribir_texto(&escritor, "{\"error\":\"Solicitud desconocida\",\"detalle\":");
+            escribir_json(&escritor, solicitud);
+            escribir_texto(&escritor, "}\n");
+        } else {
+            escribir_texto(&escritor, "{\"fin\":true,\"archivo\":");
+            escribir_json(&escritor, nombre);
+            escribir(&escritor, ",\"resultado\":%d,\"tiempo_ms\":%.3f}\n", resultado, (reloj_segundos() - inicio) * 1000);
+        }
+        fwrite(escritor.datos, 1, escritor.tam, respuesta);
+        fflush(respuesta);
+        free(escritor.datos);
+    }
+    return false;
+}
+
+#ifndef _WIN32
+// Atiende las conexiones de una en una en un socket Unix
+int servir_socket(const char* ruta) {
+    struct sockaddr_un direccion;
+    memset(&direccion, 0, sizeof(direccion));
+    direccion.sun_family = AF_UNIX;
+    if (strlen(ruta) >= sizeof(direccion.sun_path)) {
+        fprintf(stderr, "Ruta de socket demasiado larga: %s\n", ruta);
+        return 1;
+    }
+    strcpy(direccion.sun_path, ruta);
+    int servidor = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(ruta);
+    if (servidor < 0 || bind(servidor, (struct sockaddr*)&direccion, sizeof(direccion)) != 0 ||
+        listen(servidor, 16) != 0) {
+        perror("Error al abrir el socket");
+        if (servidor >= 0) {
+            close(servidor);
+        }
+        return 1;
+    }
+    // Un cliente que se va a mitad de respuesta no debe terminar el servidor
+    signal(SIGPIPE, SIG_IGN);
+    bool seguir = true;
+    while (seguir) {
+        int conexion = accept(servidor, NULL, NULL);
+        if (conexion < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error al aceptar una conexion");
+            break;
+        }
+        FILE* entrada = fdopen(conexion, "r");
+        int copia = dup(conexion);
+        FILE* respuesta = copia >= 0 ? fdopen(copia, "w") : NULL;
+        // Al cerrarse la conexion se sigue; solo salir termina el servidor
+        if (entrada && respuesta) {
+            seguir = !atender_solicitudes(entrada, respuesta);
+        }
+        if (entrada) {
+            fclose(entrada);
+        } else {
+            close(conexion);
+        }
+        if (respuesta) {
+            fclose(respuesta);
+        } else if (copia >= 0) {
+            close(copia);
+        }
+    }
+    close(servidor);
+    unlink(ruta);
+    return 0;
+}
+#endif
+
+int servir(const char* ruta_socket) {
+    cache_bloques_activo = true;
+    int resultado = 0;
+    if (ruta_socket) {
+#ifndef _WIN32
+        resultado = servir_socket(ruta_socket);
+#else
+        fprintf(stderr, "Los sockets Unix no estan disponibles en esta plataforma\n");
+        resultado = 1;
+#endif
+    } else {
+        atender_solicitudes(stdin, stdout);
+    }
+    vaciar_cache_bloques();
+    return resultado;
+}
+
+// Sin argumentos se analiza codigo_pascal.txt como siempre y "-" lee el programa de la
+// entrada estandar. Con varios archivos, un directorio o una lista (-l archivo, o -l - para
+// stdin) se pasa al modo por lotes; -j N fija el numero de hilos (por defecto, uno por
+// procesador) y -e N el maximo de errores por archivo (por defecto 20; 0 no pone limite).
+// --paralelo revisa en -j N hilos los cuerpos de un solo archivo y --vigilar lo vuelve a
+// analizar cada vez que cambia. --cache DIR guarda los resultados en disco, recortados a
+// --cache-max MB. --formato texto|jsonl|sarif elige como se escriben los diagnosticos y
+// --traza lista activa las trazas de depuracion de esos subsistemas en la salida de errores.
+// --arbol texto|dot|sexp elige como se imprime el arbol y --arbol-binario RUTA lo guarda
+// ademas en formato binario (un directorio en el lote). --servidor atiende solicitudes por la
+// entrada estandar y --socket RUTA por un socket Unix. --metricas texto|json informa al
+// terminar el tiempo de cada fase y los contadores de actividad.
+// --generar N escribe un programa sintetico de N lineas y --bench [N...] mide el
+// analizador sobre programas de esos tamanos (por defecto de 1K a 1M lineas).
+int main(int argc, char** argv) {
+    salida = stdout;
+    salida_errores = stderr;
+    construir_arbol_palabras_clave();
+
+    ListaArchivos archivos = {0};
+    bool por_lotes = false;
+    bool vigilar = false;
+    bool servidor = false;
+    const char* ruta_socket = NULL;
+    bool paralelo = false;
+    int num_hilos = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            num_hilos = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            max_errores = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--vigilar") == 0) {
+            vigilar = true;
+        } else if (strcmp(argv[i], "--servidor") == 0) {
+            servidor = true;
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            servidor = true;
+            ruta_socket = argv[++i];
+        } else if (strcmp(argv[i], "--paralelo") == 0) {
+            paralelo = true;
+        } else if (strcmp(argv[i], "--formato") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "texto") == 0) {
+                formato_diagnosticos = FORMATO_TEXTO;
+            } else if (strcmp(argv[i], "jsonl") == 0) {
+                formato_diagnosticos = FORMATO_JSONL;
+            } else if (strcmp(argv[i], "sarif") == 0) {
+                formato_diagnosticos = FORMATO_SARIF;
+            } else {
+                fprintf(stderr, "Formato desconocido: %s (use texto, jsonl o sarif)\n", argv[i]);
+                liberar_lista_archivos(&archivos);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--traza") == 0 && i + 1 < argc) {
+            if (!configurar_traza(argv[++i])) {
+                fprintf(stderr, "Traza desconocida: %s (subsistemas: declaraciones, llamadas, asignaciones, control, writeln o todo)\n", argv[i]);
+                liberar_lista_archivos(&archivos);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--metricas") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "texto") == 0) {
+                formato_metricas = METRICAS_TEXTO;
+            } else if (strcmp(argv[i], "json") == 0) {
+                formato_metricas = METRICAS_JSON;
+            } else {
+                fprintf(stderr, "Formato de metricas desconocido: %s (use texto o json)\n", argv[i]);
+                liberar_lista_archivos(&archivos);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            directorio_cache = argv[++i];
+        } else if (strcmp(argv[i], "--arbol") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "texto") == 0) {
+                formato_arbol = ARBOL_TEXTO;
+            } else if (strcmp(argv[i], "dot") == 0) {
+                formato_arbol = ARBOL_DOT;
+            } else if (strcmp(argv[i], "sexp") == 0) {
+                formato_arbol = ARBOL_SEXP;
+            } else {
+                fprintf(stderr, "Formato de arbol desconocido: %s (use texto, dot o sexp)\n", argv[i]);
+                liberar_lista_archivos(&archivos);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--arbol-binario") == 0 && i + 1 < argc) {
+            ruta_arbol_binario = argv[++i];
+        } else if (strcmp(argv[i], "--cache-max") == 0 && i + 1 < argc) {
+            tam_maximo_cache = atoll(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "--generar") == 0 && i + 1 < argc) {
+            generar_programa(stdout, atol(argv[i + 1]));
+            liberar_lista_archivos(&archivos);
+            return 0;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            long tamanos[32];
+            int num_tamanos = 0;
+            while (i + 1 < argc && num_tamanos < 32 && isdigit((unsigned char)argv[i + 1][0])) {
+                tamanos[num_tamanos++] = atol(argv[++i]);
+            }
+            if (num_tamanos == 0) {
+                const long por_defecto[] = {1000, 10000, 100000, 1000000};
+                num_tamanos = 4;
+                memcpy(tamanos, por_defecto, sizeof(por_defecto));
+            }
+            liberar_lista_archivos(&archivos);
+            cuerpos_en_paralelo = paralelo;
+            hilos_cuerpos = num_hilos;
+            return ejecutar_bench(tamanos, num_tamanos);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            if (!leer_lista_archivos(&archivos, argv[++i])) {
+                perror("Error al abrir la lista de archivos");
+                liberar_lista_archivos(&archivos);
+                return 1;
+            }
+            por_lotes = true;
+        } else if (es_directorio(argv[i])) {
+            agregar_directorio(&archivos, argv[i]);
+            por_lotes = true;
+        } else {
+            agregar_archivo(&archivos, argv[i]);
+        }
+    }
+
+    if (directorio_cache) {
+#ifndef _WIN32
+        mkdir(directorio_cache, 0777);
+#else
+        CreateDirectoryA(directorio_cache, NULL);
+#endif
+    }
+    // En el lote la ruta del arbol binario es un directorio con un arbol por archivo
+    if (ruta_arbol_binario && (por_lotes || archivos.num_rutas > 1) && !vigilar) {
+        arbol_binario_por_archivo = true;
+#ifndef _WIN32
+        mkdir(ruta_arbol_binario, 0777);
+#else
+        CreateDirectoryA(ruta_arbol_binario, NULL);
+#endif
+    }
+
+    // Los cuerpos en paralelo son para un solo archivo; en el lote ya hay un hilo por archivo
+#ifndef _WIN32
+    cuerpos_en_paralelo = paralelo && !vigilar && !servidor && !por_lotes && archivos.num_rutas <= 1;
+    hilos_cuerpos = num_hilos;
+#endif
+
+    // El servidor responde siempre en JSON Lines y sin el arbol
+    if (servidor) {
+        formato_diagnosticos = FORMATO_JSONL;
+        omitir_arbol = true;
+    }
+    // Con SARIF los resultados de todos los archivos van en un solo documento
+    bool documento_sarif = formato_diagnosticos == FORMATO_SARIF && !vigilar;
+    if (documento_sarif) {
+        abrir_documento_sarif(stderr);
+    }
+    int resultado;
+    if (servidor) {
+        resultado = servir(ruta_socket);
+    } else if (vigilar) {
+        resultado = vigilar_archivo(archivos.num_rutas > 0 ? archivos.rutas[0] : "codigo_pascal.txt");
+    } else if (!por_lotes && archivos.num_rutas == 0) {
+        resultado = analizar_archivo_con_cache("codigo_pascal.txt");
+    } else if (!por_lotes && archivos.num_rutas == 1) {
+        resultado = analizar_archivo_con_cache(archivos.rutas[0]);
+    } else {
+        resultado = analizar_lote(&archivos, num_hilos);
+    }
+    if (documento_sarif) {
+        cerrar_documento_sarif(stderr);
+    }
+    if (directorio_cache) {
+        recortar_cache();
+    }
+    liberar_lista_archivos(&archivos);
+    liberar_traza();
+    liberar_buffer_lectura();
+    liberar_reservas(0);
+    acumular_metricas();
+    if (formato_metricas != METRICAS_NINGUNO) {
+        informar_metricas(stderr);
+    }
+    return resultado;
 }